@@ -0,0 +1,297 @@
+//
+//  Backend.h
+//  SPH
+//
+//  Created by Arthur Sun on 6/22/19.
+//  Copyright © 2019 Arthur Sun. All rights reserved.
+//
+
+#ifndef Backend_h
+#define Backend_h
+
+#include "common.h"
+
+#ifndef ParticleSystemInitialCapacity
+#define ParticleSystemInitialCapacity 1024
+#endif
+
+/// parameters of one scene, laid out like Scene in common.cl
+struct Scene
+{
+    vec2 gravity;
+    vec2 lowerBound;
+    vec2 upperBound;
+    
+    /// cells of the scene's grid, (0, 0) when hashing modulo the cell count
+    cl_int2 size;
+    
+    /// first cell of the scene's grid in the shared cell table
+    int offset;
+    
+    /// the scene steps dt * timeScale per substep
+    float timeScale;
+    
+    /// samples of the scene's signed distance field, fieldSpacing apart from lowerBound, positive where particles are free
+    cl_int2 fieldSize;
+    
+    /// first sample of the scene's field in the shared field buffer, -1 without obstacles
+    int field;
+    
+    /// first sample of the field of its sinks, on the same samples, -1 without sinks
+    int sink;
+    
+    float fieldSpacing;
+    
+    inline bool operator == (const Scene& s) const {
+        return memcmp(this, &s, sizeof(Scene)) == 0;
+    }
+};
+
+/// a nozzle as the backends see it, laid out like Nozzle in emit.cl
+struct Nozzle
+{
+    vec2 position;
+    vec2 velocity;
+    
+    /// from one particle of a row to the next, across the stream
+    vec2 spacing;
+    
+    /// particles per row, centred on position
+    int count;
+    
+    int scene;
+    
+    inline bool operator == (const Nozzle& n) const {
+        return memcmp(this, &n, sizeof(Nozzle)) == 0;
+    }
+};
+
+/// a row of particles a nozzle emits before one substep of a step, laid out like EmitRow in emit.cl
+struct EmitRow
+{
+    int nozzle;
+    int substep;
+    
+    /// where its first particle goes, counted from the particles there were when the substep started
+    int offset;
+    
+    /// of its first particle, the others follow
+    int firstId;
+    
+    /// time since it was due, in the scene's time, it starts that far downstream
+    float age;
+    
+    /// what is left of its particles' lifetime, INFINITY for ever
+    float life;
+};
+
+/**
+ * a lattice of particles lower + (x, y) * stride, x < columns and y < rows, that a backend appends
+ * where they are inside the convex shape and outside the obstacles of their scene, with ids from firstId
+ */
+struct EmitDesc
+{
+    /// counter-clockwise, with outward normals
+    const vec2* vertices;
+    const vec2* normals;
+    int vertexCount;
+    
+    vec2 lower;
+    float stride;
+    int columns;
+    int rows;
+    
+    vec2 velocity;
+    int scene;
+    int firstId;
+    
+    /// in the scene's time, INFINITY for ever
+    float lifetime;
+    
+    /// the most particles it may append
+    int limit;
+    
+    /// as the next step will pass them, the obstacles are read from the fields
+    const Scene* scenes;
+    int sceneCount;
+    const float* field;
+    int fieldLength;
+    int fieldVersion;
+};
+
+/// parts of a step that can be timed with profiling on
+enum Stage
+{
+    stage_hash,
+    stage_sort,
+    stage_reorder,
+    stage_list,
+    stage_solve,
+    stage_adder,
+    stage_count
+};
+
+inline const char* stage_name(int stage) {
+    static const char* const names[stage_count] = {"hash", "sort", "reorder", "list", "solve", "adder"};
+    return names[stage];
+}
+
+/// one frame of particle data, in storage order
+struct Readback
+{
+    int count;
+    
+    /// the step that wrote it, counting from 1 since the backend was initialized, 0 before the first
+    int step;
+    
+    const vec2* positions;
+    const vec2* velocities;
+    const int* ids;
+    
+    /// the scene of each particle
+    const int* sceneIds;
+    
+    /// what is left of each particle's lifetime, a particle at 0 or below is dead and not removed yet, NULL when none can die
+    const float* lifetimes;
+    
+    /// the largest speed and acceleration the adder saw over the step that wrote this frame, per unit of dt, so scaled by timeScale and its square
+    float maxSpeed;
+    float maxAcceleration;
+    
+    /// the share of particles the adder moved over that step, the rest slept
+    float activeFraction;
+    
+    /// the share of particles that changed cell between sorts over that step, 0 unless StepDesc::resortLimit is on
+    float movedFraction;
+};
+
+/// everything a step needs besides the particles themselves
+struct StepDesc
+{
+    /// of one substep
+    float dt;
+    
+    int its;
+    
+    /// with their grids already laid out in the cell table
+    const Scene* scenes;
+    
+    int sceneCount;
+    
+    /// slots in the cell table
+    int cells;
+    
+    /// the backend may build kernels with what stays fixed from step to step as constants, in the background
+    bool specialise;
+    
+    /// the rows the nozzles emit over the step, in the order of their substeps
+    const Nozzle* nozzles;
+    int nozzleCount;
+    const EmitRow* rows;
+    int rowCount;
+    
+    /// particles the rows add up to, so room for them can be made before the step
+    int emitted;
+    
+    /// some particle was given a lifetime or some scene a sink, so the adder keeps track of what dies
+    bool mortal;
+    
+    /// reorder particle data into cell order every this many substeps, 0 never does
+    int reorderInterval;
+    
+    /**
+     * above 0 the cells are sorted starting from the order of the last sort, only the particles that changed cell are sorted and merged back in,
+     * as long as at most this share of them did, otherwise they are sorted from scratch
+     */
+    float resortLimit;
+    
+    /**
+     * above 0 the solver walks per-particle lists of everything within D + skin, which is at most D,
+     * and the cells and lists are rebuilt only once a particle has moved skin / 2 since they were built
+     */
+    float skin;
+    
+    /// visit each pair once from the forward cells and apply it to both particles, where the backend can
+    bool symmetric;
+    
+    /// the samples of every scene's field, read again only when fieldVersion changes
+    const float* field;
+    int fieldLength;
+    int fieldVersion;
+    
+    /**
+     * above 0, cells where nothing moved faster than sleepSpeed or accelerated harder than sleepAcceleration,
+     * in them or next to them, for sleepSteps substeps are skipped until something moving comes next to them
+     * it needs the cells of every substep, so the lists leave it off
+     */
+    int sleepSteps;
+    float sleepSpeed;
+    float sleepAcceleration;
+};
+
+/**
+ * runs the simulation on some device
+ * ParticleSystem stages particles and scenes on the host and hands them to one of these
+ */
+class Backend
+{
+
+public:
+    
+    virtual ~Backend() {}
+    
+    virtual void initialize(float D, bool profiling) = 0;
+    
+    /// removes every particle
+    virtual void clear() = 0;
+    
+    /// appends n particles that live for lifetimes, in their scene's time, or for ever when it is NULL, the arrays can be reused as soon as it returns
+    virtual void add(const vec2* positions, const vec2* velocities, const int* ids, const int* sceneIds, const float* lifetimes, int n) = 0;
+    
+    /// appends the particles of desc's lattice that are inside its shape and returns how many, the arrays can be reused as soon as it returns
+    virtual int emit(const EmitDesc& desc) = 0;
+    
+    /**
+     * runs desc.its substeps, may return before they are done
+     * with desc.mortal, particles that outlive their lifetime or enter a sink stop moving and stop being anyone's neighbour,
+     * and are removed once the backend learns of it, by the next substep on the host and a step or two later on OpenCL
+     */
+    virtual void step(const StepDesc& desc) = 0;
+    
+    /// the newest frame that can be read without waiting on the step just started
+    virtual const Readback& latest() = 0;
+    
+    /// blocks until every step has run, then the particles as they are now, along with any added since the last step
+    virtual const Readback& current() = 0;
+    
+    /// dead particles count until they are removed
+    virtual int getCount() const = 0;
+    
+    virtual std::string getName() const = 0;
+    
+    /// neighbour candidates the solver visited from an aliased cell since the last call, needs COUNT_ALIASES
+    virtual int getAliasedCandidates() = 0;
+    
+    /// blocks until every step has run
+    virtual void finish() = 0;
+    
+    /// blocks until kernels being built for the last step are ready, the next step uses them
+    virtual void waitForKernels() = 0;
+    
+    /// fills times[stage_count] with the milliseconds each stage took since the last call, needs profiling
+    virtual void takeStageTimes(double* times) = 0;
+    
+    /// milliseconds the host spent blocked on the backend since the last call
+    virtual double takeWaitTime() = 0;
+    
+    /// substeps that rebuilt the cells since the last call
+    virtual int takeRebuilds() = 0;
+    
+    /// passes over the particles the sort took since the last call
+    virtual int takeSortPasses() = 0;
+    
+    /// neighbour candidates the density pass visited per particle and substep since the last call, needs COUNT_NEIGHBOURS
+    virtual double takeNeighbours() = 0;
+};
+
+#endif /* Backend_h */
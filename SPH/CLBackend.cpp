@@ -0,0 +1,1098 @@
+//
+//  CLBackend.cpp
+//  SPH
+//
+//  Created by Arthur Sun on 6/4/19.
+//  Copyright © 2019 Arthur Sun. All rights reserved.
+//
+
+#include "CLBackend.hpp"
+
+void CLBackend::radixPass(int p, int groups, cl_mem tail) {
+    int size = count;
+    int n = groups * RADIX_SIZE;
+    
+    size_t local = sortGroupSize;
+    size_t global = groups * local;
+    
+    clSetKernelArg(histogram, 0, sizeof(proxies), (void*)&proxies);
+    clSetKernelArg(histogram, 1, sizeof(histograms), (void*)&histograms);
+    clSetKernelArg(histogram, 2, sizeof(p), (void*)&p);
+    clSetKernelArg(histogram, 3, sizeof(size), (void*)&size);
+    clSetKernelArg(histogram, 4, sizeof(tail), (void*)&tail);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, histogram, 1, NULL, &global, &local, 0, NULL, profile(stage_sort)));
+    
+    clSetKernelArg(scanner, 0, sizeof(histograms), (void*)&histograms);
+    clSetKernelArg(scanner, 1, sizeof(n), (void*)&n);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, scanner, 1, NULL, &local, &local, 0, NULL, profile(stage_sort)));
+    
+    clSetKernelArg(scatter, 0, sizeof(proxies), (void*)&proxies);
+    clSetKernelArg(scatter, 1, sizeof(tempProxies), (void*)&tempProxies);
+    clSetKernelArg(scatter, 2, sizeof(histograms), (void*)&histograms);
+    clSetKernelArg(scatter, 3, sizeof(p), (void*)&p);
+    clSetKernelArg(scatter, 4, sizeof(size), (void*)&size);
+    clSetKernelArg(scatter, 5, sizeof(tail), (void*)&tail);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, scatter, 1, NULL, &global, &local, 0, NULL, profile(stage_sort)));
+    
+    std::swap(proxies, tempProxies);
+}
+
+void CLBackend::sortProxies() {
+    int groups = std::min((count + RADIX_GROUP_SIZE - 1) / RADIX_GROUP_SIZE, RADIX_MAX_GROUPS);
+    int passes = (hashBits + RADIX_BITS - 1) / RADIX_BITS;
+    
+    sortPasses += passes;
+    
+    /// the sorted proxies always end up in proxies, whatever the number of passes
+    for(int k = 0; k < passes; ++k)
+        radixPass(k * RADIX_BITS, groups, NULL);
+}
+
+void CLBackend::resortProxies(float limit) {
+    int groups = std::min((count + RADIX_GROUP_SIZE - 1) / RADIX_GROUP_SIZE, RADIX_MAX_GROUPS);
+    
+    /// a stable pass on the flag moves the proxies that changed cell behind the rest, which are still in order
+    radixPass(RESORT_SHIFT, groups, NULL);
+    
+    /// then only those are sorted, with the groups the most the limit lets through would need
+    int most = std::max((int)(limit * count), 1);
+    int tailGroups = std::min((most + RADIX_GROUP_SIZE - 1) / RADIX_GROUP_SIZE, RADIX_MAX_GROUPS);
+    int passes = (hashBits + RADIX_BITS - 1) / RADIX_BITS;
+    
+    for(int k = 0; k < passes; ++k)
+        radixPass(k * RADIX_BITS, tailGroups, resortState);
+    
+    /// passes on the tail leave what is before it in the other buffer, one more on the flag they all carry brings them together
+    if(passes % 2 == 1)
+        radixPass(RESORT_SHIFT, tailGroups, resortState);
+    
+    size_t size = count;
+    
+    clSetKernelArg(merge, 0, sizeof(proxies), (void*)&proxies);
+    clSetKernelArg(merge, 1, sizeof(tempProxies), (void*)&tempProxies);
+    clSetKernelArg(merge, 2, sizeof(count), (void*)&count);
+    clSetKernelArg(merge, 3, sizeof(resortState), (void*)&resortState);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, merge, 1, NULL, &size, NULL, 0, NULL, profile(stage_sort)));
+    
+    std::swap(proxies, tempProxies);
+    
+    sortPasses += 2;
+}
+
+void CLBackend::createProxies() {
+    size_t size = count;
+    
+    clSetKernelArg(hasher, 0, sizeof(positions_cl), (void*)&positions_cl);
+    clSetKernelArg(hasher, 1, sizeof(proxies), (void*)&proxies);
+    clSetKernelArg(hasher, 2, sizeof(diameter), (void*)&diameter);
+    clSetKernelArg(hasher, 3, sizeof(count), (void*)&count);
+    clSetKernelArg(hasher, 4, sizeof(cellCount), (void*)&cellCount);
+    clSetKernelArg(hasher, 5, sizeof(sceneTable), (void*)&sceneTable);
+    clSetKernelArg(hasher, 6, sizeof(sceneIds_cl), (void*)&sceneIds_cl);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, hasher, 1, NULL, &size, NULL, 0, NULL, profile(stage_hash)));
+}
+
+void CLBackend::rehashProxies(bool mark) {
+    size_t size = count;
+    int flag = mark;
+    
+    int zero = 0;
+    clEnqueueFillBuffer(queue, resortState, &zero, sizeof(zero), 0, sizeof(zero), 0, NULL, profile(stage_hash));
+    
+    clSetKernelArg(rehash, 0, sizeof(proxies), (void*)&proxies);
+    clSetKernelArg(rehash, 1, sizeof(positions_cl), (void*)&positions_cl);
+    clSetKernelArg(rehash, 2, sizeof(diameter), (void*)&diameter);
+    clSetKernelArg(rehash, 3, sizeof(count), (void*)&count);
+    clSetKernelArg(rehash, 4, sizeof(cellCount), (void*)&cellCount);
+    clSetKernelArg(rehash, 5, sizeof(sceneTable), (void*)&sceneTable);
+    clSetKernelArg(rehash, 6, sizeof(sceneIds_cl), (void*)&sceneIds_cl);
+    clSetKernelArg(rehash, 7, sizeof(resortState), (void*)&resortState);
+    clSetKernelArg(rehash, 8, sizeof(motion), (void*)&motion);
+    clSetKernelArg(rehash, 9, sizeof(flag), (void*)&flag);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, rehash, 1, NULL, &size, NULL, 0, NULL, profile(stage_hash)));
+    
+    ++rehashes;
+}
+
+void CLBackend::reorderParticles() {
+    size_t size = count;
+    
+    clSetKernelArg(reorder, 0, sizeof(proxies), (void*)&proxies);
+    clSetKernelArg(reorder, 1, sizeof(positions_cl), (void*)&positions_cl);
+    clSetKernelArg(reorder, 2, sizeof(velocities_cl), (void*)&velocities_cl);
+    clSetKernelArg(reorder, 3, sizeof(ids_cl), (void*)&ids_cl);
+    clSetKernelArg(reorder, 4, sizeof(sceneIds_cl), (void*)&sceneIds_cl);
+    clSetKernelArg(reorder, 5, sizeof(lifetimes_cl), (void*)&lifetimes_cl);
+    clSetKernelArg(reorder, 6, sizeof(tempPositions), (void*)&tempPositions);
+    clSetKernelArg(reorder, 7, sizeof(tempVelocities), (void*)&tempVelocities);
+    clSetKernelArg(reorder, 8, sizeof(tempIds), (void*)&tempIds);
+    clSetKernelArg(reorder, 9, sizeof(tempSceneIds), (void*)&tempSceneIds);
+    clSetKernelArg(reorder, 10, sizeof(tempLifetimes), (void*)&tempLifetimes);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, reorder, 1, NULL, &size, NULL, 0, NULL, profile(stage_reorder)));
+    
+    std::swap(positions_cl, tempPositions);
+    std::swap(velocities_cl, tempVelocities);
+    std::swap(ids_cl, tempIds);
+    std::swap(sceneIds_cl, tempSceneIds);
+    std::swap(lifetimes_cl, tempLifetimes);
+}
+
+void CLBackend::removeDead() {
+    if(deaths == removed)
+        return;
+    
+    int groups = std::min((count + RADIX_GROUP_SIZE - 1) / RADIX_GROUP_SIZE, RADIX_MAX_GROUPS);
+    
+    size_t local = sortGroupSize;
+    size_t global = groups * local;
+    
+    clSetKernelArg(tally, 0, sizeof(lifetimes_cl), (void*)&lifetimes_cl);
+    clSetKernelArg(tally, 1, sizeof(histograms), (void*)&histograms);
+    clSetKernelArg(tally, 2, sizeof(count), (void*)&count);
+    clSetKernelArg(tally, 3, sizeof(deathStep), (void*)&deathStep);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, tally, 1, NULL, &global, &local, 0, NULL, profile(stage_reorder)));
+    
+    clSetKernelArg(scanner, 0, sizeof(histograms), (void*)&histograms);
+    clSetKernelArg(scanner, 1, sizeof(groups), (void*)&groups);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, scanner, 1, NULL, &local, &local, 0, NULL, profile(stage_reorder)));
+    
+    clSetKernelArg(compactor, 0, sizeof(positions_cl), (void*)&positions_cl);
+    clSetKernelArg(compactor, 1, sizeof(velocities_cl), (void*)&velocities_cl);
+    clSetKernelArg(compactor, 2, sizeof(ids_cl), (void*)&ids_cl);
+    clSetKernelArg(compactor, 3, sizeof(sceneIds_cl), (void*)&sceneIds_cl);
+    clSetKernelArg(compactor, 4, sizeof(lifetimes_cl), (void*)&lifetimes_cl);
+    clSetKernelArg(compactor, 5, sizeof(tempPositions), (void*)&tempPositions);
+    clSetKernelArg(compactor, 6, sizeof(tempVelocities), (void*)&tempVelocities);
+    clSetKernelArg(compactor, 7, sizeof(tempIds), (void*)&tempIds);
+    clSetKernelArg(compactor, 8, sizeof(tempSceneIds), (void*)&tempSceneIds);
+    clSetKernelArg(compactor, 9, sizeof(tempLifetimes), (void*)&tempLifetimes);
+    clSetKernelArg(compactor, 10, sizeof(histograms), (void*)&histograms);
+    clSetKernelArg(compactor, 11, sizeof(count), (void*)&count);
+    clSetKernelArg(compactor, 12, sizeof(deathStep), (void*)&deathStep);
+    clSetKernelArg(compactor, 13, sizeof(motion), (void*)&motion);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, compactor, 1, NULL, &global, &local, 0, NULL, profile(stage_reorder)));
+    
+    std::swap(positions_cl, tempPositions);
+    std::swap(velocities_cl, tempVelocities);
+    std::swap(ids_cl, tempIds);
+    std::swap(sceneIds_cl, tempSceneIds);
+    std::swap(lifetimes_cl, tempLifetimes);
+    
+    /// exactly the deaths counted up to deathStep, so the new count is known without reading anything back
+    count -= deaths - removed;
+    removed = deaths;
+    survivors = count;
+    
+    listsValid = false;
+    proxiesSorted = false;
+}
+
+void CLBackend::settleCompleted() {
+    for(MappedReadback& r : readbacks) {
+        if(r.ready == NULL || r.settled)
+            continue;
+        
+        cl_int status;
+        clGetEventInfo(r.ready, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+        
+        if(status == CL_COMPLETE)
+            settle(r);
+    }
+}
+
+void CLBackend::toOffsetList() {
+    size_t size = count;
+    
+    /// empty cells must read as an empty range, not whatever a previous step left there
+    cl_int2 empty = {{0, 0}};
+    clEnqueueFillBuffer(queue, offsetList, &empty, sizeof(empty), 0, cellCount * sizeof(cl_int2), 0, NULL, profile(stage_list));
+    
+    clSetKernelArg(toList, 0, sizeof(proxies), (void*)&proxies);
+    clSetKernelArg(toList, 1, sizeof(offsetList), (void*)&offsetList);
+    clSetKernelArg(toList, 2, sizeof(count), (void*)&count);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, toList, 1, NULL, &size, NULL, 0, NULL, profile(stage_list)));
+}
+
+void CLBackend::solve(float dt, int sleepSteps) {
+    size_t size = round_up(count, densityGroupSize);
+    cl_mem lifetimes = mortal ? lifetimes_cl : NULL;
+    
+    clSetKernelArg(density, 0, sizeof(positions_cl), (void*)&positions_cl);
+    clSetKernelArg(density, 1, sizeof(proxies), (void*)&proxies);
+    clSetKernelArg(density, 2, sizeof(offsetList), (void*)&offsetList);
+    clSetKernelArg(density, 3, sizeof(count), (void*)&count);
+    clSetKernelArg(density, 4, sizeof(diameter), (void*)&diameter);
+    clSetKernelArg(density, 5, sizeof(dt), (void*)&dt);
+    clSetKernelArg(density, 6, sizeof(weights), (void*)&weights);
+    clSetKernelArg(density, 7, sizeof(cellCount), (void*)&cellCount);
+    clSetKernelArg(density, 8, sizeof(sceneTable), (void*)&sceneTable);
+    clSetKernelArg(density, 9, sizeof(sceneIds_cl), (void*)&sceneIds_cl);
+    clSetKernelArg(density, 10, sizeof(aliases), (void*)&aliases);
+    clSetKernelArg(density, 11, sizeof(activity), (void*)&activity);
+    clSetKernelArg(density, 12, sizeof(stamp), (void*)&stamp);
+    clSetKernelArg(density, 13, sizeof(sleepSteps), (void*)&sleepSteps);
+    clSetKernelArg(density, 14, sizeof(motion), (void*)&motion);
+    clSetKernelArg(density, 15, sizeof(lifetimes), (void*)&lifetimes);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, density, 1, NULL, &size, &densityGroupSize, 0, NULL, profile(stage_solve)));
+    
+    size = round_up(count, forceGroupSize);
+    
+    clSetKernelArg(force, 0, sizeof(velocities_cl), (void*)&velocities_cl);
+    clSetKernelArg(force, 1, sizeof(dt), (void*)&dt);
+    clSetKernelArg(force, 2, sizeof(positions_cl), (void*)&positions_cl);
+    clSetKernelArg(force, 3, sizeof(proxies), (void*)&proxies);
+    clSetKernelArg(force, 4, sizeof(offsetList), (void*)&offsetList);
+    clSetKernelArg(force, 5, sizeof(count), (void*)&count);
+    clSetKernelArg(force, 6, sizeof(diameter), (void*)&diameter);
+    clSetKernelArg(force, 7, sizeof(accelerations), (void*)&accelerations);
+    clSetKernelArg(force, 8, sizeof(weights), (void*)&weights);
+    clSetKernelArg(force, 9, sizeof(cellCount), (void*)&cellCount);
+    clSetKernelArg(force, 10, sizeof(sceneTable), (void*)&sceneTable);
+    clSetKernelArg(force, 11, sizeof(sceneIds_cl), (void*)&sceneIds_cl);
+    clSetKernelArg(force, 12, sizeof(aliases), (void*)&aliases);
+    clSetKernelArg(force, 13, sizeof(activity), (void*)&activity);
+    clSetKernelArg(force, 14, sizeof(stamp), (void*)&stamp);
+    clSetKernelArg(force, 15, sizeof(sleepSteps), (void*)&sleepSteps);
+    clSetKernelArg(force, 16, sizeof(lifetimes), (void*)&lifetimes);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, force, 1, NULL, &size, &forceGroupSize, 0, NULL, profile(stage_solve)));
+}
+
+bool CLBackend::listsExpired(float skin) {
+    if(!listsValid || skin != listSkin)
+        return true;
+    
+    cl_int state[2];
+    
+    nanosecond_type start = current_nanosecond;
+    
+    clEnqueueReadBuffer(queue, listState, CL_TRUE, 0, sizeof(state), state, 0, NULL, NULL);
+    
+    waitTime += std::chrono::duration<double, std::milli>(current_nanosecond - start).count();
+    
+    float moved;
+    memcpy(&moved, &state[0], sizeof(moved));
+    
+    return moved > 0.25f * skin * skin;
+}
+
+void CLBackend::buildLists(float skin) {
+    size_t size = count;
+    float R = diameter + skin;
+    cl_mem lifetimes = mortal ? lifetimes_cl : NULL;
+    
+    if(neighbourList == NULL)
+        createLists();
+    
+    for(;;) {
+        cl_int2 zero = {{0, 0}};
+        clEnqueueFillBuffer(queue, listState, &zero, sizeof(zero), 0, sizeof(zero), 0, NULL, NULL);
+        
+        clSetKernelArg(neighbours, 0, sizeof(positions_cl), (void*)&positions_cl);
+        clSetKernelArg(neighbours, 1, sizeof(proxies), (void*)&proxies);
+        clSetKernelArg(neighbours, 2, sizeof(offsetList), (void*)&offsetList);
+        clSetKernelArg(neighbours, 3, sizeof(count), (void*)&count);
+        clSetKernelArg(neighbours, 4, sizeof(diameter), (void*)&diameter);
+        clSetKernelArg(neighbours, 5, sizeof(R), (void*)&R);
+        clSetKernelArg(neighbours, 6, sizeof(cellCount), (void*)&cellCount);
+        clSetKernelArg(neighbours, 7, sizeof(sceneTable), (void*)&sceneTable);
+        clSetKernelArg(neighbours, 8, sizeof(sceneIds_cl), (void*)&sceneIds_cl);
+        clSetKernelArg(neighbours, 9, sizeof(neighbourList), (void*)&neighbourList);
+        clSetKernelArg(neighbours, 10, sizeof(neighbourCounts), (void*)&neighbourCounts);
+        clSetKernelArg(neighbours, 11, sizeof(neighbourCapacity), (void*)&neighbourCapacity);
+        clSetKernelArg(neighbours, 12, sizeof(listState), (void*)&listState);
+        clSetKernelArg(neighbours, 13, sizeof(lifetimes), (void*)&lifetimes);
+        
+        cl_check(clEnqueueNDRangeKernel(queue, neighbours, 1, NULL, &size, NULL, 0, NULL, profile(stage_list)));
+        
+        cl_int state[2];
+        
+        nanosecond_type start = current_nanosecond;
+        
+        clEnqueueReadBuffer(queue, listState, CL_TRUE, 0, sizeof(state), state, 0, NULL, NULL);
+        
+        waitTime += std::chrono::duration<double, std::milli>(current_nanosecond - start).count();
+        
+        if(state[1] <= neighbourCapacity)
+            break;
+        
+        /// a particle has more neighbours than fit, grow the lists and list them all again
+        while(neighbourCapacity < state[1])
+            neighbourCapacity *= 2;
+        
+        clReleaseMemObject(neighbourList);
+        neighbourList = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int) * neighbourCapacity * capacity, NULL, NULL);
+    }
+    
+    clEnqueueCopyBuffer(queue, positions_cl, anchors, 0, 0, count * sizeof(vec2), 0, NULL, profile(stage_list));
+    
+    listsValid = true;
+    listSkin = skin;
+}
+
+void CLBackend::solveLists(float dt) {
+    size_t size = round_up(count, densityGroupSize);
+    cl_mem lifetimes = mortal ? lifetimes_cl : NULL;
+    
+    clSetKernelArg(listDensity, 0, sizeof(positions_cl), (void*)&positions_cl);
+    clSetKernelArg(listDensity, 1, sizeof(neighbourList), (void*)&neighbourList);
+    clSetKernelArg(listDensity, 2, sizeof(neighbourCounts), (void*)&neighbourCounts);
+    clSetKernelArg(listDensity, 3, sizeof(neighbourCapacity), (void*)&neighbourCapacity);
+    clSetKernelArg(listDensity, 4, sizeof(count), (void*)&count);
+    clSetKernelArg(listDensity, 5, sizeof(diameter), (void*)&diameter);
+    clSetKernelArg(listDensity, 6, sizeof(dt), (void*)&dt);
+    clSetKernelArg(listDensity, 7, sizeof(weights), (void*)&weights);
+    clSetKernelArg(listDensity, 8, sizeof(sceneTable), (void*)&sceneTable);
+    clSetKernelArg(listDensity, 9, sizeof(sceneIds_cl), (void*)&sceneIds_cl);
+    clSetKernelArg(listDensity, 10, sizeof(motion), (void*)&motion);
+    clSetKernelArg(listDensity, 11, sizeof(lifetimes), (void*)&lifetimes);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, listDensity, 1, NULL, &size, &densityGroupSize, 0, NULL, profile(stage_solve)));
+    
+    size = round_up(count, forceGroupSize);
+    
+    clSetKernelArg(listForce, 0, sizeof(velocities_cl), (void*)&velocities_cl);
+    clSetKernelArg(listForce, 1, sizeof(dt), (void*)&dt);
+    clSetKernelArg(listForce, 2, sizeof(positions_cl), (void*)&positions_cl);
+    clSetKernelArg(listForce, 3, sizeof(neighbourList), (void*)&neighbourList);
+    clSetKernelArg(listForce, 4, sizeof(neighbourCounts), (void*)&neighbourCounts);
+    clSetKernelArg(listForce, 5, sizeof(neighbourCapacity), (void*)&neighbourCapacity);
+    clSetKernelArg(listForce, 6, sizeof(count), (void*)&count);
+    clSetKernelArg(listForce, 7, sizeof(diameter), (void*)&diameter);
+    clSetKernelArg(listForce, 8, sizeof(accelerations), (void*)&accelerations);
+    clSetKernelArg(listForce, 9, sizeof(weights), (void*)&weights);
+    clSetKernelArg(listForce, 10, sizeof(sceneTable), (void*)&sceneTable);
+    clSetKernelArg(listForce, 11, sizeof(sceneIds_cl), (void*)&sceneIds_cl);
+    clSetKernelArg(listForce, 12, sizeof(lifetimes), (void*)&lifetimes);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, listForce, 1, NULL, &size, &forceGroupSize, 0, NULL, profile(stage_solve)));
+}
+
+int CLBackend::getAliasedCandidates() {
+    int n = 0;
+    int zero = 0;
+    clEnqueueReadBuffer(queue, aliases, CL_TRUE, 0, sizeof(int), &n, 0, NULL, NULL);
+    clEnqueueWriteBuffer(queue, aliases, CL_TRUE, 0, sizeof(int), &zero, 0, NULL, NULL);
+    return n;
+}
+
+void CLBackend::takeStageTimes(double* times) {
+    /// nothing was recorded, so there is nothing to wait for
+    if(!profiling) {
+        std::fill(times, times + stage_count, 0.0);
+        return;
+    }
+    
+    finish();
+    
+    for(int s = 0; s < stage_count; ++s) {
+        times[s] = 0.0;
+        
+        for(cl_event e : stageEvents[s]) {
+            cl_ulong start = 0, end = 0;
+            clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+            clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+            times[s] += (end - start) * 1e-6;
+            clReleaseEvent(e);
+        }
+        
+        stageEvents[s].clear();
+    }
+}
+
+void CLBackend::finish() {
+    nanosecond_type start = current_nanosecond;
+    
+    clFinish(queue);
+    
+    waitTime += std::chrono::duration<double, std::milli>(current_nanosecond - start).count();
+}
+
+void CLBackend::initialize(float D, bool profiling) {
+    this->profiling = profiling;
+    count = 0;
+    waitTime = 0.0;
+    stepsSinceReorder = 0;
+    rebuilds = 0;
+    steps = 0;
+    mortal = false;
+    sortPasses = 0;
+    neighbourVisits = 0;
+    neighbourSamples = 0;
+    rehashes = 0;
+    movedFraction = 0.0f;
+    diameter = D;
+    
+    context = create_cl_context(CL_DEVICE_TYPE_CPU, &device);
+    
+    createMemObjs();
+    
+    queue = clCreateCommandQueue(context, device, profiling ? CL_QUEUE_PROFILING_ENABLE : 0, NULL);
+    
+    createReadbacks();
+    
+    programs.initialize(context, device);
+    
+    toList = programs.kernel("toList.cl", "toList");
+    histogram = programs.kernel("sort.cl", "histogram");
+    scanner = programs.kernel("sort.cl", "scan");
+    scatter = programs.kernel("sort.cl", "scatter");
+    reorder = programs.kernel("reorder.cl", "reorder");
+    settler = programs.kernel("solver.cl", "settle");
+    merge = programs.kernel("sort.cl", "merge");
+    tally = programs.kernel("sort.cl", "tally");
+    compactor = programs.kernel("sort.cl", "compact");
+    emitter = programs.kernel("emit.cl", "emit");
+    nozzler = programs.kernel("emit.cl", "nozzle");
+    
+    /// solver.cl is built here with no options, so the settler above comes from the same program
+    variants[""] = buildVariant("");
+    useVariant("");
+    
+    sortGroupSize = RADIX_GROUP_SIZE;
+    sortGroupSize = std::min(sortGroupSize, max_work_group_size(histogram, device));
+    sortGroupSize = std::min(sortGroupSize, max_work_group_size(scanner, device));
+    sortGroupSize = std::min(sortGroupSize, max_work_group_size(scatter, device));
+    sortGroupSize = std::min(sortGroupSize, max_work_group_size(tally, device));
+    sortGroupSize = std::min(sortGroupSize, max_work_group_size(compactor, device));
+    
+    settleGroupSize = pick_local_size(settler, device, SETTLE_GROUP_SIZE);
+}
+
+KernelVariant CLBackend::buildVariant(std::string options) {
+    KernelVariant v;
+    v.hasher = programs.kernel("hasher.cl", "hasher", options.c_str());
+    v.rehash = programs.kernel("hasher.cl", "rehash", options.c_str());
+    v.density = programs.kernel("solver.cl", "density", options.c_str());
+    v.force = programs.kernel("solver.cl", "force", options.c_str());
+    v.adder = programs.kernel("solver.cl", "adder", options.c_str());
+    v.neighbours = programs.kernel("solver.cl", "neighbours", options.c_str());
+    v.listDensity = programs.kernel("solver.cl", "listDensity", options.c_str());
+    v.listForce = programs.kernel("solver.cl", "listForce", options.c_str());
+    v.used = 0;
+    return v;
+}
+
+void CLBackend::releaseVariant(KernelVariant& v) {
+    cl_kernel kernels[] = {v.hasher, v.rehash, v.density, v.force, v.adder, v.neighbours, v.listDensity, v.listForce};
+    
+    for(cl_kernel k : kernels)
+        if(k != NULL)
+            clReleaseKernel(k);
+}
+
+std::string CLBackend::variantOptions(const StepDesc& desc) const {
+    if(!desc.specialise)
+        return "";
+    
+    /// hexadecimal, so the constant is exactly the diameter the arguments would have passed
+    char options[256];
+    int n = snprintf(options, sizeof(options), "-DPARTICLE_DIAMETER=%af", (double)diameter);
+    
+    if(desc.sceneCount == 1)
+        snprintf(options + n, sizeof(options) - n, " -DSINGLE_SCENE=1 -DSCENE_SIZE_X=%d -DSCENE_SIZE_Y=%d", desc.scenes[0].size.s[0], desc.scenes[0].size.s[1]);
+    
+    return options;
+}
+
+void CLBackend::collectVariant(bool wait) {
+    if(!pendingVariant.valid())
+        return;
+    
+    if(!wait && pendingVariant.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return;
+    
+    KernelVariant v = pendingVariant.get();
+    
+    if(!v.isValid()) {
+        releaseVariant(v);
+        failedVariants.insert(pendingOptions);
+        return;
+    }
+    
+    v.used = steps;
+    variants[pendingOptions] = v;
+    
+    /// the "" variant and the one running stay
+    while((int)variants.size() > KERNEL_VARIANTS + 1) {
+        auto oldest = variants.end();
+        
+        for(auto it = variants.begin(); it != variants.end(); ++it)
+            if(!it->first.empty() && it->first != activeVariant && it->first != pendingOptions && (oldest == variants.end() || it->second.used < oldest->second.used))
+                oldest = it;
+        
+        if(oldest == variants.end())
+            break;
+        
+        releaseVariant(oldest->second);
+        
+        /// its programs would otherwise stay cached for every grid size ever used
+        programs.release("hasher.cl", oldest->first.c_str());
+        programs.release("solver.cl", oldest->first.c_str());
+        variants.erase(oldest);
+    }
+}
+
+void CLBackend::selectVariant(const StepDesc& desc) {
+    collectVariant(false);
+    
+    std::string options = variantOptions(desc);
+    auto it = variants.find(options);
+    
+    if(it == variants.end()) {
+        if(!pendingVariant.valid() && failedVariants.count(options) == 0) {
+            pendingOptions = options;
+            pendingVariant = std::async(std::launch::async, &CLBackend::buildVariant, this, options);
+        }
+        
+        it = variants.find("");
+    }
+    
+    it->second.used = steps;
+    
+    if(it->first != activeVariant)
+        useVariant(it->first);
+}
+
+void CLBackend::useVariant(const std::string& options) {
+    const KernelVariant& v = variants[options];
+    
+    hasher = v.hasher;
+    rehash = v.rehash;
+    density = v.density;
+    force = v.force;
+    adder = v.adder;
+    neighbours = v.neighbours;
+    listDensity = v.listDensity;
+    listForce = v.listForce;
+    
+    densityGroupSize = pick_local_size(density, device, DENSITY_GROUP_SIZE);
+    forceGroupSize = pick_local_size(force, device, FORCE_GROUP_SIZE);
+    adderGroupSize = pick_local_size(adder, device, ADDER_GROUP_SIZE);
+    
+    activeVariant = options;
+}
+
+void CLBackend::destory_cl() {
+    /// the build still running uses the context
+    collectVariant(true);
+    
+    for(auto& v : variants)
+        releaseVariant(v.second);
+    
+    variants.clear();
+    failedVariants.clear();
+    activeVariant.clear();
+    
+    releaseReadbacks();
+    
+    for(std::vector<cl_event>& events : stageEvents) {
+        for(cl_event e : events)
+            clReleaseEvent(e);
+        events.clear();
+    }
+    
+    clReleaseContext(context);
+    
+    releaseMemObjs();
+    
+    clReleaseCommandQueue(queue);
+    
+    clReleaseKernel(toList);
+    clReleaseKernel(histogram);
+    clReleaseKernel(scanner);
+    clReleaseKernel(scatter);
+    clReleaseKernel(reorder);
+    clReleaseKernel(settler);
+    clReleaseKernel(merge);
+    clReleaseKernel(tally);
+    clReleaseKernel(compactor);
+    clReleaseKernel(emitter);
+    clReleaseKernel(nozzler);
+    
+    programs.release();
+}
+
+void CLBackend::emitRows(const StepDesc& desc, int k) {
+    int first = nextRow;
+    int n = 0;
+    int width = 0;
+    
+    for(; nextRow < desc.rowCount && desc.rows[nextRow].substep == k; ++nextRow) {
+        int c = desc.nozzles[desc.rows[nextRow].nozzle].count;
+        n += c;
+        width = std::max(width, c);
+    }
+    
+    if(n == 0)
+        return;
+    
+    int sleepSteps = desc.skin > 0.0f ? 0 : desc.sleepSteps;
+    size_t global[2] = {(size_t)width, (size_t)(nextRow - first)};
+    
+    clSetKernelArg(nozzler, 0, sizeof(positions_cl), (void*)&positions_cl);
+    clSetKernelArg(nozzler, 1, sizeof(velocities_cl), (void*)&velocities_cl);
+    clSetKernelArg(nozzler, 2, sizeof(ids_cl), (void*)&ids_cl);
+    clSetKernelArg(nozzler, 3, sizeof(sceneIds_cl), (void*)&sceneIds_cl);
+    clSetKernelArg(nozzler, 4, sizeof(lifetimes_cl), (void*)&lifetimes_cl);
+    clSetKernelArg(nozzler, 5, sizeof(nozzleTable), (void*)&nozzleTable);
+    clSetKernelArg(nozzler, 6, sizeof(rowTable), (void*)&rowTable);
+    clSetKernelArg(nozzler, 7, sizeof(first), (void*)&first);
+    clSetKernelArg(nozzler, 8, sizeof(count), (void*)&count);
+    clSetKernelArg(nozzler, 9, sizeof(diameter), (void*)&diameter);
+    clSetKernelArg(nozzler, 10, sizeof(cellCount), (void*)&cellCount);
+    clSetKernelArg(nozzler, 11, sizeof(sceneTable), (void*)&sceneTable);
+    clSetKernelArg(nozzler, 12, sizeof(activity), (void*)&activity);
+    clSetKernelArg(nozzler, 13, sizeof(stamp), (void*)&stamp);
+    clSetKernelArg(nozzler, 14, sizeof(sleepSteps), (void*)&sleepSteps);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, nozzler, 2, NULL, global, NULL, 0, NULL, NULL));
+    
+    /// the new particles are hashed from scratch with the rest, the cells around them were woken above
+    count += n;
+    listsValid = false;
+    proxiesSorted = false;
+}
+
+void CLBackend::substep(const StepDesc& desc, int k) {
+    float dt = desc.dt;
+    
+    resizeCells(desc.cells);
+    
+    bool lists = desc.skin > 0.0f;
+    
+    /// sleeping needs the cells of every substep, which the lists skip
+    int sleepSteps = lists ? 0 : desc.sleepSteps;
+    
+    ++stepsSinceReorder;
+    
+    if(sleepSteps > 0)
+        prepareActivity();
+    else
+        sleepReset = true;
+    
+    ++stamp;
+    
+    if(desc.rowCount > 0)
+        emitRows(desc, k);
+    
+    /// nothing to solve until the first row comes out
+    if(count == 0)
+        return;
+    
+    /// with lists the particles keep their order until the next rebuild, so reordering waits for it
+    if(!lists || listsExpired(desc.skin)) {
+        /// the proxies of the last sort are hashed again in place, and merged back while few enough changed cell
+        bool resort = desc.resortLimit > 0.0f && proxiesSorted;
+        bool incremental = resort && movedFraction <= desc.resortLimit;
+        
+        if(resort)
+            rehashProxies(incremental);
+        else
+            createProxies();
+        
+        if(incremental)
+            resortProxies(desc.resortLimit);
+        else
+            sortProxies();
+        
+        proxiesSorted = desc.resortLimit > 0.0f;
+        
+        if(desc.reorderInterval > 0 && stepsSinceReorder >= desc.reorderInterval) {
+            reorderParticles();
+            stepsSinceReorder = 0;
+        }
+        
+        toOffsetList();
+        
+        if(lists)
+            buildLists(desc.skin);
+        else
+            listsValid = false;
+        
+        ++rebuilds;
+    }
+    
+    if(lists)
+        solveLists(dt);
+    else
+        solve(dt, sleepSteps);
+    
+    cl_mem origins = lists ? anchors : NULL;
+    cl_mem lifetimes = mortal ? lifetimes_cl : NULL;
+    
+    /// the number readback() gives this step, what a particle that dies in it is marked with
+    int step = steps + 1;
+    
+    size_t size = round_up(count, adderGroupSize);
+    
+    clSetKernelArg(adder, 0, sizeof(velocities_cl), (void*)&velocities_cl);
+    clSetKernelArg(adder, 1, sizeof(positions_cl), (void*)&positions_cl);
+    clSetKernelArg(adder, 2, sizeof(accelerations), (void*)&accelerations);
+    clSetKernelArg(adder, 3, sizeof(dt), (void*)&dt);
+    clSetKernelArg(adder, 4, sizeof(diameter), (void*)&diameter);
+    clSetKernelArg(adder, 5, sizeof(count), (void*)&count);
+    clSetKernelArg(adder, 6, sizeof(sceneTable), (void*)&sceneTable);
+    clSetKernelArg(adder, 7, sizeof(sceneIds_cl), (void*)&sceneIds_cl);
+    clSetKernelArg(adder, 8, sizeof(origins), (void*)&origins);
+    clSetKernelArg(adder, 9, sizeof(listState), (void*)&listState);
+    clSetKernelArg(adder, 10, sizeof(motion), (void*)&motion);
+    clSetKernelArg(adder, 11, sizeof(fieldSamples), (void*)&fieldSamples);
+    clSetKernelArg(adder, 12, sizeof(cellCount), (void*)&cellCount);
+    clSetKernelArg(adder, 13, sizeof(activity), (void*)&activity);
+    clSetKernelArg(adder, 14, sizeof(marks), (void*)&marks);
+    clSetKernelArg(adder, 15, sizeof(stamp), (void*)&stamp);
+    clSetKernelArg(adder, 16, sizeof(sleepSteps), (void*)&sleepSteps);
+    clSetKernelArg(adder, 17, sizeof(desc.sleepSpeed), (void*)&desc.sleepSpeed);
+    clSetKernelArg(adder, 18, sizeof(desc.sleepAcceleration), (void*)&desc.sleepAcceleration);
+    clSetKernelArg(adder, 19, sizeof(lifetimes), (void*)&lifetimes);
+    clSetKernelArg(adder, 20, sizeof(step), (void*)&step);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, adder, 1, NULL, &size, &adderGroupSize, 0, NULL, profile(stage_adder)));
+    
+    if(sleepSteps > 0) {
+        size = round_up(cellCount, settleGroupSize);
+        
+        clSetKernelArg(settler, 0, sizeof(activity), (void*)&activity);
+        clSetKernelArg(settler, 1, sizeof(marks), (void*)&marks);
+        clSetKernelArg(settler, 2, sizeof(offsetList), (void*)&offsetList);
+        clSetKernelArg(settler, 3, sizeof(cellCount), (void*)&cellCount);
+        clSetKernelArg(settler, 4, sizeof(stamp), (void*)&stamp);
+        clSetKernelArg(settler, 5, sizeof(sleepSteps), (void*)&sleepSteps);
+        clSetKernelArg(settler, 6, sizeof(motion), (void*)&motion);
+        
+        cl_check(clEnqueueNDRangeKernel(queue, settler, 1, NULL, &size, &settleGroupSize, 0, NULL, profile(stage_adder)));
+    }
+}
+
+void CLBackend::reserve(int n) {
+    if(n <= capacity)
+        return;
+    
+    int c = capacity;
+    while(c < n)
+        c *= 2;
+    
+    capacity = std::min(c, MAX_PARTICLE_COUNT);
+    
+    releaseLists();
+    
+    positions_cl = resize(positions_cl, sizeof(vec2), count);
+    velocities_cl = resize(velocities_cl, sizeof(vec2), count);
+    ids_cl = resize(ids_cl, sizeof(int), count);
+    sceneIds_cl = resize(sceneIds_cl, sizeof(int), count);
+    lifetimes_cl = resize(lifetimes_cl, sizeof(float), count);
+    
+    /// the rest are rewritten every step, the proxies too once they are hashed from scratch
+    proxiesSorted = false;
+    proxies = resize(proxies, sizeof(Proxy), 0);
+    tempProxies = resize(tempProxies, sizeof(Proxy), 0);
+    weights = resize(weights, sizeof(float), 0);
+    accelerations = resize(accelerations, sizeof(vec2), 0);
+    tempPositions = resize(tempPositions, sizeof(vec2), 0);
+    tempVelocities = resize(tempVelocities, sizeof(vec2), 0);
+    tempIds = resize(tempIds, sizeof(int), 0);
+    tempSceneIds = resize(tempSceneIds, sizeof(int), 0);
+    tempLifetimes = resize(tempLifetimes, sizeof(float), 0);
+}
+
+void CLBackend::add(const vec2* positions, const vec2* velocities, const int* ids, const int* sceneIds, const float* lifetimes, int n) {
+    reserve(count + n);
+    
+    if(lifetimes != NULL) {
+        clEnqueueWriteBuffer(queue, lifetimes_cl, CL_FALSE, count * sizeof(float), n * sizeof(float), lifetimes, 0, NULL, NULL);
+        mortal = true;
+    }else{
+        float forever = INFINITY;
+        clEnqueueFillBuffer(queue, lifetimes_cl, &forever, sizeof(forever), count * sizeof(float), n * sizeof(float), 0, NULL, NULL);
+    }
+    
+    clEnqueueWriteBuffer(queue, positions_cl, CL_FALSE, count * sizeof(vec2), n * sizeof(vec2), positions, 0, NULL, NULL);
+    clEnqueueWriteBuffer(queue, velocities_cl, CL_FALSE, count * sizeof(vec2), n * sizeof(vec2), velocities, 0, NULL, NULL);
+    clEnqueueWriteBuffer(queue, ids_cl, CL_FALSE, count * sizeof(int), n * sizeof(int), ids, 0, NULL, NULL);
+    clEnqueueWriteBuffer(queue, sceneIds_cl, CL_TRUE, count * sizeof(int), n * sizeof(int), sceneIds, 0, NULL, NULL);
+    
+    count += n;
+    listsValid = false;
+    proxiesSorted = false;
+    sleepReset = true;
+}
+
+int CLBackend::emit(const EmitDesc& desc) {
+    uploadScenes(desc.scenes, desc.sceneCount);
+    uploadField(desc.field, desc.fieldLength, desc.fieldVersion);
+    
+    int lattice = desc.columns * desc.rows;
+    int limit = std::min(desc.limit, lattice);
+    
+    if(limit <= 0)
+        return 0;
+    
+    std::vector<vec2> data(desc.vertices, desc.vertices + desc.vertexCount);
+    data.insert(data.end(), desc.normals, desc.normals + desc.vertexCount);
+    
+    cl_mem shape = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(vec2) * data.size(), data.data(), NULL);
+    
+    reserve(count + limit);
+    
+    int zero = 0;
+    clEnqueueFillBuffer(queue, appended, &zero, sizeof(zero), 0, sizeof(zero), 0, NULL, NULL);
+    
+    size_t global[2] = {(size_t)desc.columns, (size_t)desc.rows};
+    
+    clSetKernelArg(emitter, 0, sizeof(positions_cl), (void*)&positions_cl);
+    clSetKernelArg(emitter, 1, sizeof(velocities_cl), (void*)&velocities_cl);
+    clSetKernelArg(emitter, 2, sizeof(ids_cl), (void*)&ids_cl);
+    clSetKernelArg(emitter, 3, sizeof(sceneIds_cl), (void*)&sceneIds_cl);
+    clSetKernelArg(emitter, 4, sizeof(lifetimes_cl), (void*)&lifetimes_cl);
+    clSetKernelArg(emitter, 5, sizeof(shape), (void*)&shape);
+    clSetKernelArg(emitter, 6, sizeof(desc.vertexCount), (void*)&desc.vertexCount);
+    clSetKernelArg(emitter, 7, sizeof(desc.lower), (void*)&desc.lower);
+    clSetKernelArg(emitter, 8, sizeof(desc.stride), (void*)&desc.stride);
+    clSetKernelArg(emitter, 9, sizeof(desc.velocity), (void*)&desc.velocity);
+    clSetKernelArg(emitter, 10, sizeof(desc.lifetime), (void*)&desc.lifetime);
+    clSetKernelArg(emitter, 11, sizeof(desc.scene), (void*)&desc.scene);
+    clSetKernelArg(emitter, 12, sizeof(count), (void*)&count);
+    clSetKernelArg(emitter, 13, sizeof(desc.firstId), (void*)&desc.firstId);
+    clSetKernelArg(emitter, 14, sizeof(limit), (void*)&limit);
+    clSetKernelArg(emitter, 15, sizeof(sceneTable), (void*)&sceneTable);
+    clSetKernelArg(emitter, 16, sizeof(fieldSamples), (void*)&fieldSamples);
+    clSetKernelArg(emitter, 17, sizeof(appended), (void*)&appended);
+    
+    cl_check(clEnqueueNDRangeKernel(queue, emitter, 2, NULL, global, NULL, 0, NULL, NULL));
+    
+    int n = 0;
+    
+    nanosecond_type start = current_nanosecond;
+    
+    /// the only thing that comes back, the particles stay on the device
+    clEnqueueReadBuffer(queue, appended, CL_TRUE, 0, sizeof(n), &n, 0, NULL, NULL);
+    
+    waitTime += std::chrono::duration<double, std::milli>(current_nanosecond - start).count();
+    
+    clReleaseMemObject(shape);
+    
+    n = std::min(n, limit);
+    
+    count += n;
+    listsValid = false;
+    proxiesSorted = false;
+    sleepReset = true;
+    
+    return n;
+}
+
+void CLBackend::clear() {
+    count = 0;
+    readbacks[0].count = 0;
+    readbacks[1].count = 0;
+    
+    /// deaths they counted were of the particles just cleared
+    readbacks[0].settled = true;
+    readbacks[1].settled = true;
+    stepsSinceReorder = 0;
+    releaseMemObjs();
+    createMemObjs();
+}
+
+void CLBackend::createReadbacks() {
+    for(MappedReadback& r : readbacks) {
+        r.buffer = NULL;
+        r.capacity = 0;
+        r.ready = NULL;
+        r.mapped = NULL;
+        r.count = 0;
+        r.step = 0;
+        r.positions = NULL;
+        r.velocities = NULL;
+        r.ids = NULL;
+        r.sceneIds = NULL;
+        r.lifetimes = NULL;
+        r.motion = NULL;
+        r.substeps = 0;
+        r.rehashes = 0;
+        r.survivors = -1;
+        r.settled = false;
+        r.maxSpeed = 0.0f;
+        r.maxAcceleration = 0.0f;
+        r.activeFraction = 1.0f;
+        r.movedFraction = 0.0f;
+    }
+    
+    nextReadback = 0;
+}
+
+void CLBackend::releaseReadbacks() {
+    for(MappedReadback& r : readbacks) {
+        if(r.mapped != NULL)
+            clEnqueueUnmapMemObject(queue, r.buffer, r.mapped, 0, NULL, NULL);
+        
+        if(r.ready != NULL)
+            clReleaseEvent(r.ready);
+    }
+    
+    clFinish(queue);
+    
+    for(MappedReadback& r : readbacks)
+        if(r.buffer != NULL)
+            clReleaseMemObject(r.buffer);
+}
+
+void CLBackend::readback(int substeps) {
+    MappedReadback& r = readbacks[nextReadback];
+    
+    /// the renderer is done with this one, it has been reading the other since the last step
+    if(r.mapped != NULL)
+        clEnqueueUnmapMemObject(queue, r.buffer, r.mapped, 0, NULL, NULL);
+    
+    if(r.ready != NULL)
+        clReleaseEvent(r.ready);
+    
+    if(r.capacity < count) {
+        if(r.buffer != NULL)
+            clReleaseMemObject(r.buffer);
+        
+        r.capacity = capacity;
+        r.buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, (2 * sizeof(vec2) + 2 * sizeof(int) + sizeof(float)) * r.capacity + sizeof(cl_int8), NULL, NULL);
+    }
+    
+    size_t p = count * sizeof(vec2);
+    size_t v = r.capacity * sizeof(vec2);
+    size_t d = 2 * v;
+    size_t s = d + r.capacity * sizeof(int);
+    size_t l = s + r.capacity * sizeof(int);
+    size_t m = l + r.capacity * sizeof(float);
+    
+    clEnqueueCopyBuffer(queue, positions_cl, r.buffer, 0, 0, p, 0, NULL, NULL);
+    clEnqueueCopyBuffer(queue, velocities_cl, r.buffer, 0, v, p, 0, NULL, NULL);
+    clEnqueueCopyBuffer(queue, ids_cl, r.buffer, 0, d, count * sizeof(int), 0, NULL, NULL);
+    clEnqueueCopyBuffer(queue, sceneIds_cl, r.buffer, 0, s, count * sizeof(int), 0, NULL, NULL);
+    
+    /// only something that can die needs them, the dead are not removed until a later step
+    if(mortal)
+        clEnqueueCopyBuffer(queue, lifetimes_cl, r.buffer, 0, l, count * sizeof(float), 0, NULL, NULL);
+    
+    clEnqueueCopyBuffer(queue, motion, r.buffer, 0, m, sizeof(cl_int8), 0, NULL, NULL);
+    
+    /// the next step starts its own maximum and counts, the deaths keep adding up
+    cl_int zero = 0;
+    clEnqueueFillBuffer(queue, motion, &zero, sizeof(zero), 0, 5 * sizeof(zero), 0, NULL, NULL);
+    
+    char* mapped = (char*)clEnqueueMapBuffer(queue, r.buffer, CL_FALSE, CL_MAP_READ, 0, m + sizeof(cl_int8), 0, NULL, &r.ready, NULL);
+    
+    r.mapped = mapped;
+    r.count = count;
+    r.positions = (const vec2*)mapped;
+    r.velocities = (const vec2*)(mapped + v);
+    r.ids = (const int*)(mapped + d);
+    r.sceneIds = (const int*)(mapped + s);
+    r.lifetimes = mortal ? (const float*)(mapped + l) : NULL;
+    r.motion = (const cl_int*)(mapped + m);
+    r.substeps = substeps;
+    r.rehashes = rehashes;
+    r.survivors = survivors;
+    r.movedFraction = 0.0f;
+    r.settled = false;
+    r.step = substeps > 0 ? ++steps : steps;
+    
+    rehashes = 0;
+    
+    clFlush(queue);
+    
+    nextReadback ^= 1;
+}
+
+const Readback& CLBackend::latest() {
+    MappedReadback& newest = readbacks[nextReadback ^ 1];
+    MappedReadback& older = readbacks[nextReadback];
+    
+    if(newest.ready == NULL)
+        return newest;
+    
+    cl_int status;
+    clGetEventInfo(newest.ready, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+    
+    if(status == CL_COMPLETE)
+        return settle(newest);
+    
+    if(older.ready == NULL)
+        return newest;
+    
+    nanosecond_type start = current_nanosecond;
+    
+    clWaitForEvents(1, &older.ready);
+    
+    waitTime += std::chrono::duration<double, std::milli>(current_nanosecond - start).count();
+    
+    return settle(older);
+}
+
+const Readback& CLBackend::current() {
+    finish();
+    
+    MappedReadback& newest = readbacks[nextReadback ^ 1];
+    
+    if(newest.ready != NULL)
+        settle(newest);
+    
+    /// every step has run, so every death has been counted
+    removeDead();
+    
+    if(newest.count == count)
+        return newest;
+    
+    float speed = newest.maxSpeed;
+    float acceleration = newest.maxAcceleration;
+    float active = newest.activeFraction;
+    float changed = newest.movedFraction;
+    
+    /// nothing ran since the last readback, so the motion buffer is still clear
+    readback(0);
+    finish();
+    
+    MappedReadback& r = readbacks[nextReadback ^ 1];
+    r.maxSpeed = speed;
+    r.maxAcceleration = acceleration;
+    r.activeFraction = active;
+    r.movedFraction = changed;
+    return r;
+}
+
+void CLBackend::step(const StepDesc& desc) {
+    mortal = desc.mortal;
+    settleCompleted();
+    removeDead();
+    selectVariant(desc);
+    uploadScenes(desc.scenes, desc.sceneCount);
+    uploadField(desc.field, desc.fieldLength, desc.fieldVersion);
+    uploadNozzles(desc.nozzles, desc.nozzleCount);
+    
+    /// every row is known before the step, so no substep waits to learn how many particles there are
+    reserve(count + desc.emitted);
+    
+    rowTable = desc.rowCount > 0 ? clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(EmitRow) * desc.rowCount, (void*)desc.rows, NULL) : NULL;
+    nextRow = 0;
+    
+    for(int i = 0; i < desc.its; ++i)
+        substep(desc, i);
+    
+    /// the kernels that read it keep it alive until they are done
+    if(rowTable != NULL)
+        clReleaseMemObject(rowTable);
+    
+    rowTable = NULL;
+    
+    readback(desc.its);
+}
@@ -0,0 +1,671 @@
+//
+//  CLBackend.hpp
+//  SPH
+//
+//  Created by Arthur Sun on 6/22/19.
+//  Copyright © 2019 Arthur Sun. All rights reserved.
+//
+
+#ifndef CLBackend_hpp
+#define CLBackend_hpp
+
+#include <future>
+#include <set>
+#include "Backend.h"
+#include "ProgramCache.hpp"
+
+struct Proxy
+{
+    int index;
+    int hash;
+};
+
+/// a frame read back into pinned host memory
+struct MappedReadback : Readback
+{
+    cl_mem buffer;
+    cl_event ready;
+    void* mapped;
+    
+    /// particles the buffer has room for
+    int capacity;
+    
+    /// the motion buffer, copied in after the particles
+    const cl_int* motion;
+    
+    /// of the step that filled it
+    int substeps;
+    
+    /// substeps of that step that hashed the proxies again from the last sort
+    int rehashes;
+    
+    /// what the last compaction before it should have left, -1 if there was none
+    int survivors;
+    
+    /// its motion has been read, and its neighbour count added up
+    bool settled;
+};
+
+/// the kernels built with constants for the diameter and the scenes, one per set of build options
+struct KernelVariant
+{
+    cl_kernel hasher;
+    cl_kernel rehash;
+    cl_kernel density;
+    cl_kernel force;
+    cl_kernel adder;
+    cl_kernel neighbours;
+    cl_kernel listDensity;
+    cl_kernel listForce;
+    
+    /// the step that last picked it, the one picked longest ago leaves a full cache first
+    int used;
+    
+    inline bool isValid() const {
+        return hasher != NULL && rehash != NULL && density != NULL && force != NULL && adder != NULL && neighbours != NULL && listDensity != NULL && listForce != NULL;
+    }
+};
+
+/// runs the kernels on an OpenCL device
+class CLBackend : public Backend
+{
+    cl_kernel hasher;
+    cl_kernel toList;
+    cl_kernel histogram;
+    cl_kernel scanner;
+    cl_kernel scatter;
+    cl_kernel density;
+    cl_kernel force;
+    cl_kernel adder;
+    cl_kernel reorder;
+    cl_kernel neighbours;
+    cl_kernel listDensity;
+    cl_kernel listForce;
+    cl_kernel settler;
+    cl_kernel rehash;
+    cl_kernel merge;
+    cl_kernel emitter;
+    cl_kernel nozzler;
+    cl_kernel tally;
+    cl_kernel compactor;
+    
+    /// every .cl file is built once, all its kernels come from the same program
+    ProgramCache programs;
+    
+    /// by build options, "" takes everything as arguments and can run any step
+    std::map<std::string, KernelVariant> variants;
+    
+    /// the options of the variant hasher, rehash and the solver kernels come from
+    std::string activeVariant;
+    
+    /// the variant being built on another thread, at most one at a time
+    std::future<KernelVariant> pendingVariant;
+    std::string pendingOptions;
+    
+    /// options that did not build, they are not tried again
+    std::set<std::string> failedVariants;
+    
+    cl_context context;
+    cl_device_id device;
+    
+    cl_mem proxies;
+    cl_mem tempProxies;
+    cl_mem offsetList;
+    cl_mem histograms;
+    cl_mem aliases;
+    cl_mem accelerations;
+    cl_mem weights;
+    
+    cl_mem positions_cl;
+    cl_mem velocities_cl;
+    cl_mem ids_cl;
+    cl_mem sceneIds_cl;
+    
+    /// what is left of each particle's lifetime, INFINITY for ever, -step once it died in that step
+    cl_mem lifetimes_cl;
+    
+    cl_mem tempPositions;
+    cl_mem tempVelocities;
+    cl_mem tempIds;
+    cl_mem tempSceneIds;
+    cl_mem tempLifetimes;
+    
+    /// the scenes as the kernels last saw them
+    cl_mem sceneTable;
+    
+    /// the signed distance samples of every scene with obstacles, NULL without any
+    cl_mem fieldSamples;
+    
+    /// the nozzles as the kernels last saw them, NULL without any
+    cl_mem nozzleTable;
+    
+    /// the rows of the step being enqueued, and the first of them the next substep emits
+    cl_mem rowTable;
+    int nextRow;
+    
+    /// the particles an emit() appended, read back once it is done
+    cl_mem appended;
+    
+    /// neighbourCapacity entries per particle, created the first time a step asks for lists
+    cl_mem neighbourList;
+    cl_mem neighbourCounts;
+    
+    /// where the particles were when the lists were built
+    cl_mem anchors;
+    
+    /// the furthest any particle moved from its anchor, squared, and the longest list that did not fit
+    cl_mem listState;
+    
+    /**
+     * the largest squared speed and acceleration since the last readback, as float bits, then the particles that slept through a substep,
+     * the neighbour candidates the density pass visited, with COUNT_NEIGHBOURS, and the particles that changed cell at a rehash
+     * motion[5] counts the particles that ever died and motion[6] holds the survivors of the last compaction, the readbacks leave both alone
+     */
+    cl_mem motion;
+    
+    /// the particles that changed cell at the rehash of the current substep, the tail the re-sort sorts
+    cl_mem resortState;
+    
+    /// per cell slot, the last substep something moved in or next to it, and what the adder marked in the current one
+    cl_mem activity;
+    cl_mem marks;
+    
+    /// slots activity and marks have room for
+    int activityCapacity;
+    
+    /// counts substeps, what activity holds
+    int stamp;
+    
+    /// activity no longer fits the particles or the cells, every slot starts awake again
+    bool sleepReset;
+    
+    cl_command_queue queue;
+    
+    /// what sceneTable holds
+    std::vector<Scene> uploadedScenes;
+    
+    /// what nozzleTable holds
+    std::vector<Nozzle> uploadedNozzles;
+    
+    /// the StepDesc::fieldVersion fieldSamples holds
+    int fieldVersion;
+    
+    /// frames alternate between the two, the renderer reads one while the other is being filled
+    MappedReadback readbacks[2];
+    
+    /// the readback the next step fills
+    int nextReadback;
+    
+    /// particles that died up to deathStep as far as the settled readbacks tell, and those of them removed
+    int deaths;
+    int deathStep;
+    int removed;
+    
+    /// the particles the last removeDead() left, -1 before the first
+    int survivors;
+    
+    /// StepDesc::mortal of the current step, the neighbour passes skip the dead and the readbacks take the lifetimes
+    bool mortal;
+    
+    float diameter;
+    
+    int count;
+    
+    /// particles the per-particle buffers can hold, grows geometrically
+    int capacity;
+    
+    /// substeps since the particles were last reordered
+    int stepsSinceReorder;
+    
+    /// milliseconds the host spent blocked on the queue
+    double waitTime;
+    
+    int neighbourCapacity;
+    
+    /// the lists were built with listSkin and nothing has been added since
+    bool listsValid;
+    
+    float listSkin;
+    
+    /// substeps that rebuilt the cells since the last takeRebuilds()
+    int rebuilds;
+    
+    /// steps read back since initialize()
+    int steps;
+    
+    /// radix passes since the last takeSortPasses()
+    int sortPasses;
+    
+    /// neighbour candidates the settled readbacks counted since the last takeNeighbours(), and the particle substeps they counted them over
+    long neighbourVisits;
+    long neighbourSamples;
+    
+    /// proxies holds the sorted order of the last substep with the hashes it was sorted by, nothing was added and no cell or scene changed since
+    bool proxiesSorted;
+    
+    /// substeps since the last readback that hashed the proxies again
+    int rehashes;
+    
+    /// Readback::movedFraction of the newest settled readback, whether the next substeps re-sort or sort from scratch
+    float movedFraction;
+    
+    bool profiling;
+    
+    /// events of every command enqueued since the last takeStageTimes(), by stage
+    std::vector<cl_event> stageEvents[stage_count];
+    
+    /// where the next command of a stage records its event, NULL unless profiling
+    inline cl_event* profile(int stage) {
+        if(!profiling)
+            return NULL;
+        
+        stageEvents[stage].push_back(NULL);
+        return &stageEvents[stage].back();
+    }
+    
+    /// cells in the hash table, offsetList holds a (start, end) pair for each
+    int cellCount;
+    
+    int cellCapacity;
+    
+    /// bits needed to hold any hash, decides the number of radix passes
+    int hashBits;
+    
+    size_t sortGroupSize;
+    size_t densityGroupSize;
+    size_t forceGroupSize;
+    size_t adderGroupSize;
+    size_t settleGroupSize;
+    
+    inline void releaseMemObjs() {
+        clReleaseMemObject(proxies);
+        clReleaseMemObject(tempProxies);
+        clReleaseMemObject(offsetList);
+        clReleaseMemObject(histograms);
+        clReleaseMemObject(aliases);
+        clReleaseMemObject(weights);
+        
+        clReleaseMemObject(positions_cl);
+        clReleaseMemObject(velocities_cl);
+        clReleaseMemObject(ids_cl);
+        clReleaseMemObject(sceneIds_cl);
+        clReleaseMemObject(lifetimes_cl);
+        clReleaseMemObject(accelerations);
+        
+        clReleaseMemObject(tempPositions);
+        clReleaseMemObject(tempVelocities);
+        clReleaseMemObject(tempIds);
+        clReleaseMemObject(tempSceneIds);
+        clReleaseMemObject(tempLifetimes);
+        
+        clReleaseMemObject(listState);
+        clReleaseMemObject(motion);
+        clReleaseMemObject(resortState);
+        clReleaseMemObject(appended);
+        
+        if(activity != NULL) {
+            clReleaseMemObject(activity);
+            clReleaseMemObject(marks);
+        }
+        
+        if(sceneTable != NULL)
+            clReleaseMemObject(sceneTable);
+        
+        if(fieldSamples != NULL)
+            clReleaseMemObject(fieldSamples);
+        
+        if(nozzleTable != NULL)
+            clReleaseMemObject(nozzleTable);
+        
+        releaseLists();
+    }
+    
+    inline void releaseLists() {
+        if(neighbourList != NULL) {
+            clReleaseMemObject(neighbourList);
+            clReleaseMemObject(neighbourCounts);
+            clReleaseMemObject(anchors);
+        }
+        
+        neighbourList = NULL;
+        listsValid = false;
+    }
+    
+    /// sized for the particle capacity, so the lists go whenever that grows
+    inline void createLists() {
+        neighbourList = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int) * neighbourCapacity * capacity, NULL, NULL);
+        neighbourCounts = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int) * capacity, NULL, NULL);
+        anchors = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(vec2) * capacity, NULL, NULL);
+    }
+    
+    inline void createMemObjs() {
+        capacity = ParticleSystemInitialCapacity;
+        
+        proxies = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(Proxy) * capacity, NULL, NULL);
+        tempProxies = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(Proxy) * capacity, NULL, NULL);
+        cellCapacity = MIN_CELL_COUNT;
+        cellCount = 0;
+        offsetList = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int2) * cellCapacity, NULL, NULL);
+        histograms = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * RADIX_SIZE * RADIX_MAX_GROUPS, NULL, NULL);
+        
+        int zero = 0;
+        aliases = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(int), &zero, NULL);
+        weights = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * capacity, NULL, NULL);
+        
+        positions_cl = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(vec2) * capacity, NULL, NULL);
+        velocities_cl = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(vec2) * capacity, NULL, NULL);
+        ids_cl = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int) * capacity, NULL, NULL);
+        sceneIds_cl = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int) * capacity, NULL, NULL);
+        lifetimes_cl = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * capacity, NULL, NULL);
+        accelerations = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(vec2) * capacity, NULL, NULL);
+        
+        tempPositions = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(vec2) * capacity, NULL, NULL);
+        tempVelocities = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(vec2) * capacity, NULL, NULL);
+        tempIds = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int) * capacity, NULL, NULL);
+        tempSceneIds = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int) * capacity, NULL, NULL);
+        tempLifetimes = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * capacity, NULL, NULL);
+        
+        cl_int2 state = {{0, 0}};
+        listState = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(state), &state, NULL);
+        
+        cl_int8 moved = {{0, 0, 0, 0, 0, 0, 0, 0}};
+        motion = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(moved), &moved, NULL);
+        deaths = 0;
+        deathStep = 0;
+        removed = 0;
+        survivors = -1;
+        
+        resortState = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(zero), &zero, NULL);
+        proxiesSorted = false;
+        
+        appended = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(zero), &zero, NULL);
+        
+        activity = NULL;
+        marks = NULL;
+        activityCapacity = 0;
+        stamp = 0;
+        sleepReset = true;
+        
+        sceneTable = NULL;
+        uploadedScenes.clear();
+        
+        fieldSamples = NULL;
+        fieldVersion = -1;
+        
+        nozzleTable = NULL;
+        uploadedNozzles.clear();
+        rowTable = NULL;
+        
+        neighbourList = NULL;
+        neighbourCapacity = NEIGHBOUR_CAPACITY;
+        listsValid = false;
+    }
+    
+    /// a buffer for capacity elements of size bytes, holding the first keep elements of buffer, which is released
+    inline cl_mem resize(cl_mem buffer, size_t size, int keep) {
+        cl_mem b = clCreateBuffer(context, CL_MEM_READ_WRITE, size * capacity, NULL, NULL);
+        
+        if(keep > 0)
+            clEnqueueCopyBuffer(queue, buffer, b, 0, 0, size * keep, 0, NULL, NULL);
+        
+        clReleaseMemObject(buffer);
+        return b;
+    }
+    
+    /// grows the per-particle buffers to hold at least n particles
+    void reserve(int n);
+    
+    /// grows offsetList to n cells, the radix sort covers hashes below n
+    inline void resizeCells(int n) {
+        if(n > cellCapacity) {
+            clReleaseMemObject(offsetList);
+            cellCapacity = n;
+            offsetList = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int2) * cellCapacity, NULL, NULL);
+        }
+        
+        if(n != cellCount) {
+            listsValid = false;
+            proxiesSorted = false;
+            sleepReset = true;
+        }
+        
+        cellCount = n;
+        hashBits = bit_width(cellCount - 1);
+    }
+    
+    /// sizes activity to the cell table, and wakes every slot if the particles or the cells changed
+    inline void prepareActivity() {
+        if(activityCapacity < cellCapacity) {
+            if(activity != NULL) {
+                clReleaseMemObject(activity);
+                clReleaseMemObject(marks);
+            }
+            
+            activityCapacity = cellCapacity;
+            activity = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int) * activityCapacity, NULL, NULL);
+            marks = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int) * activityCapacity, NULL, NULL);
+            sleepReset = true;
+        }
+        
+        if(sleepReset) {
+            int zero = 0;
+            clEnqueueFillBuffer(queue, activity, &stamp, sizeof(stamp), 0, sizeof(int) * cellCount, 0, NULL, NULL);
+            clEnqueueFillBuffer(queue, marks, &zero, sizeof(zero), 0, sizeof(int) * cellCount, 0, NULL, NULL);
+            sleepReset = false;
+        }
+    }
+    
+    /// a new buffer rather than a write, so the host copy is free to change while steps are in flight
+    inline void uploadScenes(const Scene* scenes, int n) {
+        if((int)uploadedScenes.size() == n && std::equal(scenes, scenes + n, uploadedScenes.begin()))
+            return;
+        
+        if(sceneTable != NULL)
+            clReleaseMemObject(sceneTable);
+        
+        sceneTable = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(Scene) * n, (void*)scenes, NULL);
+        uploadedScenes.assign(scenes, scenes + n);
+        listsValid = false;
+        proxiesSorted = false;
+    }
+    
+    inline void uploadField(const float* field, int n, int version) {
+        if(version == fieldVersion)
+            return;
+        
+        if(fieldSamples != NULL)
+            clReleaseMemObject(fieldSamples);
+        
+        fieldSamples = n > 0 ? clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * n, (void*)field, NULL) : NULL;
+        fieldVersion = version;
+    }
+    
+    inline void uploadNozzles(const Nozzle* nozzles, int n) {
+        if((int)uploadedNozzles.size() == n && std::equal(nozzles, nozzles + n, uploadedNozzles.begin()))
+            return;
+        
+        if(nozzleTable != NULL)
+            clReleaseMemObject(nozzleTable);
+        
+        nozzleTable = n > 0 ? clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(Nozzle) * n, (void*)nozzles, NULL) : NULL;
+        uploadedNozzles.assign(nozzles, nozzles + n);
+    }
+    
+    void destory_cl();
+    
+    /// called from the thread building it, the kernels are NULL where the program did not build
+    KernelVariant buildVariant(std::string options);
+    
+    void releaseVariant(KernelVariant& v);
+    
+    /// the options that turn what desc fixes into constants, "" unless desc.specialise
+    std::string variantOptions(const StepDesc& desc) const;
+    
+    /// moves a finished build into the cache, with wait it waits for one still running
+    void collectVariant(bool wait);
+    
+    /**
+     * points the kernels at the variant built for desc, without waiting for it
+     * until it is built the "" variant runs, since a variant for other options could be wrong for desc
+     */
+    void selectVariant(const StepDesc& desc);
+    
+    void useVariant(const std::string& options);
+    
+    void createProxies();
+    
+    /// hashes the proxies again where the last sort left them, with mark the ones that changed cell carry RESORT_FLAG
+    void rehashProxies(bool mark);
+    
+    /// one stable pass on the bits of the hash from p, over the last resortState proxies when tail is not NULL
+    void radixPass(int p, int groups, cl_mem tail);
+    
+    void sortProxies();
+    
+    /// sorts the marked proxies on their own and merges them back into the rest, sized for at most limit of them
+    void resortProxies(float limit);
+    
+    void reorderParticles();
+    
+    void toOffsetList();
+    
+    /// skips the particles of slots that sleep when sleepSteps is above 0
+    void solve(float dt, int sleepSteps);
+    
+    /// waits for the last adder and tells whether a particle moved far enough that the lists may miss a neighbour
+    bool listsExpired(float skin);
+    
+    /// lists the neighbours within D + skin from the cells just built, waits to see that they all fit
+    void buildLists(float skin);
+    
+    void solveLists(float dt);
+    
+    /// appends the rows of desc the k-th substep emits, before anything is hashed
+    void emitRows(const StepDesc& desc, int k);
+    
+    /// settles the readbacks that have completed, without waiting on the others
+    void settleCompleted();
+    
+    /// removes the particles the settled readbacks counted as dead, the rest of the dead stay where they stopped
+    void removeDead();
+    
+    /// enqueues the k-th substep of desc, nothing waits on it
+    void substep(const StepDesc& desc, int k);
+    
+    /// copies the particles into the next readback buffer without waiting on them
+    void readback(int substeps);
+    
+    void createReadbacks();
+    
+    void releaseReadbacks();
+    
+    /// fills in the motion of a readback that has completed
+    inline const Readback& settle(MappedReadback& r) {
+        /// no step filled it, it keeps the motion it was given
+        if(r.substeps == 0 || r.settled)
+            return r;
+        
+        float moved[2];
+        memcpy(moved, r.motion, sizeof(moved));
+        
+        r.maxSpeed = sqrtf(moved[0]);
+        r.maxAcceleration = sqrtf(moved[1]);
+        r.activeFraction = r.count > 0 ? 1.0f - r.motion[2] / ((float)r.count * r.substeps) : 1.0f;
+        
+        /// a sample of the steps, not all of them, readbacks that are never settled are left out
+        neighbourVisits += (unsigned int)r.motion[3];
+        neighbourSamples += (long)r.count * r.substeps;
+        
+        if(r.rehashes > 0 && r.count > 0) {
+            r.movedFraction = r.motion[4] / ((float)r.count * r.rehashes);
+            movedFraction = r.movedFraction;
+        }
+        
+        /// it only ever grows, so an older readback settled late tells nothing new
+        if(r.motion[5] > deaths) {
+            deaths = r.motion[5];
+            deathStep = r.step;
+        }
+        
+        /// the count the host worked out without reading anything back, a particle dead but never counted would break it
+        if(r.survivors >= 0 && r.motion[6] != r.survivors)
+            fprintf(stderr, "compaction kept %d particles, not %d\n", r.motion[6], r.survivors);
+        
+        r.settled = true;
+        return r;
+    }
+    
+public:
+    
+    inline CLBackend() : context(NULL) {}
+    
+    inline ~CLBackend() {
+        if(context != NULL)
+            destory_cl();
+    }
+    
+    void initialize(float D, bool profiling);
+    
+    void clear();
+    
+    /// waits for the variant being built, the next step picks it up
+    inline void waitForKernels() {
+        collectVariant(true);
+    }
+    
+    void add(const vec2* positions, const vec2* velocities, const int* ids, const int* sceneIds, const float* lifetimes, int n);
+    
+    /// waits for the kernel, to know how many it appended
+    int emit(const EmitDesc& desc);
+    
+    /// enqueues all its substeps back to back and a readback of the result, without waiting on any of it
+    void step(const StepDesc& desc);
+    
+    /// the newest readback that has completed, or if the last step is still running, the one before it
+    const Readback& latest();
+    
+    /// reads the particles back again when some were added since the last step
+    const Readback& current();
+    
+    inline int getCount() const {
+        return count;
+    }
+    
+    inline std::string getName() const {
+        return cl_device_name(device);
+    }
+    
+    int getAliasedCandidates();
+    
+    void finish();
+    
+    void takeStageTimes(double* times);
+    
+    inline double takeWaitTime() {
+        double t = waitTime;
+        waitTime = 0.0;
+        return t;
+    }
+    
+    inline int takeRebuilds() {
+        int n = rebuilds;
+        rebuilds = 0;
+        return n;
+    }
+    
+    inline int takeSortPasses() {
+        int n = sortPasses;
+        sortPasses = 0;
+        return n;
+    }
+    
+    /// over the readbacks latest() has returned since the last call
+    inline double takeNeighbours() {
+        double n = neighbourSamples > 0 ? neighbourVisits / (double)neighbourSamples : 0.0;
+        neighbourVisits = 0;
+        neighbourSamples = 0;
+        return n;
+    }
+};
+
+#endif /* CLBackend_hpp */
@@ -20,21 +20,37 @@ private:
     GLuint positions;
     GLuint vao;
     
-    const ParticleSystem* ps;
+    /// particles in the readback last uploaded
+    int count;
+    
+    /// particles the vertex buffer has room for
+    int capacity;
+    
+    ParticleSystem* ps;
     
     glProgram renderer;
     
 public:
     
-    PSGraphic(ParticleSystem* ps) : ps(ps) {}
+    PSGraphic(ParticleSystem* ps) : count(0), capacity(ParticleSystemInitialCapacity), ps(ps) {}
     
     void initialize();
     
     void destory();
     
+    /// uploads whichever readback has finished, so drawing never waits on the step just enqueued
     inline void load() {
+        const Readback& r = ps->latest();
+        count = r.count;
         glBindBuffer(GL_ARRAY_BUFFER, positions);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, ps->count * sizeof(vec2), ps->positions);
+        
+        if(count > capacity) {
+            while(capacity < count)
+                capacity *= 2;
+            glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(vec2), 0, GL_STREAM_DRAW);
+        }
+        
+        glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(vec2), r.positions);
     }
     
     void draw(GLuint target, const Frame& frame);
@@ -49,7 +65,7 @@ void PSGraphic::initialize() {
     glBindVertexArray(vao);
     
     glBindBuffer(GL_ARRAY_BUFFER, positions);
-    glBufferData(GL_ARRAY_BUFFER, MAX_PARTICLE_COUNT * sizeof(vec2), 0, GL_STREAM_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(vec2), 0, GL_STREAM_DRAW);
     glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
     glEnableVertexAttribArray(0);
 
@@ -75,7 +91,7 @@ void PSGraphic::draw(GLuint target, const Frame& frame) {
     glBindFramebuffer(GL_FRAMEBUFFER, target);
     glBindVertexArray(vao);
     glViewport(frame.x, frame.y, frame.w, frame.h);
-    glDrawArrays(GL_POINTS, 0, ps->count);
+    glDrawArrays(GL_POINTS, 0, count);
     glBindVertexArray(0);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
@@ -0,0 +1,1377 @@
+//
+//  NativeBackend.cpp
+//  SPH
+//
+//  Created by Arthur Sun on 6/22/19.
+//  Copyright © 2019 Arthur Sun. All rights reserved.
+//
+
+#include "NativeBackend.hpp"
+
+/**
+ * the host side of common.cl, these have to agree with it
+ * or the two backends file particles under different cells
+ */
+
+struct Cell
+{
+    int x;
+    int y;
+};
+
+static inline int imod(int x, int m) {
+    return ((x % m) + m) % m;
+}
+
+/// the cell a particle is filed under, particles outside a bounded grid go to its border cells
+static inline Cell home_cell(const vec2& p, const Scene& s, float D) {
+    Cell c = {(int)floorf((p.x - s.lowerBound.x) / D), (int)floorf((p.y - s.lowerBound.y) / D)};
+    
+    if(s.size.s[0] > 0) {
+        c.x = std::min(std::max(c.x, 0), s.size.s[0] - 1);
+        c.y = std::min(std::max(c.y, 0), s.size.s[1] - 1);
+    }
+    
+    return c;
+}
+
+/// the cell table slot of c in scene s, or -1 outside its grid
+static inline int scene_map(const Cell& c, const Scene& s, int n) {
+    if(s.size.s[0] > 0) {
+        if(c.x < 0 || c.y < 0 || c.x >= s.size.s[0] || c.y >= s.size.s[1])
+            return -1;
+        return c.x + c.y * s.size.s[0] + s.offset;
+    }
+    
+    return imod(c.x + c.y * 1024, n);
+}
+
+/// activity holds the last substep something moved in or next to each slot, a slot sleeps once steps substeps went by without
+static inline bool asleep(const int* activity, int slot, int stamp, int steps) {
+    return steps > 0 && (slot < 0 || stamp - activity[slot] > steps);
+}
+
+/// c and every cell next to it sleep, so no particle that is awake needs the density of one in c
+static inline bool deeply_asleep(const int* activity, const Cell& c, const Scene& s, int n, int stamp, int steps) {
+    for(int x = -1; x <= 1; ++x) {
+        for(int y = -1; y <= 1; ++y) {
+            Cell nc = {c.x + x, c.y + y};
+            if(!asleep(activity, scene_map(nc, s, n), stamp, steps))
+                return false;
+        }
+    }
+    
+    return true;
+}
+
+/// bilinear sample of a scene's signed distance field F, its obstacles or its sinks, at p relative to its lower corner, and the direction it grows in
+static inline float field_distance(const float* F, const Scene& s, const vec2& p, vec2& gradient) {
+    int nx = s.fieldSize.s[0];
+    int ny = s.fieldSize.s[1];
+    
+    /// in this order a NaN position lands on 0, like clamp() in solver.cl, instead of indexing outside the field
+    float gx = std::max(0.0f, std::min(p.x / s.fieldSpacing, (float)(nx - 1)));
+    float gy = std::max(0.0f, std::min(p.y / s.fieldSpacing, (float)(ny - 1)));
+    int cx = std::min((int)gx, nx - 2);
+    int cy = std::min((int)gy, ny - 2);
+    float tx = gx - cx;
+    float ty = gy - cy;
+    
+    const float* f = F + cx + cy * nx;
+    
+    float d00 = f[0];
+    float d10 = f[1];
+    float d01 = f[nx];
+    float d11 = f[nx + 1];
+    
+    gradient.x = (d10 - d00) + ty * ((d11 - d01) - (d10 - d00));
+    gradient.y = (d01 - d00) + tx * ((d11 - d10) - (d01 - d00));
+    
+    float d0 = d00 + tx * (d10 - d00);
+    float d1 = d01 + tx * (d11 - d01);
+    
+    return d0 + ty * (d1 - d0);
+}
+
+/**
+ * the runs of the cell-ordered arrays under the cells up to reach away from c, 3x3 for the solver and 5x5 for the lists
+ * in a bounded grid each row of them is one run, hashed slots that happen to be next to each other share one too
+ */
+static inline void find_candidates(const Cell& c, const Scene& s, int cells, const int* cellStart, int self, int reach, Candidates& out) {
+    int runs = 0;
+    
+    if(s.size.s[0] > 0) {
+        const int nx = s.size.s[0];
+        const int x0 = std::max(c.x - reach, 0);
+        const int x1 = std::min(c.x + reach, nx - 1) + 1;
+        const int y0 = std::max(c.y - reach, 0);
+        const int y1 = std::min(c.y + reach, s.size.s[1] - 1);
+        
+        for(int y = y0; y <= y1; ++y) {
+            const int* row = cellStart + s.offset + y * nx;
+            out.begin[runs] = row[x0];
+            out.end[runs] = row[x1];
+            ++runs;
+        }
+    }else{
+        for(int y = -reach; y <= reach; ++y) {
+            int last = -2;
+            
+            for(int x = -reach; x <= reach; ++x) {
+                Cell nc = {c.x + x, c.y + y};
+                int hh = scene_map(nc, s, cells);
+                
+                if(hh == last + 1) {
+                    out.end[runs - 1] = cellStart[hh + 1];
+                }else{
+                    out.begin[runs] = cellStart[hh];
+                    out.end[runs] = cellStart[hh + 1];
+                    ++runs;
+                }
+                
+                last = hh;
+            }
+        }
+    }
+    
+    out.runs = runs;
+    out.self = self;
+}
+
+/**
+ * the candidates of a symmetric pass, the particles after self in its own cell and the cells at
+ * (+1, 0), (-1, +1), (0, +1) and (+1, +1), every pair of neighbouring cells shows up from one side only
+ */
+static inline void find_forward(const Cell& c, const Scene& s, int cells, const int* cellStart, int self, Candidates& out) {
+    int runs = 0;
+    
+    if(s.size.s[0] > 0) {
+        const int nx = s.size.s[0];
+        const int* row = cellStart + s.offset + c.y * nx;
+        
+        out.begin[runs] = self + 1;
+        out.end[runs] = row[std::min(c.x + 1, nx - 1) + 1];
+        ++runs;
+        
+        if(c.y + 1 < s.size.s[1]) {
+            row += nx;
+            out.begin[runs] = row[std::max(c.x - 1, 0)];
+            out.end[runs] = row[std::min(c.x + 1, nx - 1) + 1];
+            ++runs;
+        }
+    }else{
+        Cell right = {c.x + 1, c.y};
+        int h = scene_map(c, s, cells);
+        int hr = scene_map(right, s, cells);
+        
+        out.begin[runs] = self + 1;
+        out.end[runs] = cellStart[h + 1];
+        ++runs;
+        
+        out.begin[runs] = cellStart[hr];
+        out.end[runs] = cellStart[hr + 1];
+        ++runs;
+        
+        int last = -2;
+        
+        for(int x = -1; x <= 1; ++x) {
+            Cell nc = {c.x + x, c.y + 1};
+            int hh = scene_map(nc, s, cells);
+            
+            if(hh == last + 1) {
+                out.end[runs - 1] = cellStart[hh + 1];
+            }else{
+                out.begin[runs] = cellStart[hh];
+                out.end[runs] = cellStart[hh + 1];
+                ++runs;
+            }
+            
+            last = hh;
+        }
+    }
+    
+    out.runs = runs;
+    out.self = -1;
+}
+
+#if COUNT_NEIGHBOURS
+/// what a pass visits from c, without the particle itself
+static inline int count_candidates(const Candidates& c) {
+    int n = c.self >= 0 ? -1 : 0;
+    
+    for(int r = 0; r < c.runs; ++r)
+        n += c.end[r] - c.begin[r];
+    
+    return n;
+}
+#endif
+
+#if COUNT_ALIASES
+/// candidates around c that were filed under a different cell with the same slot
+static inline int count_aliased(const Cell& c, const Scene& s, int cells, const int* cellStart, const float* xs, const float* ys, int self, float D) {
+    int aliased = 0;
+    
+    for(int x = -1; x <= 1; ++x) {
+        for(int y = -1; y <= 1; ++y) {
+            Cell nc = {c.x + x, c.y + y};
+            int hh = scene_map(nc, s, cells);
+            
+            if(hh < 0) continue;
+            
+            for(int j = cellStart[hh]; j < cellStart[hh + 1]; ++j) {
+                if(j == self) continue;
+                
+                Cell jc = home_cell(vec2(xs[j], ys[j]), s, D);
+                if(jc.x != nc.x || jc.y != nc.y) ++aliased;
+            }
+        }
+    }
+    
+    return aliased;
+}
+#endif
+
+void NativeBackend::hash() {
+    const float D = diameter;
+    const int cells = cellCount;
+    
+    pool.parallel_for(count, NATIVE_PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        for(int i = begin; i < end; ++i) {
+            const Scene& s = scenes[sceneIds[i]];
+            hashes[i] = scene_map(home_cell(positions[i], s, D), s, cells);
+        }
+    });
+}
+
+void NativeBackend::sort(bool keep) {
+    const int cells = cellCount;
+    const int threads = pool.getThreadCount();
+    const int grain = (count + threads - 1) / threads;
+    const int chunks = (count + grain - 1) / grain;
+    
+    chunkCounts.resize((size_t)chunks * cells);
+    
+    /// every chunk counts its own particles per cell
+    pool.parallel_for(count, grain, [&](int begin, int end, int thread) {
+        int* counts = &chunkCounts[(size_t)(begin / grain) * cells];
+        std::fill(counts, counts + cells, 0);
+        
+        for(int i = begin; i < end; ++i)
+            ++counts[hashes[i]];
+    });
+    
+    /// turns the counts of a cell into where each chunk starts inside it, and sums runs of cells
+    pool.parallel_for(cells, NATIVE_CELL_GRAIN, [&](int begin, int end, int thread) {
+        int sum = 0;
+        
+        for(int h = begin; h < end; ++h) {
+            cellStart[h] = sum;
+            
+            for(int c = 0; c < chunks; ++c) {
+                int& n = chunkCounts[(size_t)c * cells + h];
+                int k = n;
+                n = sum;
+                sum += k;
+            }
+        }
+        
+        blockSums[begin / NATIVE_CELL_GRAIN] = sum;
+    });
+    
+    int runs = (cells + NATIVE_CELL_GRAIN - 1) / NATIVE_CELL_GRAIN;
+    int sum = 0;
+    for(int b = 0; b < runs; ++b) {
+        int n = blockSums[b];
+        blockSums[b] = sum;
+        sum += n;
+    }
+    
+    pool.parallel_for(cells, NATIVE_CELL_GRAIN, [&](int begin, int end, int thread) {
+        int base = blockSums[begin / NATIVE_CELL_GRAIN];
+        
+        for(int h = begin; h < end; ++h)
+            cellStart[h] += base;
+        
+        for(int c = 0; c < chunks; ++c) {
+            int* counts = &chunkCounts[(size_t)c * cells];
+            for(int h = begin; h < end; ++h)
+                counts[h] += base;
+        }
+    });
+    
+    cellStart[cells] = count;
+    
+    /// chunks write in index order, so particles keep their order inside a cell
+    pool.parallel_for(count, grain, [&](int begin, int end, int thread) {
+        int* offsets = &chunkCounts[(size_t)(begin / grain) * cells];
+        
+        for(int i = begin; i < end; ++i) {
+            int h = hashes[i];
+            int o = offsets[h]++;
+            
+            order[o] = i;
+            
+            if(keep)
+                sortedHashes[o] = h;
+        }
+    });
+}
+
+int NativeBackend::rehash() {
+    const float D = diameter;
+    const int cells = cellCount;
+    const int threads = pool.getThreadCount();
+    const int grain = (count + threads - 1) / threads;
+    
+    chunkMovers.resize((count + grain - 1) / grain);
+    
+    pool.parallel_for(count, grain, [&](int begin, int end, int thread) {
+        std::vector<long>& m = chunkMovers[begin / grain];
+        m.clear();
+        
+        for(int k = begin; k < end; ++k) {
+            int i = order[k];
+            const Scene& s = scenes[sceneIds[i]];
+            int h = scene_map(home_cell(positions[i], s, D), s, cells);
+            
+            hashes[i] = h;
+            
+            if(h != sortedHashes[k])
+                m.push_back(((long)h << 32) | k);
+        }
+    });
+    
+    movers.clear();
+    for(const std::vector<long>& m : chunkMovers)
+        movers.insert(movers.end(), m.begin(), m.end());
+    
+    moverSum += movers.size();
+    moverSamples += count;
+    
+    return (int)movers.size();
+}
+
+void NativeBackend::resort() {
+    const int cells = cellCount;
+    const int threads = pool.getThreadCount();
+    const int grain = (count + threads - 1) / threads;
+    const int n = (int)movers.size();
+    
+    /// nothing changed cell, so the order, its hashes and the cell starts all still hold
+    if(n == 0)
+        return;
+    
+    /// the chunks were joined in order, so the places and the cells they left come out sorted
+    moverPlaces.resize(n);
+    moverCells.resize(n);
+    
+    for(int j = 0; j < n; ++j) {
+        moverPlaces[j] = (int)(movers[j] & 0xffffffff);
+        moverCells[j] = sortedHashes[moverPlaces[j]];
+    }
+    
+    /// few enough that one thread sorts them faster than it hands them out
+    std::sort(movers.begin(), movers.end());
+    
+    tempOrder.resize(count);
+    tempHashes.resize(count);
+    
+    /// a mover goes after every stayer up to its cell, and after the movers sorted ahead of it
+    for(int j = 0; j < n; ++j) {
+        int h = (int)(movers[j] >> 32);
+        int left = (int)(std::upper_bound(moverCells.begin(), moverCells.end(), h) - moverCells.begin());
+        int o = cellStart[h + 1] - left + j;
+        
+        tempOrder[o] = order[movers[j] & 0xffffffff];
+        tempHashes[o] = h;
+    }
+    
+    /// a stayer goes back by the movers that left from before it, and on by those that came into lower cells
+    pool.parallel_for(count, grain, [&](int begin, int end, int thread) {
+        int a = (int)(std::lower_bound(moverPlaces.begin(), moverPlaces.end(), begin) - moverPlaces.begin());
+        int b = (int)(std::lower_bound(movers.begin(), movers.end(), (long)sortedHashes[begin] << 32) - movers.begin());
+        
+        for(int k = begin; k < end; ++k) {
+            if(a < n && moverPlaces[a] == k) {
+                ++a;
+                continue;
+            }
+            
+            int h = sortedHashes[k];
+            
+            while(b < n && (int)(movers[b] >> 32) < h)
+                ++b;
+            
+            int o = k - a + b;
+            tempOrder[o] = order[k];
+            tempHashes[o] = h;
+        }
+    });
+    
+    /// a cell starts later by the movers that came into lower cells, and earlier by those that left them
+    pool.parallel_for(cells, NATIVE_CELL_GRAIN, [&](int begin, int end, int thread) {
+        int in = (int)(std::lower_bound(movers.begin(), movers.end(), (long)begin << 32) - movers.begin());
+        int out = (int)(std::lower_bound(moverCells.begin(), moverCells.end(), begin) - moverCells.begin());
+        
+        for(int h = begin; h < end; ++h) {
+            while(in < n && (int)(movers[in] >> 32) < h)
+                ++in;
+            
+            while(out < n && moverCells[out] < h)
+                ++out;
+            
+            cellStart[h] += in - out;
+        }
+    });
+    
+    std::swap(order, tempOrder);
+    std::swap(sortedHashes, tempHashes);
+}
+
+void NativeBackend::reorder() {
+    pool.parallel_for(count, NATIVE_PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        for(int i = begin; i < end; ++i) {
+            int j = order[i];
+            tempPositions[i] = positions[j];
+            tempVelocities[i] = velocities[j];
+            tempIds[i] = ids[j];
+            tempSceneIds[i] = sceneIds[j];
+            tempLives[i] = lives[j];
+            order[i] = i;
+        }
+    });
+    
+    std::swap(positions, tempPositions);
+    std::swap(velocities, tempVelocities);
+    std::swap(ids, tempIds);
+    std::swap(sceneIds, tempSceneIds);
+    std::swap(lives, tempLives);
+}
+
+void NativeBackend::removeDead(int dead) {
+    const int chunks = (count + NATIVE_PARTICLE_GRAIN - 1) / NATIVE_PARTICLE_GRAIN;
+    
+    survivors.resize(chunks);
+    
+    pool.parallel_for(count, NATIVE_PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        int n = 0;
+        
+        for(int i = begin; i < end; ++i)
+            if(lives[i] > 0.0f)
+                ++n;
+        
+        survivors[begin / NATIVE_PARTICLE_GRAIN] = n;
+    });
+    
+    int sum = 0;
+    for(int c = 0; c < chunks; ++c) {
+        int n = survivors[c];
+        survivors[c] = sum;
+        sum += n;
+    }
+    
+    /// chunks write in index order, so the survivors keep theirs
+    pool.parallel_for(count, NATIVE_PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        int o = survivors[begin / NATIVE_PARTICLE_GRAIN];
+        
+        for(int i = begin; i < end; ++i) {
+            if(lives[i] <= 0.0f)
+                continue;
+            
+            tempPositions[o] = positions[i];
+            tempVelocities[o] = velocities[i];
+            tempIds[o] = ids[i];
+            tempSceneIds[o] = sceneIds[i];
+            tempLives[o] = lives[i];
+            ++o;
+        }
+    });
+    
+    std::swap(positions, tempPositions);
+    std::swap(velocities, tempVelocities);
+    std::swap(ids, tempIds);
+    std::swap(sceneIds, tempSceneIds);
+    std::swap(lives, tempLives);
+    
+    if(sum != count - dead)
+        fprintf(stderr, "compaction kept %d particles, not %d\n", sum, count - dead);
+    
+    count = sum;
+    resize(count);
+    listsValid = false;
+    sortValid = false;
+}
+
+void NativeBackend::gather() {
+    pool.parallel_for(count, NATIVE_PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        for(int k = begin; k < end; ++k) {
+            int i = order[k];
+            xs[k] = positions[i].x;
+            ys[k] = positions[i].y;
+            vxs[k] = velocities[i].x;
+            vys[k] = velocities[i].y;
+        }
+    });
+}
+
+void NativeBackend::density(float dt) {
+    const float D = diameter;
+    const float D2 = D * D;
+    const int cells = cellCount;
+    const SoA soa = {xs.data(), ys.data(), vxs.data(), vys.data(), ws.data()};
+    
+    pool.parallel_for(cells, NATIVE_CELL_GRAIN, [&](int begin, int end, int thread) {
+#if COUNT_ALIASES
+        int aliased = 0;
+#endif
+
+#if COUNT_NEIGHBOURS
+        long visited = 0;
+#endif
+        
+        Candidates candidates;
+        
+        for(int k = cellStart[begin]; k < cellStart[end]; ++k) {
+            const Scene& s = scenes[sceneIds[order[k]]];
+            
+            const float sdt = dt * s.timeScale;
+            
+            const vec2 p(xs[k], ys[k]);
+            
+            const Cell c = home_cell(p, s, D);
+            
+            if(deeply_asleep(activity.data(), c, s, cells, stamp, sleepSteps))
+                continue;
+            
+            const float cv2 = D2 / (sdt * sdt);
+            const float mp = cv2 * 0.25f;
+            
+            find_candidates(c, s, cells, cellStart.data(), k, 1, candidates);
+            
+            float weight = kernels.weight(soa, candidates, p.x, p.y, D);
+            
+#if COUNT_ALIASES
+            aliased += count_aliased(c, s, cells, cellStart.data(), xs.data(), ys.data(), k, D);
+#endif
+
+#if COUNT_NEIGHBOURS
+            visited += count_candidates(candidates);
+#endif
+            
+            ws[k] = std::min(mp, 0.05f * std::max(weight - 1.0f, 0.0f));
+        }
+        
+#if COUNT_ALIASES
+        if(aliased != 0)
+            aliases += aliased;
+#endif
+
+#if COUNT_NEIGHBOURS
+        visits += visited;
+#endif
+    });
+}
+
+void NativeBackend::force(float dt) {
+    const float D = diameter;
+    const int cells = cellCount;
+    const SoA soa = {xs.data(), ys.data(), vxs.data(), vys.data(), ws.data()};
+    
+    pool.parallel_for(cells, NATIVE_CELL_GRAIN, [&](int begin, int end, int thread) {
+#if COUNT_ALIASES
+        int aliased = 0;
+#endif
+        
+        Candidates candidates;
+        
+        for(int k = cellStart[begin]; k < cellStart[end]; ++k) {
+            const int i = order[k];
+            const Scene& s = scenes[sceneIds[i]];
+            
+            const float sdt = dt * s.timeScale;
+            
+            const vec2 p(xs[k], ys[k]);
+            
+            const Cell c = home_cell(p, s, D);
+            
+            if(asleep(activity.data(), scene_map(c, s, cells), stamp, sleepSteps))
+                continue;
+            
+            find_candidates(c, s, cells, cellStart.data(), k, 1, candidates);
+            
+            float ax = 0.0f;
+            float ay = 0.0f;
+            
+            kernels.force(soa, candidates, p.x, p.y, vxs[k], vys[k], ws[k], D, sdt, &ax, &ay);
+            
+#if COUNT_ALIASES
+            aliased += count_aliased(c, s, cells, cellStart.data(), xs.data(), ys.data(), k, D);
+#endif
+            
+            accelerations[i] = vec2(sdt * (ax + s.gravity.x), sdt * (ay + s.gravity.y));
+        }
+        
+#if COUNT_ALIASES
+        if(aliased != 0)
+            aliases += aliased;
+#endif
+    });
+}
+
+void NativeBackend::alternate(const std::function<void(int begin, int end)>& fn) {
+    const int cells = cellCount;
+    
+    /// a bounded grid's forward cells are at most a row and a cell ahead, hashed ones 1025 slots ahead modulo the table, which 2048 divides
+    int grain = NATIVE_CELL_GRAIN;
+    for(int i = 0; i < sceneCount; ++i)
+        grain = std::max(grain, scenes[i].size.s[0] > 0 ? scenes[i].size.s[0] + 1 : 2048);
+    
+    const int chunks = (cells + grain - 1) / grain;
+    
+    for(int parity = 0; parity < 2; ++parity) {
+        pool.parallel_for((chunks + 1 - parity) / 2, 1, [&](int begin, int end, int thread) {
+            for(int c = begin; c < end; ++c) {
+                int first = (2 * c + parity) * grain;
+                fn(first, std::min(first + grain, cells));
+            }
+        });
+    }
+}
+
+void NativeBackend::symmetricDensity(float dt) {
+    const float D = diameter;
+    const int cells = cellCount;
+    const SoA soa = {xs.data(), ys.data(), vxs.data(), vys.data(), ws.data()};
+    float* sums = ws.data();
+    
+    pool.parallel_for(count, NATIVE_PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        std::fill(sums + begin, sums + end, 0.0f);
+    });
+    
+    alternate([&](int begin, int end) {
+#if COUNT_ALIASES
+        int aliased = 0;
+#endif
+
+#if COUNT_NEIGHBOURS
+        long visited = 0;
+#endif
+        
+        Candidates candidates;
+        
+        for(int k = cellStart[begin]; k < cellStart[end]; ++k) {
+            const Scene& s = scenes[sceneIds[order[k]]];
+            
+            const vec2 p(xs[k], ys[k]);
+            
+            const Cell c = home_cell(p, s, D);
+            
+            find_forward(c, s, cells, cellStart.data(), k, candidates);
+            
+            float weight = kernels.weightHalf(soa, candidates, p.x, p.y, D, sums);
+            sums[k] += weight;
+            
+#if COUNT_ALIASES
+            aliased += count_aliased(c, s, cells, cellStart.data(), xs.data(), ys.data(), k, D);
+#endif
+
+#if COUNT_NEIGHBOURS
+            visited += count_candidates(candidates);
+#endif
+        }
+        
+#if COUNT_ALIASES
+        if(aliased != 0)
+            aliases += aliased;
+#endif
+
+#if COUNT_NEIGHBOURS
+        visits += visited;
+#endif
+    });
+    
+    pool.parallel_for(count, NATIVE_PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        for(int k = begin; k < end; ++k) {
+            const float sdt = dt * scenes[sceneIds[order[k]]].timeScale;
+            
+            const float cv2 = D * D / (sdt * sdt);
+            const float mp = cv2 * 0.25f;
+            
+            ws[k] = std::min(mp, 0.05f * std::max(sums[k] - 1.0f, 0.0f));
+        }
+    });
+}
+
+void NativeBackend::symmetricForce(float dt) {
+    const float D = diameter;
+    const int cells = cellCount;
+    const SoA soa = {xs.data(), ys.data(), vxs.data(), vys.data(), ws.data()};
+    
+    pool.parallel_for(count, NATIVE_PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        std::fill(axs.begin() + begin, axs.begin() + end, 0.0f);
+        std::fill(ays.begin() + begin, ays.begin() + end, 0.0f);
+    });
+    
+    alternate([&](int begin, int end) {
+        Candidates candidates;
+        
+        for(int k = cellStart[begin]; k < cellStart[end]; ++k) {
+            const Scene& s = scenes[sceneIds[order[k]]];
+            
+            const float sdt = dt * s.timeScale;
+            
+            const vec2 p(xs[k], ys[k]);
+            
+            find_forward(home_cell(p, s, D), s, cells, cellStart.data(), k, candidates);
+            
+            float ax = 0.0f;
+            float ay = 0.0f;
+            
+            kernels.forceHalf(soa, candidates, p.x, p.y, vxs[k], vys[k], ws[k], D, sdt, &ax, &ay, axs.data(), ays.data());
+            
+            axs[k] += ax;
+            ays[k] += ay;
+        }
+    });
+    
+    pool.parallel_for(count, NATIVE_PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        for(int k = begin; k < end; ++k) {
+            const int i = order[k];
+            const Scene& s = scenes[sceneIds[i]];
+            
+            const float sdt = dt * s.timeScale;
+            
+            accelerations[i] = vec2(sdt * (axs[k] + s.gravity.x), sdt * (ays[k] + s.gravity.y));
+        }
+    });
+}
+
+bool NativeBackend::listsExpired(float skin) {
+    if(!listsValid || skin != listSkin)
+        return true;
+    
+    float m = *std::max_element(moved.begin(), moved.end());
+    
+    return m > 0.25f * skin * skin;
+}
+
+void NativeBackend::buildLists(float skin) {
+    const float D = diameter;
+    const float R = D + skin;
+    const float R2 = R * R;
+    const int cells = cellCount;
+    
+    neighbourCounts.resize(count);
+    
+    for(;;) {
+        neighbourList.resize((size_t)count * neighbourCapacity);
+        
+        std::atomic<int> longest(0);
+        
+        pool.parallel_for(cells, NATIVE_CELL_GRAIN, [&](int begin, int end, int thread) {
+            Candidates candidates;
+            
+            int most = 0;
+            
+            for(int k = cellStart[begin]; k < cellStart[end]; ++k) {
+                const Scene& s = scenes[sceneIds[order[k]]];
+                const float px = xs[k];
+                const float py = ys[k];
+                
+                find_candidates(home_cell(vec2(px, py), s, D), s, cells, cellStart.data(), k, 2, candidates);
+                
+                int* out = &neighbourList[(size_t)k * neighbourCapacity];
+                int n = 0;
+                
+                for(int r = 0; r < candidates.runs; ++r) {
+                    for(int j = candidates.begin[r]; j < candidates.end[r]; ++j) {
+                        if(j == k) continue;
+                        
+                        float dx = xs[j] - px;
+                        float dy = ys[j] - py;
+                        
+                        if(dx * dx + dy * dy < R2) {
+                            if(n < neighbourCapacity)
+                                out[n] = j;
+                            ++n;
+                        }
+                    }
+                }
+                
+                neighbourCounts[k] = std::min(n, neighbourCapacity);
+                most = std::max(most, n);
+            }
+            
+            int l = longest.load();
+            while(most > l && !longest.compare_exchange_weak(l, most));
+        });
+        
+        if(longest <= neighbourCapacity)
+            break;
+        
+        /// a particle has more neighbours than fit, grow the lists and list them all again
+        while(neighbourCapacity < longest)
+            neighbourCapacity *= 2;
+    }
+    
+    anchors = positions;
+    std::fill(moved.begin(), moved.end(), 0.0f);
+    
+    listScenes.assign(scenes, scenes + sceneCount);
+    listSkin = skin;
+    listsValid = true;
+}
+
+void NativeBackend::listDensity(float dt) {
+    const float D = diameter;
+    const SoA soa = {xs.data(), ys.data(), vxs.data(), vys.data(), ws.data()};
+    
+    pool.parallel_for(count, NATIVE_PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+#if COUNT_NEIGHBOURS
+        long visited = 0;
+#endif
+        
+        for(int k = begin; k < end; ++k) {
+            const float sdt = dt * scenes[sceneIds[order[k]]].timeScale;
+            
+            const float cv2 = D * D / (sdt * sdt);
+            const float mp = cv2 * 0.25f;
+            
+            float weight = kernels.weightList(soa, &neighbourList[(size_t)k * neighbourCapacity], neighbourCounts[k], xs[k], ys[k], D);
+            
+#if COUNT_NEIGHBOURS
+            visited += neighbourCounts[k];
+#endif
+            
+            ws[k] = std::min(mp, 0.05f * std::max(weight - 1.0f, 0.0f));
+        }
+        
+#if COUNT_NEIGHBOURS
+        visits += visited;
+#endif
+    });
+}
+
+void NativeBackend::listForce(float dt) {
+    const float D = diameter;
+    const SoA soa = {xs.data(), ys.data(), vxs.data(), vys.data(), ws.data()};
+    
+    pool.parallel_for(count, NATIVE_PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        for(int k = begin; k < end; ++k) {
+            const int i = order[k];
+            const Scene& s = scenes[sceneIds[i]];
+            
+            const float sdt = dt * s.timeScale;
+            
+            float ax = 0.0f;
+            float ay = 0.0f;
+            
+            kernels.forceList(soa, &neighbourList[(size_t)k * neighbourCapacity], neighbourCounts[k], xs[k], ys[k], vxs[k], vys[k], ws[k], D, sdt, &ax, &ay);
+            
+            accelerations[i] = vec2(sdt * (ax + s.gravity.x), sdt * (ay + s.gravity.y));
+        }
+    });
+}
+
+void NativeBackend::adder(float dt, bool lists) {
+    const float D = diameter;
+    const float D2 = diameter * diameter;
+    const int cells = cellCount;
+    const float speed2 = sleepSpeed * sleepSpeed;
+    const float accel2 = sleepAcceleration * sleepAcceleration * dt * dt;
+    
+    pool.parallel_for(count, NATIVE_PARTICLE_GRAIN, [&](int begin, int end, int thread) {
+        float furthest = 0.0f;
+        float fastest = 0.0f;
+        float hardest = 0.0f;
+        int died = 0;
+        
+        for(int i = begin; i < end; ++i) {
+            const Scene& s = scenes[sceneIds[i]];
+            
+            const float sdt = dt * s.timeScale;
+            const float cv2 = D2 / (sdt * sdt);
+            
+            vec2& A = velocities[i];
+            vec2& B = positions[i];
+            
+            /// the cell the particle was filed under this substep
+            const Cell c = home_cell(B, s, D);
+            
+            /// the lifetime runs down while the particle sleeps too, the dead stay where they are until the substep is done
+            if(mortal) {
+                float& L = lives[i];
+                
+                if(L <= 0.0f)
+                    continue;
+                
+                L -= sdt;
+                
+                if(L <= 0.0f) {
+                    ++died;
+                    continue;
+                }
+            }
+            
+            if(asleep(activity.data(), scene_map(c, s, cells), stamp, sleepSteps))
+                continue;
+            
+            const vec2& dv = accelerations[i];
+            
+            A += dv;
+            
+            float v2 = dot(A, A);
+            
+            /// before the clamp, so the next step can take enough substeps that it does not have to
+            float ts2 = s.timeScale * s.timeScale;
+            fastest = std::max(fastest, v2 * ts2);
+            hardest = std::max(hardest, dot(dv, dv) * ts2);
+            
+            if(sleepSteps > 0 && (v2 * ts2 > speed2 || dot(dv, dv) * ts2 > accel2)) {
+                for(int x = -1; x <= 1; ++x) {
+                    for(int y = -1; y <= 1; ++y) {
+                        Cell nc = {c.x + x, c.y + y};
+                        int h = scene_map(nc, s, cells);
+                        if(h >= 0)
+                            marks[h].store(stamp, std::memory_order_relaxed);
+                    }
+                }
+            }
+            
+            if(v2 > cv2) {
+                float k = sqrtf(cv2 / v2);
+                A.x *= k;
+                A.y *= k;
+            }
+            
+            B += sdt * A;
+            
+            /// out of the obstacles, and the velocity into them removed
+            if(s.field >= 0) {
+                vec2 n;
+                float d = field_distance(field.data() + s.field, s, B - s.lowerBound, n);
+                float n2 = dot(n, n);
+                
+                if(d < 0.0f && n2 > 0.0f) {
+                    n = (1.0f / sqrtf(n2)) * n;
+                    B -= d * n;
+                    
+                    float vn = dot(A, n);
+                    if(vn < 0.0f)
+                        A -= vn * n;
+                }
+            }
+            
+#if BOUNDS
+            if(B.x < s.lowerBound.x) {
+                A.x = 0.0f;
+                B.x = s.lowerBound.x;
+            }
+            
+            if(B.y < s.lowerBound.y) {
+                A.y = 0.0f;
+                B.y = s.lowerBound.y;
+            }
+            
+            if(B.x > s.upperBound.x) {
+                A.x = 0.0f;
+                B.x = s.upperBound.x;
+            }
+            
+            if(B.y > s.upperBound.y) {
+                A.y = 0.0f;
+                B.y = s.upperBound.y;
+            }
+#endif
+            
+            if(lists) {
+                vec2 d = B - anchors[i];
+                furthest = std::max(furthest, dot(d, d));
+            }
+            
+            if(mortal && s.sink >= 0) {
+                vec2 n;
+                if(field_distance(field.data() + s.sink, s, B - s.lowerBound, n) < 0.0f) {
+                    lives[i] = 0.0f;
+                    ++died;
+                }
+            }
+        }
+        
+        deaths[thread] += died;
+        moved[thread] = std::max(moved[thread], furthest);
+        speeds[thread] = std::max(speeds[thread], fastest);
+        accels[thread] = std::max(accels[thread], hardest / (dt * dt));
+    });
+}
+
+void NativeBackend::settle() {
+    pool.parallel_for(cellCount, NATIVE_CELL_GRAIN, [&](int begin, int end, int thread) {
+        long sleeping = 0;
+        
+        for(int c = begin; c < end; ++c) {
+            if(asleep(activity.data(), c, stamp, sleepSteps))
+                sleeping += cellStart[c + 1] - cellStart[c];
+            
+            activity[c] = std::max(activity[c], marks[c].load(std::memory_order_relaxed));
+        }
+        
+        sleepers[thread] += sleeping;
+    });
+}
+
+void NativeBackend::emitRows(const StepDesc& desc, int k) {
+    int first = nextRow;
+    int n = 0;
+    
+    for(; nextRow < desc.rowCount && desc.rows[nextRow].substep == k; ++nextRow)
+        n += desc.nozzles[desc.rows[nextRow].nozzle].count;
+    
+    if(n == 0)
+        return;
+    
+    resize(count + n);
+    
+    for(int r = first; r < nextRow; ++r) {
+        const EmitRow& row = desc.rows[r];
+        const Nozzle& nozzle = desc.nozzles[row.nozzle];
+        const Scene& s = scenes[nozzle.scene];
+        
+        for(int j = 0; j < nozzle.count; ++j) {
+            int i = count + row.offset + j;
+            
+            positions[i] = nozzle.position + (j - 0.5f * (nozzle.count - 1)) * nozzle.spacing + row.age * nozzle.velocity;
+            velocities[i] = nozzle.velocity;
+            ids[i] = row.firstId + j;
+            sceneIds[i] = nozzle.scene;
+            lives[i] = row.life;
+            
+            /// a particle in a sleeping slot would never move
+            if(sleepSteps > 0) {
+                Cell c = home_cell(positions[i], s, diameter);
+                
+                for(int x = -1; x <= 1; ++x) {
+                    for(int y = -1; y <= 1; ++y) {
+                        Cell nc = {c.x + x, c.y + y};
+                        int h = scene_map(nc, s, cellCount);
+                        if(h >= 0)
+                            activity[h] = stamp;
+                    }
+                }
+            }
+        }
+    }
+    
+    count += n;
+    resizeScratch();
+    listsValid = false;
+    sortValid = false;
+}
+
+void NativeBackend::substep(const StepDesc& desc, int k) {
+    const bool lists = desc.skin > 0.0f;
+    
+    ++stepsSinceReorder;
+    ++stamp;
+    
+    if(desc.rowCount > 0)
+        emitRows(desc, k);
+    
+    /// nothing to solve until the first row comes out
+    if(count == 0)
+        return;
+    
+    /// with lists the particles keep their order until the next rebuild, so reordering waits for it
+    const bool rebuild = !lists || listsExpired(desc.skin);
+    
+    nanosecond_type start = current_nanosecond;
+    
+    if(rebuild) {
+        bool incremental = desc.resortLimit > 0.0f && sortValid;
+        int changed = incremental ? rehash() : 0;
+        
+        if(!incremental)
+            hash();
+        
+        record(stage_hash, start);
+        start = current_nanosecond;
+        
+        /// too many changed cell, merging them back would take longer than sorting from scratch
+        if(incremental && changed <= desc.resortLimit * count)
+            resort();
+        else
+            sort(desc.resortLimit > 0.0f);
+        
+        sortValid = desc.resortLimit > 0.0f;
+        ++sortPasses;
+        
+        record(stage_sort, start);
+        
+        if(desc.reorderInterval > 0 && stepsSinceReorder >= desc.reorderInterval) {
+            start = current_nanosecond;
+            
+            reorder();
+            stepsSinceReorder = 0;
+            
+            record(stage_reorder, start);
+        }
+        
+        ++rebuilds;
+        start = current_nanosecond;
+    }
+    
+    gather();
+    
+    record(stage_reorder, start);
+    
+    if(rebuild) {
+        start = current_nanosecond;
+        
+        if(lists)
+            buildLists(desc.skin);
+        else
+            listsValid = false;
+        
+        record(stage_list, start);
+    }
+    
+    start = current_nanosecond;
+    
+    if(lists) {
+        listDensity(desc.dt);
+        listForce(desc.dt);
+    }else if(desc.symmetric) {
+        symmetricDensity(desc.dt);
+        symmetricForce(desc.dt);
+    }else{
+        density(desc.dt);
+        force(desc.dt);
+    }
+    
+    record(stage_solve, start);
+    start = current_nanosecond;
+    
+    adder(desc.dt, lists);
+    
+    if(sleepSteps > 0)
+        settle();
+    
+    record(stage_adder, start);
+    
+    int died = 0;
+    for(int& n : deaths) {
+        died += n;
+        n = 0;
+    }
+    
+    /// before the next substep, so the dead are never anyone's neighbour and no frame has them
+    if(died > 0) {
+        start = current_nanosecond;
+        removeDead(died);
+        record(stage_reorder, start);
+    }
+}
+
+void NativeBackend::initialize(float D, bool profiling) {
+    this->profiling = profiling;
+    diameter = D;
+    count = 0;
+    cellCount = 0;
+    stepsSinceReorder = 0;
+    aliases = 0;
+    visits = 0;
+    visitSamples = 0;
+    sortPasses = 0;
+    scenes = NULL;
+    sceneCount = 0;
+    neighbourCapacity = NEIGHBOUR_CAPACITY;
+    listsValid = false;
+    sortValid = false;
+    rebuilds = 0;
+    fieldVersion = -1;
+    stamp = 0;
+    sleepReset = true;
+    sleepSteps = 0;
+    sleepers.assign(pool.getThreadCount(), 0);
+    deaths.assign(pool.getThreadCount(), 0);
+    mortal = false;
+    moved.assign(pool.getThreadCount(), 0.0f);
+    speeds.assign(pool.getThreadCount(), 0.0f);
+    accels.assign(pool.getThreadCount(), 0.0f);
+    
+    for(double& t : stageTimes)
+        t = 0.0;
+    
+    frame.count = 0;
+    frame.step = 0;
+    frame.positions = NULL;
+    frame.velocities = NULL;
+    frame.ids = NULL;
+    frame.sceneIds = NULL;
+    frame.lifetimes = NULL;
+    frame.maxSpeed = 0.0f;
+    frame.maxAcceleration = 0.0f;
+    frame.activeFraction = 1.0f;
+    frame.movedFraction = 0.0f;
+}
+
+void NativeBackend::clear() {
+    count = 0;
+    stepsSinceReorder = 0;
+    listsValid = false;
+    sortValid = false;
+    resize(0);
+}
+
+void NativeBackend::add(const vec2* positions, const vec2* velocities, const int* ids, const int* sceneIds, const float* lifetimes, int n) {
+    resize(count + n);
+    
+    std::copy(positions, positions + n, this->positions.begin() + count);
+    std::copy(velocities, velocities + n, this->velocities.begin() + count);
+    std::copy(ids, ids + n, this->ids.begin() + count);
+    std::copy(sceneIds, sceneIds + n, this->sceneIds.begin() + count);
+    
+    if(lifetimes != NULL) {
+        std::copy(lifetimes, lifetimes + n, lives.begin() + count);
+        mortal = true;
+    }else
+        std::fill(lives.begin() + count, lives.begin() + count + n, INFINITY);
+    
+    count += n;
+    listsValid = false;
+    sortValid = false;
+    sleepReset = true;
+}
+
+int NativeBackend::emit(const EmitDesc& desc) {
+    if(desc.fieldVersion != fieldVersion) {
+        field.assign(desc.field, desc.field + desc.fieldLength);
+        fieldVersion = desc.fieldVersion;
+    }
+    
+    const Scene& s = desc.scenes[desc.scene];
+    int n = 0;
+    
+    resize(count + std::max(std::min(desc.limit, desc.columns * desc.rows), 0));
+    
+    for(int y = 0; y < desc.rows; ++y) {
+        for(int x = 0; x < desc.columns && n < desc.limit; ++x) {
+            vec2 p = desc.lower + desc.stride * vec2(x, y);
+            bool inside = true;
+            
+            for(int k = 0; k < desc.vertexCount && inside; ++k)
+                inside = dot(desc.normals[k], p - desc.vertices[k]) <= 0.0f;
+            
+            vec2 g;
+            if(!inside || (s.field >= 0 && field_distance(field.data() + s.field, s, p - s.lowerBound, g) <= 0.0f))
+                continue;
+            
+            positions[count + n] = p;
+            velocities[count + n] = desc.velocity;
+            ids[count + n] = desc.firstId + n;
+            sceneIds[count + n] = desc.scene;
+            lives[count + n] = desc.lifetime;
+            ++n;
+        }
+    }
+    
+    count += n;
+    resize(count);
+    listsValid = false;
+    sortValid = false;
+    sleepReset = true;
+    
+    return n;
+}
+
+void NativeBackend::step(const StepDesc& desc) {
+    if(desc.cells != cellCount || desc.sceneCount != (int)listScenes.size() || !std::equal(desc.scenes, desc.scenes + desc.sceneCount, listScenes.begin()))
+        listsValid = false;
+    
+    /// the hashes of the last sort mean nothing under other cells
+    if(desc.cells != cellCount || desc.sceneCount != (int)sortScenes.size() || !std::equal(desc.scenes, desc.scenes + desc.sceneCount, sortScenes.begin())) {
+        sortScenes.assign(desc.scenes, desc.scenes + desc.sceneCount);
+        sortValid = false;
+    }
+    
+    /// sleeping needs the cells of every substep, which the lists skip, and the symmetric passes write into sleeping neighbours
+    int steps = desc.skin > 0.0f || desc.symmetric ? 0 : desc.sleepSteps;
+    
+    if(steps == 0 || sleepSteps == 0 || desc.cells != cellCount)
+        sleepReset = true;
+    
+    sleepSteps = steps;
+    sleepSpeed = desc.sleepSpeed;
+    sleepAcceleration = desc.sleepAcceleration;
+    mortal = desc.mortal;
+    
+    scenes = desc.scenes;
+    sceneCount = desc.sceneCount;
+    
+    if(desc.fieldVersion != fieldVersion) {
+        field.assign(desc.field, desc.field + desc.fieldLength);
+        fieldVersion = desc.fieldVersion;
+    }
+    cellCount = desc.cells;
+    
+    cellStart.resize(cellCount + 1);
+    blockSums.resize((cellCount + NATIVE_CELL_GRAIN - 1) / NATIVE_CELL_GRAIN);
+    
+    /// room for every row of the step up front, the substeps only resize what they rewrite
+    positions.reserve(count + desc.emitted);
+    velocities.reserve(count + desc.emitted);
+    ids.reserve(count + desc.emitted);
+    sceneIds.reserve(count + desc.emitted);
+    lives.reserve(count + desc.emitted);
+    
+    resizeScratch();
+    
+    if(sleepSteps > 0 && sleepReset) {
+        activity.assign(cellCount, stamp);
+        marks = std::vector<std::atomic<int>>(cellCount);
+        sleepReset = false;
+    }
+    
+    std::fill(speeds.begin(), speeds.end(), 0.0f);
+    std::fill(accels.begin(), accels.end(), 0.0f);
+    std::fill(sleepers.begin(), sleepers.end(), 0);
+    
+    moverSum = 0;
+    moverSamples = 0;
+    
+    nextRow = 0;
+    
+    for(int i = 0; i < desc.its; ++i)
+        substep(desc, i);
+    
+    frame.movedFraction = moverSamples > 0 ? moverSum / (float)moverSamples : 0.0f;
+    
+    visitSamples += (long)count * desc.its;
+    
+    long sleeping = 0;
+    for(long n : sleepers)
+        sleeping += n;
+    
+    frame.activeFraction = count > 0 ? 1.0f - sleeping / ((float)count * desc.its) : 1.0f;
+    
+    frame.maxSpeed = sqrtf(*std::max_element(speeds.begin(), speeds.end()));
+    frame.maxAcceleration = sqrtf(*std::max_element(accels.begin(), accels.end()));
+    ++frame.step;
+}
+
+const Readback& NativeBackend::latest() {
+    frame.count = count;
+    frame.positions = positions.data();
+    frame.velocities = velocities.data();
+    frame.ids = ids.data();
+    frame.sceneIds = sceneIds.data();
+    frame.lifetimes = mortal ? lives.data() : NULL;
+    return frame;
+}
+
+void NativeBackend::takeStageTimes(double* times) {
+    for(int s = 0; s < stage_count; ++s) {
+        times[s] = stageTimes[s];
+        stageTimes[s] = 0.0;
+    }
+}
@@ -0,0 +1,350 @@
+//
+//  NativeBackend.hpp
+//  SPH
+//
+//  Created by Arthur Sun on 6/22/19.
+//  Copyright © 2019 Arthur Sun. All rights reserved.
+//
+
+#ifndef NativeBackend_hpp
+#define NativeBackend_hpp
+
+#include "Backend.h"
+#include "ThreadPool.h"
+#include "NativeKernels.hpp"
+
+/// cells per chunk the solver hands out, the unit threads steal
+#ifndef NATIVE_CELL_GRAIN
+#define NATIVE_CELL_GRAIN 256
+#endif
+
+/// particles per chunk of the hasher and adder
+#ifndef NATIVE_PARTICLE_GRAIN
+#define NATIVE_PARTICLE_GRAIN 4096
+#endif
+
+/**
+ * runs the same physics as solver.cl on a pool of host threads,
+ * without going through an OpenCL runtime
+ * a step runs to completion before step() returns
+ */
+class NativeBackend : public Backend
+{
+    ThreadPool pool;
+    
+    std::vector<vec2> positions;
+    std::vector<vec2> velocities;
+    std::vector<int> ids;
+    std::vector<int> sceneIds;
+    
+    /// time each particle has left, INFINITY for ever, and 0 once it died
+    std::vector<float> lives;
+    
+    std::vector<vec2> tempPositions;
+    std::vector<vec2> tempVelocities;
+    std::vector<int> tempIds;
+    std::vector<int> tempSceneIds;
+    std::vector<float> tempLives;
+    
+    std::vector<vec2> accelerations;
+    
+    /// positions, velocities and weights in cell order, what the neighbour kernels read
+    std::vector<float> xs;
+    std::vector<float> ys;
+    std::vector<float> vxs;
+    std::vector<float> vys;
+    std::vector<float> ws;
+    
+    /// forces in cell order, the symmetric passes add to the particle and take from its neighbours here
+    std::vector<float> axs;
+    std::vector<float> ays;
+    
+    NeighbourKernels kernels;
+    
+    /// the cell table slot of every particle
+    std::vector<int> hashes;
+    
+    /// particles in cell order, the indices the proxies hold on the device
+    std::vector<int> order;
+    
+    /// the particles of cell h are order[cellStart[h]] to order[cellStart[h + 1] - 1]
+    std::vector<int> cellStart;
+    
+    /// particles of each sort chunk in each cell, then where the chunk writes into the cell
+    std::vector<int> chunkCounts;
+    
+    /// particles in each run of NATIVE_CELL_GRAIN cells, then where the run starts
+    std::vector<int> blockSums;
+    
+    /// the cell of each place in order as of the last sort, kept when re-sorting is on
+    std::vector<int> sortedHashes;
+    
+    /// order and sortedHashes describe the particles, nothing was added and no cell or scene changed since the sort
+    bool sortValid;
+    
+    /// what the cells were hashed with at the last sort
+    std::vector<Scene> sortScenes;
+    
+    /// the particles of each sort chunk that changed cell, as (hash << 32) | place in order
+    std::vector<std::vector<long>> chunkMovers;
+    
+    /// those of every chunk, sorted so by cell and then by the old order, and the places and cells they left, in order
+    std::vector<long> movers;
+    std::vector<int> moverPlaces;
+    std::vector<int> moverCells;
+    
+    std::vector<int> tempOrder;
+    std::vector<int> tempHashes;
+    
+    /// particles that changed cell at the re-sorts of the current step, and the particles the re-sorts looked at
+    long moverSum;
+    long moverSamples;
+    
+    /// neighbourCapacity cell-order indices per particle in cell order, the first neighbourCounts[k] of them are its neighbours
+    std::vector<int> neighbourList;
+    std::vector<int> neighbourCounts;
+    
+    /// where each particle was when the lists were built, in storage order
+    std::vector<vec2> anchors;
+    
+    /// the furthest a particle of each thread moved from its anchor, squared
+    std::vector<float> moved;
+    
+    /// the largest squared speed and acceleration of each thread since the step began, per unit of dt
+    std::vector<float> speeds;
+    std::vector<float> accels;
+    
+    /// per cell slot, the last substep something moved in or next to it, and what the adder marked in the current one
+    std::vector<int> activity;
+    std::vector<std::atomic<int>> marks;
+    
+    /// counts substeps, what activity holds
+    int stamp;
+    
+    /// activity no longer fits the particles or the cells, every slot starts awake again
+    bool sleepReset;
+    
+    /// what the current step sleeps with, sleepSteps is 0 when it does not
+    int sleepSteps;
+    float sleepSpeed;
+    float sleepAcceleration;
+    
+    /// particles of each thread that slept through a substep since the step began
+    std::vector<long> sleepers;
+    
+    /// the lifetimes run down and the sinks take particles, in the current step
+    bool mortal;
+    
+    /// particles of each thread that died in the current substep
+    std::vector<int> deaths;
+    
+    /// survivors of each chunk of NATIVE_PARTICLE_GRAIN particles, then where the chunk writes them
+    std::vector<int> survivors;
+    
+    /// what the lists were built with
+    std::vector<Scene> listScenes;
+    float listSkin;
+    
+    int neighbourCapacity;
+    
+    /// the lists can be used, nothing was added and no scene changed since they were built
+    bool listsValid;
+    
+    /// substeps that rebuilt the cells since the last takeRebuilds()
+    int rebuilds;
+    
+    Readback frame;
+    
+    const Scene* scenes;
+    
+    int sceneCount;
+    
+    /// the signed distance samples of every scene with obstacles, and the StepDesc::fieldVersion they came from
+    std::vector<float> field;
+    int fieldVersion;
+    
+    float diameter;
+    
+    int count;
+    
+    int cellCount;
+    
+    /// substeps since the particles were last reordered
+    int stepsSinceReorder;
+    
+    bool profiling;
+    
+    /// milliseconds each stage took since the last takeStageTimes()
+    double stageTimes[stage_count];
+    
+    std::atomic<int> aliases;
+    
+    /// neighbour candidates the density pass visited since the last takeNeighbours(), with COUNT_NEIGHBOURS, and the particle substeps since
+    std::atomic<long> visits;
+    long visitSamples;
+    
+    /// counting sorts and re-sorts since the last takeSortPasses(), one per rebuild
+    int sortPasses;
+    
+    inline void resize(int n) {
+        positions.resize(n);
+        velocities.resize(n);
+        ids.resize(n);
+        sceneIds.resize(n);
+        lives.resize(n);
+    }
+    
+    /// sizes the arrays a substep rewrites to the particles
+    inline void resizeScratch() {
+        tempPositions.resize(count);
+        tempVelocities.resize(count);
+        tempIds.resize(count);
+        tempSceneIds.resize(count);
+        tempLives.resize(count);
+        accelerations.resize(count);
+        xs.resize(count);
+        ys.resize(count);
+        vxs.resize(count);
+        vys.resize(count);
+        ws.resize(count);
+        axs.resize(count);
+        ays.resize(count);
+        hashes.resize(count);
+        order.resize(count);
+        sortedHashes.resize(count);
+    }
+    
+    /// adds the time since start to stage, when profiling
+    inline void record(int stage, nanosecond_type start) {
+        if(profiling)
+            stageTimes[stage] += std::chrono::duration<double, std::milli>(current_nanosecond - start).count();
+    }
+    
+    void hash();
+    
+    /// a stable counting sort of the particles by cell, split over the threads, which keeps sortedHashes when asked
+    void sort(bool keep);
+    
+    /// hashes the particles in the order of the last sort and counts those that changed cell, returns how many did
+    int rehash();
+    
+    /// merges the particles that changed cell back into the order of the last sort, after rehash()
+    void resort();
+    
+    void reorder();
+    
+    /// moves the particles that are still alive to the front, in the order they were in, dead is how many the adder counted
+    void removeDead(int dead);
+    
+    /// copies positions and velocities into cell order, one array per component
+    void gather();
+    
+    void density(float dt);
+    
+    void force(float dt);
+    
+    /**
+     * calls fn over chunks of cells, the even chunks first and then the odd ones
+     * a chunk spans at least as many cells as a forward neighbour can be ahead, so it only writes into itself and the next
+     */
+    void alternate(const std::function<void(int begin, int end)>& fn);
+    
+    void symmetricDensity(float dt);
+    
+    void symmetricForce(float dt);
+    
+    /// whether a particle moved far enough that the lists may miss a neighbour
+    bool listsExpired(float skin);
+    
+    /// lists the neighbours within D + skin from the 5x5 cells around each particle
+    void buildLists(float skin);
+    
+    void listDensity(float dt);
+    
+    void listForce(float dt);
+    
+    /// with lists on, it also finds how far the particles have moved from their anchors
+    void adder(float dt, bool lists);
+    
+    /// counts the particles of the slots that slept through the substep, and folds the marks the adder left into activity
+    void settle();
+    
+    /// appends the rows of desc the k-th substep emits, from nextRow on
+    void emitRows(const StepDesc& desc, int k);
+    
+    /// the first row of the current step that has not been emitted
+    int nextRow;
+    
+    void substep(const StepDesc& desc, int k);
+    
+public:
+    
+    /// 0 threads uses one per hardware thread, kernelName picks the neighbour kernels, the widest the cpu runs when it is NULL or the cpu cannot run them
+    inline NativeBackend(int threads, const char* kernelName = NULL) : pool(threads), kernels(pick_neighbour_kernels()) {
+        if(kernelName != NULL && !find_neighbour_kernels(kernelName, &kernels))
+            fprintf(stderr, "the %s kernels cannot run here, %s runs instead\n", kernelName, kernels.name);
+    }
+    
+    void initialize(float D, bool profiling);
+    
+    void clear();
+    
+    void add(const vec2* positions, const vec2* velocities, const int* ids, const int* sceneIds, const float* lifetimes, int n);
+    
+    int emit(const EmitDesc& desc);
+    
+    void step(const StepDesc& desc);
+    
+    /// the particles as the last step left them
+    const Readback& latest();
+    
+    /// the same as latest(), nothing is left running
+    inline const Readback& current() {
+        return latest();
+    }
+    
+    inline int getCount() const {
+        return count;
+    }
+    
+    inline std::string getName() const {
+        return "native, " + std::to_string(pool.getThreadCount()) + " threads, " + kernels.name;
+    }
+    
+    inline int getAliasedCandidates() {
+        return aliases.exchange(0);
+    }
+    
+    inline int takeRebuilds() {
+        int n = rebuilds;
+        rebuilds = 0;
+        return n;
+    }
+    
+    inline int takeSortPasses() {
+        int n = sortPasses;
+        sortPasses = 0;
+        return n;
+    }
+    
+    inline double takeNeighbours() {
+        double n = visitSamples > 0 ? visits.exchange(0) / (double)visitSamples : 0.0;
+        visitSamples = 0;
+        return n;
+    }
+    
+    /// steps are done by the time step() returns
+    inline void finish() {}
+    
+    /// nothing is built at run time
+    inline void waitForKernels() {}
+    
+    void takeStageTimes(double* times);
+    
+    /// the host does all the work, it never waits on anything
+    inline double takeWaitTime() {
+        return 0.0;
+    }
+};
+
+#endif /* NativeBackend_hpp */
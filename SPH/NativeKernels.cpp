@@ -0,0 +1,738 @@
+//
+//  NativeKernels.cpp
+//  SPH
+//
+//  Created by Arthur Sun on 6/23/19.
+//  Copyright © 2019 Arthur Sun. All rights reserved.
+//
+
+#include "NativeKernels.hpp"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+/**
+ * the pair terms of density and force in solver.cl, over candidates in cell order
+ * the vector versions are built for their instruction set with target attributes
+ * and picked at runtime, so the rest of the program keeps the baseline flags
+ */
+ 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || defined(__GNUC__))
+#define NATIVE_X86 1
+#include <immintrin.h>
+#else
+#define NATIVE_X86 0
+#endif
+
+/// what candidate j at (dx, dy), closer than D, adds to the force, j gets the opposite
+static inline void pair_force(const SoA& a, int j, float dx, float dy, float ds, float vx, float vy, float weight, float D, float dt, float* fx, float* fy) {
+    float dr = sqrtf(ds);
+    float w = 1.0f - dr/D;
+    float h = a.w[j] + weight;
+    float nx = dx / dr;
+    float ny = dy / dr;
+    
+    float s = -64.0f * w * h / D;
+    
+    float vn = (a.vx[j] - vx) * nx + (a.vy[j] - vy) * ny;
+    
+    if(vn < 0.0f)
+        s += 0.25f * std::max(w, std::min(-(dt / D) * vn, 0.5f)) * vn / dt;
+    
+    *fx = s * nx;
+    *fy = s * ny;
+}
+
+static float weight_scalar(const SoA& a, const Candidates& c, float px, float py, float D) {
+    const float D2 = D * D;
+    
+    float weight = 0.0f;
+    
+    for(int r = 0; r < c.runs; ++r) {
+        for(int j = c.begin[r]; j < c.end[r]; ++j) {
+            if(j == c.self) continue;
+            
+            float dx = a.x[j] - px;
+            float dy = a.y[j] - py;
+            float ds = dx * dx + dy * dy;
+            if(ds < D2)
+                weight += 1.0f - sqrtf(ds)/D;
+        }
+    }
+    
+    return weight;
+}
+
+static void force_scalar(const SoA& a, const Candidates& c, float px, float py, float vx, float vy, float weight, float D, float dt, float* ax, float* ay) {
+    const float D2 = D * D;
+    
+    float fx = 0.0f;
+    float fy = 0.0f;
+    
+    for(int r = 0; r < c.runs; ++r) {
+        for(int j = c.begin[r]; j < c.end[r]; ++j) {
+            if(j == c.self) continue;
+            
+            float dx = a.x[j] - px;
+            float dy = a.y[j] - py;
+            float ds = dx * dx + dy * dy;
+            
+            if(ds < D2) {
+                float cx, cy;
+                pair_force(a, j, dx, dy, ds, vx, vy, weight, D, dt, &cx, &cy);
+                fx += cx;
+                fy += cy;
+            }
+        }
+    }
+    
+    *ax += fx;
+    *ay += fy;
+}
+
+static float weight_list_scalar(const SoA& a, const int* list, int n, float px, float py, float D) {
+    const float D2 = D * D;
+    
+    float weight = 0.0f;
+    
+    for(int k = 0; k < n; ++k) {
+        int j = list[k];
+        float dx = a.x[j] - px;
+        float dy = a.y[j] - py;
+        float ds = dx * dx + dy * dy;
+        if(ds < D2)
+            weight += 1.0f - sqrtf(ds)/D;
+    }
+    
+    return weight;
+}
+
+static void force_list_scalar(const SoA& a, const int* list, int n, float px, float py, float vx, float vy, float weight, float D, float dt, float* ax, float* ay) {
+    const float D2 = D * D;
+    
+    float fx = 0.0f;
+    float fy = 0.0f;
+    
+    for(int k = 0; k < n; ++k) {
+        int j = list[k];
+        float dx = a.x[j] - px;
+        float dy = a.y[j] - py;
+        float ds = dx * dx + dy * dy;
+        
+        if(ds < D2) {
+            float cx, cy;
+            pair_force(a, j, dx, dy, ds, vx, vy, weight, D, dt, &cx, &cy);
+            fx += cx;
+            fy += cy;
+        }
+    }
+    
+    *ax += fx;
+    *ay += fy;
+}
+
+static float weight_half_scalar(const SoA& a, const Candidates& c, float px, float py, float D, float* sums) {
+    const float D2 = D * D;
+    
+    float weight = 0.0f;
+    
+    for(int r = 0; r < c.runs; ++r) {
+        for(int j = c.begin[r]; j < c.end[r]; ++j) {
+            float dx = a.x[j] - px;
+            float dy = a.y[j] - py;
+            float ds = dx * dx + dy * dy;
+            
+            if(ds < D2) {
+                float w = 1.0f - sqrtf(ds)/D;
+                weight += w;
+                sums[j] += w;
+            }
+        }
+    }
+    
+    return weight;
+}
+
+static void force_half_scalar(const SoA& a, const Candidates& c, float px, float py, float vx, float vy, float weight, float D, float dt, float* ax, float* ay, float* axs, float* ays) {
+    const float D2 = D * D;
+    
+    float fx = 0.0f;
+    float fy = 0.0f;
+    
+    for(int r = 0; r < c.runs; ++r) {
+        for(int j = c.begin[r]; j < c.end[r]; ++j) {
+            float dx = a.x[j] - px;
+            float dy = a.y[j] - py;
+            float ds = dx * dx + dy * dy;
+            
+            if(ds < D2) {
+                float cx, cy;
+                pair_force(a, j, dx, dy, ds, vx, vy, weight, D, dt, &cx, &cy);
+                fx += cx;
+                fy += cy;
+                axs[j] -= cx;
+                ays[j] -= cy;
+            }
+        }
+    }
+    
+    *ax += fx;
+    *ay += fy;
+}
+
+#if NATIVE_X86
+
+__attribute__((target("avx2,fma")))
+static float hsum_avx2(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+/// 8 candidates at a time, lanes past the end of a run are masked off and never loaded
+__attribute__((target("avx2,fma")))
+static float weight_avx2(const SoA& a, const Candidates& c, float px, float py, float D) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i self = _mm256_set1_epi32(c.self);
+    const __m256 D2 = _mm256_set1_ps(D * D);
+    const __m256 invD = _mm256_set1_ps(1.0f / D);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 x = _mm256_set1_ps(px);
+    const __m256 y = _mm256_set1_ps(py);
+    
+    __m256 weight = _mm256_setzero_ps();
+    
+    for(int r = 0; r < c.runs; ++r) {
+        const __m256i end = _mm256_set1_epi32(c.end[r]);
+        
+        for(int j = c.begin[r]; j < c.end[r]; j += 8) {
+            __m256i index = _mm256_add_epi32(_mm256_set1_epi32(j), lanes);
+            __m256i mask = _mm256_andnot_si256(_mm256_cmpeq_epi32(index, self), _mm256_cmpgt_epi32(end, index));
+            
+            __m256 dx = _mm256_sub_ps(_mm256_maskload_ps(a.x + j, mask), x);
+            __m256 dy = _mm256_sub_ps(_mm256_maskload_ps(a.y + j, mask), y);
+            __m256 ds = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+            
+            __m256 in = _mm256_and_ps(_mm256_castsi256_ps(mask), _mm256_cmp_ps(ds, D2, _CMP_LT_OQ));
+            __m256 w = _mm256_fnmadd_ps(_mm256_sqrt_ps(ds), invD, one);
+            
+            weight = _mm256_add_ps(weight, _mm256_and_ps(in, w));
+        }
+    }
+    
+    return hsum_avx2(weight);
+}
+
+/// what the AVX2 force kernels broadcast once per particle
+struct ForceAVX2
+{
+    __m256 D2, invD, pressure, viscosity, nqd, half, one, zero, x, y, u, v, h0;
+};
+
+__attribute__((target("avx2,fma")))
+static inline void broadcast_avx2(ForceAVX2& k, float px, float py, float vx, float vy, float weight, float D, float dt) {
+    k.D2 = _mm256_set1_ps(D * D);
+    k.invD = _mm256_set1_ps(1.0f / D);
+    k.pressure = _mm256_set1_ps(-64.0f / D);
+    k.viscosity = _mm256_set1_ps(0.25f / dt);
+    k.nqd = _mm256_set1_ps(-dt / D);
+    k.half = _mm256_set1_ps(0.5f);
+    k.one = _mm256_set1_ps(1.0f);
+    k.zero = _mm256_setzero_ps();
+    k.x = _mm256_set1_ps(px);
+    k.y = _mm256_set1_ps(py);
+    k.u = _mm256_set1_ps(vx);
+    k.v = _mm256_set1_ps(vy);
+    k.h0 = _mm256_set1_ps(weight);
+}
+
+/**
+ * what each lane adds to the force, zero in lanes outside D
+ * they are masked after the products, coincident candidates would otherwise turn them into NaN
+ */
+__attribute__((target("avx2,fma")))
+static inline void pair_force_avx2(const ForceAVX2& k, __m256 dx, __m256 dy, __m256 in, __m256 jw, __m256 jvx, __m256 jvy, __m256* cx, __m256* cy) {
+    __m256 ds = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+    in = _mm256_and_ps(in, _mm256_cmp_ps(ds, k.D2, _CMP_LT_OQ));
+    
+    __m256 dr = _mm256_sqrt_ps(ds);
+    __m256 w = _mm256_fnmadd_ps(dr, k.invD, k.one);
+    __m256 h = _mm256_add_ps(jw, k.h0);
+    __m256 nx = _mm256_div_ps(dx, dr);
+    __m256 ny = _mm256_div_ps(dy, dr);
+    
+    __m256 s = _mm256_mul_ps(_mm256_mul_ps(k.pressure, w), h);
+    
+    __m256 vn = _mm256_fmadd_ps(_mm256_sub_ps(jvx, k.u), nx, _mm256_mul_ps(_mm256_sub_ps(jvy, k.v), ny));
+    __m256 g = _mm256_mul_ps(_mm256_mul_ps(k.viscosity, _mm256_max_ps(w, _mm256_min_ps(_mm256_mul_ps(k.nqd, vn), k.half))), vn);
+    s = _mm256_add_ps(s, _mm256_and_ps(_mm256_cmp_ps(vn, k.zero, _CMP_LT_OQ), g));
+    
+    *cx = _mm256_and_ps(in, _mm256_mul_ps(s, nx));
+    *cy = _mm256_and_ps(in, _mm256_mul_ps(s, ny));
+}
+
+__attribute__((target("avx2,fma")))
+static void force_avx2(const SoA& a, const Candidates& c, float px, float py, float vx, float vy, float weight, float D, float dt, float* ax, float* ay) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i self = _mm256_set1_epi32(c.self);
+    
+    ForceAVX2 k;
+    broadcast_avx2(k, px, py, vx, vy, weight, D, dt);
+    
+    __m256 fx = _mm256_setzero_ps();
+    __m256 fy = _mm256_setzero_ps();
+    
+    for(int r = 0; r < c.runs; ++r) {
+        const __m256i end = _mm256_set1_epi32(c.end[r]);
+        
+        for(int j = c.begin[r]; j < c.end[r]; j += 8) {
+            __m256i index = _mm256_add_epi32(_mm256_set1_epi32(j), lanes);
+            __m256i mask = _mm256_andnot_si256(_mm256_cmpeq_epi32(index, self), _mm256_cmpgt_epi32(end, index));
+            
+            __m256 dx = _mm256_sub_ps(_mm256_maskload_ps(a.x + j, mask), k.x);
+            __m256 dy = _mm256_sub_ps(_mm256_maskload_ps(a.y + j, mask), k.y);
+            
+            __m256 cx, cy;
+            pair_force_avx2(k, dx, dy, _mm256_castsi256_ps(mask), _mm256_maskload_ps(a.w + j, mask), _mm256_maskload_ps(a.vx + j, mask), _mm256_maskload_ps(a.vy + j, mask), &cx, &cy);
+            
+            fx = _mm256_add_ps(fx, cx);
+            fy = _mm256_add_ps(fy, cy);
+        }
+    }
+    
+    *ax += hsum_avx2(fx);
+    *ay += hsum_avx2(fy);
+}
+
+/// the lists are gathered 8 at a time, lanes past n are masked off and never loaded
+__attribute__((target("avx2,fma")))
+static float weight_list_avx2(const SoA& a, const int* list, int n, float px, float py, float D) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i end = _mm256_set1_epi32(n);
+    const __m256 D2 = _mm256_set1_ps(D * D);
+    const __m256 invD = _mm256_set1_ps(1.0f / D);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 x = _mm256_set1_ps(px);
+    const __m256 y = _mm256_set1_ps(py);
+    
+    __m256 weight = _mm256_setzero_ps();
+    
+    for(int k = 0; k < n; k += 8) {
+        __m256i mask = _mm256_cmpgt_epi32(end, _mm256_add_epi32(_mm256_set1_epi32(k), lanes));
+        __m256i index = _mm256_maskload_epi32(list + k, mask);
+        __m256 m = _mm256_castsi256_ps(mask);
+        
+        __m256 dx = _mm256_sub_ps(_mm256_mask_i32gather_ps(zero, a.x, index, m, 4), x);
+        __m256 dy = _mm256_sub_ps(_mm256_mask_i32gather_ps(zero, a.y, index, m, 4), y);
+        __m256 ds = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+        
+        __m256 in = _mm256_and_ps(m, _mm256_cmp_ps(ds, D2, _CMP_LT_OQ));
+        __m256 w = _mm256_fnmadd_ps(_mm256_sqrt_ps(ds), invD, one);
+        
+        weight = _mm256_add_ps(weight, _mm256_and_ps(in, w));
+    }
+    
+    return hsum_avx2(weight);
+}
+
+__attribute__((target("avx2,fma")))
+static void force_list_avx2(const SoA& a, const int* list, int n, float px, float py, float vx, float vy, float weight, float D, float dt, float* ax, float* ay) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i end = _mm256_set1_epi32(n);
+    
+    ForceAVX2 k;
+    broadcast_avx2(k, px, py, vx, vy, weight, D, dt);
+    
+    __m256 fx = _mm256_setzero_ps();
+    __m256 fy = _mm256_setzero_ps();
+    
+    for(int i = 0; i < n; i += 8) {
+        __m256i mask = _mm256_cmpgt_epi32(end, _mm256_add_epi32(_mm256_set1_epi32(i), lanes));
+        __m256i index = _mm256_maskload_epi32(list + i, mask);
+        __m256 m = _mm256_castsi256_ps(mask);
+        
+        __m256 dx = _mm256_sub_ps(_mm256_mask_i32gather_ps(k.zero, a.x, index, m, 4), k.x);
+        __m256 dy = _mm256_sub_ps(_mm256_mask_i32gather_ps(k.zero, a.y, index, m, 4), k.y);
+        
+        __m256 cx, cy;
+        pair_force_avx2(k, dx, dy, m, _mm256_mask_i32gather_ps(k.zero, a.w, index, m, 4), _mm256_mask_i32gather_ps(k.zero, a.vx, index, m, 4), _mm256_mask_i32gather_ps(k.zero, a.vy, index, m, 4), &cx, &cy);
+        
+        fx = _mm256_add_ps(fx, cx);
+        fy = _mm256_add_ps(fy, cy);
+    }
+    
+    *ax += hsum_avx2(fx);
+    *ay += hsum_avx2(fy);
+}
+
+/// 16 candidates at a time, with mask registers instead of blends
+__attribute__((target("avx512f")))
+static float weight_avx512(const SoA& a, const Candidates& c, float px, float py, float D) {
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i self = _mm512_set1_epi32(c.self);
+    const __m512 D2 = _mm512_set1_ps(D * D);
+    const __m512 invD = _mm512_set1_ps(1.0f / D);
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 x = _mm512_set1_ps(px);
+    const __m512 y = _mm512_set1_ps(py);
+    
+    __m512 weight = _mm512_setzero_ps();
+    
+    for(int r = 0; r < c.runs; ++r) {
+        const __m512i end = _mm512_set1_epi32(c.end[r]);
+        
+        for(int j = c.begin[r]; j < c.end[r]; j += 16) {
+            __m512i index = _mm512_add_epi32(_mm512_set1_epi32(j), lanes);
+            __mmask16 mask = _mm512_cmplt_epi32_mask(index, end) & _mm512_cmpneq_epi32_mask(index, self);
+            
+            __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a.x + j), x);
+            __m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a.y + j), y);
+            __m512 ds = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+            
+            __mmask16 in = _mm512_mask_cmp_ps_mask(mask, ds, D2, _CMP_LT_OQ);
+            
+            weight = _mm512_mask_add_ps(weight, in, weight, _mm512_fnmadd_ps(_mm512_sqrt_ps(ds), invD, one));
+        }
+    }
+    
+    return _mm512_reduce_add_ps(weight);
+}
+
+/// a forward run holds neither the particle nor a candidate twice, so the candidates' sums load, add and store as vectors
+__attribute__((target("avx2,fma")))
+static float weight_half_avx2(const SoA& a, const Candidates& c, float px, float py, float D, float* sums) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 D2 = _mm256_set1_ps(D * D);
+    const __m256 invD = _mm256_set1_ps(1.0f / D);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 x = _mm256_set1_ps(px);
+    const __m256 y = _mm256_set1_ps(py);
+    
+    __m256 weight = _mm256_setzero_ps();
+    
+    for(int r = 0; r < c.runs; ++r) {
+        const __m256i end = _mm256_set1_epi32(c.end[r]);
+        
+        for(int j = c.begin[r]; j < c.end[r]; j += 8) {
+            __m256i mask = _mm256_cmpgt_epi32(end, _mm256_add_epi32(_mm256_set1_epi32(j), lanes));
+            
+            __m256 dx = _mm256_sub_ps(_mm256_maskload_ps(a.x + j, mask), x);
+            __m256 dy = _mm256_sub_ps(_mm256_maskload_ps(a.y + j, mask), y);
+            __m256 ds = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+            
+            __m256 in = _mm256_and_ps(_mm256_castsi256_ps(mask), _mm256_cmp_ps(ds, D2, _CMP_LT_OQ));
+            __m256 w = _mm256_and_ps(in, _mm256_fnmadd_ps(_mm256_sqrt_ps(ds), invD, one));
+            
+            weight = _mm256_add_ps(weight, w);
+            _mm256_maskstore_ps(sums + j, mask, _mm256_add_ps(_mm256_maskload_ps(sums + j, mask), w));
+        }
+    }
+    
+    return hsum_avx2(weight);
+}
+
+__attribute__((target("avx2,fma")))
+static void force_half_avx2(const SoA& a, const Candidates& c, float px, float py, float vx, float vy, float weight, float D, float dt, float* ax, float* ay, float* axs, float* ays) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    
+    ForceAVX2 k;
+    broadcast_avx2(k, px, py, vx, vy, weight, D, dt);
+    
+    __m256 fx = _mm256_setzero_ps();
+    __m256 fy = _mm256_setzero_ps();
+    
+    for(int r = 0; r < c.runs; ++r) {
+        const __m256i end = _mm256_set1_epi32(c.end[r]);
+        
+        for(int j = c.begin[r]; j < c.end[r]; j += 8) {
+            __m256i mask = _mm256_cmpgt_epi32(end, _mm256_add_epi32(_mm256_set1_epi32(j), lanes));
+            
+            __m256 dx = _mm256_sub_ps(_mm256_maskload_ps(a.x + j, mask), k.x);
+            __m256 dy = _mm256_sub_ps(_mm256_maskload_ps(a.y + j, mask), k.y);
+            
+            __m256 cx, cy;
+            pair_force_avx2(k, dx, dy, _mm256_castsi256_ps(mask), _mm256_maskload_ps(a.w + j, mask), _mm256_maskload_ps(a.vx + j, mask), _mm256_maskload_ps(a.vy + j, mask), &cx, &cy);
+            
+            fx = _mm256_add_ps(fx, cx);
+            fy = _mm256_add_ps(fy, cy);
+            _mm256_maskstore_ps(axs + j, mask, _mm256_sub_ps(_mm256_maskload_ps(axs + j, mask), cx));
+            _mm256_maskstore_ps(ays + j, mask, _mm256_sub_ps(_mm256_maskload_ps(ays + j, mask), cy));
+        }
+    }
+    
+    *ax += hsum_avx2(fx);
+    *ay += hsum_avx2(fy);
+}
+
+/// what the AVX-512 force kernels broadcast once per particle
+struct ForceAVX512
+{
+    __m512 D2, invD, pressure, viscosity, nqd, half, one, zero, x, y, u, v, h0;
+};
+
+__attribute__((target("avx512f")))
+static inline void broadcast_avx512(ForceAVX512& k, float px, float py, float vx, float vy, float weight, float D, float dt) {
+    k.D2 = _mm512_set1_ps(D * D);
+    k.invD = _mm512_set1_ps(1.0f / D);
+    k.pressure = _mm512_set1_ps(-64.0f / D);
+    k.viscosity = _mm512_set1_ps(0.25f / dt);
+    k.nqd = _mm512_set1_ps(-dt / D);
+    k.half = _mm512_set1_ps(0.5f);
+    k.one = _mm512_set1_ps(1.0f);
+    k.zero = _mm512_setzero_ps();
+    k.x = _mm512_set1_ps(px);
+    k.y = _mm512_set1_ps(py);
+    k.u = _mm512_set1_ps(vx);
+    k.v = _mm512_set1_ps(vy);
+    k.h0 = _mm512_set1_ps(weight);
+}
+
+/**
+ * the lanes of mask closer than D, and what each of them adds to the force in cx and cy
+ * load(in, f) loads field f of the candidates in those lanes, they are only loaded when there are any
+ */
+template<typename Load>
+__attribute__((target("avx512f")))
+static inline __mmask16 pair_force_avx512(const ForceAVX512& k, __m512 dx, __m512 dy, __mmask16 mask, Load load, __m512* cx, __m512* cy) {
+    __m512 ds = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+    
+    __mmask16 in = _mm512_mask_cmp_ps_mask(mask, ds, k.D2, _CMP_LT_OQ);
+    
+    if(in == 0) return in;
+    
+    __m512 dr = _mm512_sqrt_ps(ds);
+    __m512 w = _mm512_fnmadd_ps(dr, k.invD, k.one);
+    __m512 h = _mm512_add_ps(load(in, 0), k.h0);
+    __m512 nx = _mm512_div_ps(dx, dr);
+    __m512 ny = _mm512_div_ps(dy, dr);
+    
+    __m512 s = _mm512_mul_ps(_mm512_mul_ps(k.pressure, w), h);
+    
+    __m512 vn = _mm512_fmadd_ps(_mm512_sub_ps(load(in, 1), k.u), nx, _mm512_mul_ps(_mm512_sub_ps(load(in, 2), k.v), ny));
+    __m512 g = _mm512_mul_ps(_mm512_mul_ps(k.viscosity, _mm512_max_ps(w, _mm512_min_ps(_mm512_mul_ps(k.nqd, vn), k.half))), vn);
+    s = _mm512_mask_add_ps(s, _mm512_cmp_ps_mask(vn, k.zero, _CMP_LT_OQ), s, g);
+    
+    *cx = _mm512_maskz_mul_ps(in, s, nx);
+    *cy = _mm512_maskz_mul_ps(in, s, ny);
+    
+    return in;
+}
+
+__attribute__((target("avx512f")))
+static void force_avx512(const SoA& a, const Candidates& c, float px, float py, float vx, float vy, float weight, float D, float dt, float* ax, float* ay) {
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i self = _mm512_set1_epi32(c.self);
+    const float* const fields[3] = {a.w, a.vx, a.vy};
+    
+    ForceAVX512 k;
+    broadcast_avx512(k, px, py, vx, vy, weight, D, dt);
+    
+    __m512 fx = _mm512_setzero_ps();
+    __m512 fy = _mm512_setzero_ps();
+    
+    for(int r = 0; r < c.runs; ++r) {
+        const __m512i end = _mm512_set1_epi32(c.end[r]);
+        
+        for(int j = c.begin[r]; j < c.end[r]; j += 16) {
+            __m512i index = _mm512_add_epi32(_mm512_set1_epi32(j), lanes);
+            __mmask16 mask = _mm512_cmplt_epi32_mask(index, end) & _mm512_cmpneq_epi32_mask(index, self);
+            
+            __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a.x + j), k.x);
+            __m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a.y + j), k.y);
+            
+            __m512 cx, cy;
+            
+            if(pair_force_avx512(k, dx, dy, mask, [&](__mmask16 in, int f) __attribute__((target("avx512f"))) { return _mm512_maskz_loadu_ps(in, fields[f] + j); }, &cx, &cy)) {
+                fx = _mm512_add_ps(fx, cx);
+                fy = _mm512_add_ps(fy, cy);
+            }
+        }
+    }
+    
+    *ax += _mm512_reduce_add_ps(fx);
+    *ay += _mm512_reduce_add_ps(fy);
+}
+
+/// the lists are gathered 16 at a time
+__attribute__((target("avx512f")))
+static float weight_list_avx512(const SoA& a, const int* list, int n, float px, float py, float D) {
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i end = _mm512_set1_epi32(n);
+    const __m512 D2 = _mm512_set1_ps(D * D);
+    const __m512 invD = _mm512_set1_ps(1.0f / D);
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 x = _mm512_set1_ps(px);
+    const __m512 y = _mm512_set1_ps(py);
+    
+    __m512 weight = _mm512_setzero_ps();
+    
+    for(int k = 0; k < n; k += 16) {
+        __mmask16 mask = _mm512_cmplt_epi32_mask(_mm512_add_epi32(_mm512_set1_epi32(k), lanes), end);
+        __m512i index = _mm512_maskz_loadu_epi32(mask, list + k);
+        
+        __m512 dx = _mm512_sub_ps(_mm512_mask_i32gather_ps(zero, mask, index, a.x, 4), x);
+        __m512 dy = _mm512_sub_ps(_mm512_mask_i32gather_ps(zero, mask, index, a.y, 4), y);
+        __m512 ds = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+        
+        __mmask16 in = _mm512_mask_cmp_ps_mask(mask, ds, D2, _CMP_LT_OQ);
+        
+        weight = _mm512_mask_add_ps(weight, in, weight, _mm512_fnmadd_ps(_mm512_sqrt_ps(ds), invD, one));
+    }
+    
+    return _mm512_reduce_add_ps(weight);
+}
+
+__attribute__((target("avx512f")))
+static void force_list_avx512(const SoA& a, const int* list, int n, float px, float py, float vx, float vy, float weight, float D, float dt, float* ax, float* ay) {
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i end = _mm512_set1_epi32(n);
+    const float* const fields[3] = {a.w, a.vx, a.vy};
+    
+    ForceAVX512 k;
+    broadcast_avx512(k, px, py, vx, vy, weight, D, dt);
+    
+    __m512 fx = _mm512_setzero_ps();
+    __m512 fy = _mm512_setzero_ps();
+    
+    for(int i = 0; i < n; i += 16) {
+        __mmask16 mask = _mm512_cmplt_epi32_mask(_mm512_add_epi32(_mm512_set1_epi32(i), lanes), end);
+        __m512i index = _mm512_maskz_loadu_epi32(mask, list + i);
+        
+        __m512 dx = _mm512_sub_ps(_mm512_mask_i32gather_ps(k.zero, mask, index, a.x, 4), k.x);
+        __m512 dy = _mm512_sub_ps(_mm512_mask_i32gather_ps(k.zero, mask, index, a.y, 4), k.y);
+        
+        __m512 cx, cy;
+        
+        if(pair_force_avx512(k, dx, dy, mask, [&](__mmask16 in, int f) __attribute__((target("avx512f"))) { return _mm512_mask_i32gather_ps(k.zero, in, index, fields[f], 4); }, &cx, &cy)) {
+            fx = _mm512_add_ps(fx, cx);
+            fy = _mm512_add_ps(fy, cy);
+        }
+    }
+    
+    *ax += _mm512_reduce_add_ps(fx);
+    *ay += _mm512_reduce_add_ps(fy);
+}
+
+__attribute__((target("avx512f")))
+static float weight_half_avx512(const SoA& a, const Candidates& c, float px, float py, float D, float* sums) {
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512 D2 = _mm512_set1_ps(D * D);
+    const __m512 invD = _mm512_set1_ps(1.0f / D);
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 x = _mm512_set1_ps(px);
+    const __m512 y = _mm512_set1_ps(py);
+    
+    __m512 weight = _mm512_setzero_ps();
+    
+    for(int r = 0; r < c.runs; ++r) {
+        const __m512i end = _mm512_set1_epi32(c.end[r]);
+        
+        for(int j = c.begin[r]; j < c.end[r]; j += 16) {
+            __mmask16 mask = _mm512_cmplt_epi32_mask(_mm512_add_epi32(_mm512_set1_epi32(j), lanes), end);
+            
+            __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a.x + j), x);
+            __m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a.y + j), y);
+            __m512 ds = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+            
+            __mmask16 in = _mm512_mask_cmp_ps_mask(mask, ds, D2, _CMP_LT_OQ);
+            
+            if(in == 0) continue;
+            
+            __m512 w = _mm512_maskz_fnmadd_ps(in, _mm512_sqrt_ps(ds), invD, one);
+            
+            weight = _mm512_add_ps(weight, w);
+            _mm512_mask_storeu_ps(sums + j, in, _mm512_add_ps(_mm512_maskz_loadu_ps(in, sums + j), w));
+        }
+    }
+    
+    return _mm512_reduce_add_ps(weight);
+}
+
+__attribute__((target("avx512f")))
+static void force_half_avx512(const SoA& a, const Candidates& c, float px, float py, float vx, float vy, float weight, float D, float dt, float* ax, float* ay, float* axs, float* ays) {
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const float* const fields[3] = {a.w, a.vx, a.vy};
+    
+    ForceAVX512 k;
+    broadcast_avx512(k, px, py, vx, vy, weight, D, dt);
+    
+    __m512 fx = _mm512_setzero_ps();
+    __m512 fy = _mm512_setzero_ps();
+    
+    for(int r = 0; r < c.runs; ++r) {
+        const __m512i end = _mm512_set1_epi32(c.end[r]);
+        
+        for(int j = c.begin[r]; j < c.end[r]; j += 16) {
+            __mmask16 mask = _mm512_cmplt_epi32_mask(_mm512_add_epi32(_mm512_set1_epi32(j), lanes), end);
+            
+            __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a.x + j), k.x);
+            __m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a.y + j), k.y);
+            
+            __m512 cx, cy;
+            __mmask16 in = pair_force_avx512(k, dx, dy, mask, [&](__mmask16 in, int f) __attribute__((target("avx512f"))) { return _mm512_maskz_loadu_ps(in, fields[f] + j); }, &cx, &cy);
+            
+            if(in == 0) continue;
+            
+            fx = _mm512_add_ps(fx, cx);
+            fy = _mm512_add_ps(fy, cy);
+            _mm512_mask_storeu_ps(axs + j, in, _mm512_sub_ps(_mm512_maskz_loadu_ps(in, axs + j), cx));
+            _mm512_mask_storeu_ps(ays + j, in, _mm512_sub_ps(_mm512_maskz_loadu_ps(in, ays + j), cy));
+        }
+    }
+    
+    *ax += _mm512_reduce_add_ps(fx);
+    *ay += _mm512_reduce_add_ps(fy);
+}
+
+#endif
+
+static NeighbourKernels scalar_neighbour_kernels() {
+    NeighbourKernels k = {"scalar", weight_scalar, force_scalar, weight_list_scalar, force_list_scalar, weight_half_scalar, force_half_scalar};
+    return k;
+}
+
+NeighbourKernels pick_neighbour_kernels() {
+#if NATIVE_X86
+    __builtin_cpu_init();
+    
+    if(__builtin_cpu_supports("avx512f")) {
+        NeighbourKernels k = {"avx512", weight_avx512, force_avx512, weight_list_avx512, force_list_avx512, weight_half_avx512, force_half_avx512};
+        return k;
+    }
+    
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        NeighbourKernels k = {"avx2", weight_avx2, force_avx2, weight_list_avx2, force_list_avx2, weight_half_avx2, force_half_avx2};
+        return k;
+    }
+#endif
+    
+    return scalar_neighbour_kernels();
+}
+
+bool find_neighbour_kernels(const char* name, NeighbourKernels* kernels) {
+    if(strcmp(name, "scalar") == 0) {
+        *kernels = scalar_neighbour_kernels();
+        return true;
+    }
+    
+#if NATIVE_X86
+    __builtin_cpu_init();
+    
+    if(strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512f")) {
+        NeighbourKernels k = {"avx512", weight_avx512, force_avx512, weight_list_avx512, force_list_avx512, weight_half_avx512, force_half_avx512};
+        *kernels = k;
+        return true;
+    }
+    
+    if(strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        NeighbourKernels k = {"avx2", weight_avx2, force_avx2, weight_list_avx2, force_list_avx2, weight_half_avx2, force_half_avx2};
+        *kernels = k;
+        return true;
+    }
+#endif
+    
+    return false;
+}
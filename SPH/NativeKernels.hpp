@@ -0,0 +1,74 @@
+//
+//  NativeKernels.hpp
+//  SPH
+//
+//  Created by Arthur Sun on 6/23/19.
+//  Copyright © 2019 Arthur Sun. All rights reserved.
+//
+
+#ifndef NativeKernels_hpp
+#define NativeKernels_hpp
+
+/// at most one run per row of the 5x5 cells the neighbour lists are built from, more when neighbouring slots are not next to each other
+#define MAX_CANDIDATE_RUNS 25
+
+/// particle data in cell order, one array per component so candidates load straight into vector registers
+struct SoA
+{
+    const float* x;
+    const float* y;
+    const float* vx;
+    const float* vy;
+    
+    /// the densities the weight pass left
+    const float* w;
+};
+
+/// the candidate neighbours of one particle, runs of the cell-ordered arrays
+struct Candidates
+{
+    int begin[MAX_CANDIDATE_RUNS];
+    int end[MAX_CANDIDATE_RUNS];
+    int runs;
+    
+    /// where the particle itself sits, it is skipped
+    int self;
+};
+
+/// sum of 1 - r/D over the candidates closer than D
+typedef float (*WeightKernel)(const SoA& a, const Candidates& c, float px, float py, float D);
+
+/// adds the pressure and viscosity of the candidates closer than D to a
+typedef void (*ForceKernel)(const SoA& a, const Candidates& c, float px, float py, float vx, float vy, float weight, float D, float dt, float* ax, float* ay);
+
+/// the same over n cell-order indices from a neighbour list
+typedef float (*WeightListKernel)(const SoA& a, const int* list, int n, float px, float py, float D);
+
+typedef void (*ForceListKernel)(const SoA& a, const int* list, int n, float px, float py, float vx, float vy, float weight, float D, float dt, float* ax, float* ay);
+
+/**
+ * the same over forward candidates only, each pair visited once
+ * what a pair adds to the particle is returned, and added to the candidate in sums, or taken from it in ax and ay
+ */
+typedef float (*WeightHalfKernel)(const SoA& a, const Candidates& c, float px, float py, float D, float* sums);
+
+typedef void (*ForceHalfKernel)(const SoA& a, const Candidates& c, float px, float py, float vx, float vy, float weight, float D, float dt, float* ax, float* ay, float* axs, float* ays);
+
+struct NeighbourKernels
+{
+    const char* name;
+    WeightKernel weight;
+    ForceKernel force;
+    WeightListKernel weightList;
+    ForceListKernel forceList;
+    WeightHalfKernel weightHalf;
+    ForceHalfKernel forceHalf;
+};
+
+/// the widest kernels the cpu runs, AVX-512, AVX2 or scalar
+NeighbourKernels pick_neighbour_kernels();
+
+/// the kernels called name, scalar, avx2 or avx512, false when there are none by that name or the cpu cannot run them
+bool find_neighbour_kernels(const char* name, NeighbourKernels* kernels);
+
+#endif /* NativeKernels_hpp */
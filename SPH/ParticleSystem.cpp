@@ -7,145 +7,610 @@
 //
 
 #include "ParticleSystem.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
-void ParticleSystem::sortProxies() {
-    size_t size = count;
+/// what a snapshot with h's counts takes up, in bytes
+static size_t snapshot_bytes(const SnapshotHeader& h) {
+    return sizeof(SnapshotHeader) + (size_t)(h.sceneCount - 1) * sizeof(Scene) + (size_t)h.obstacleCount * sizeof(SnapshotObstacle) + (size_t)h.vertexCount * sizeof(vec2) + (size_t)h.nozzleCount * (sizeof(Nozzle) + sizeof(NozzleFlow)) + (size_t)h.count * (2 * sizeof(vec2) + 2 * sizeof(int) + sizeof(float));
+}
+
+/// the bounds are finite and hold some room, what the grid of a scene is laid over
+static bool bounds_valid(const vec2& lowerBound, const vec2& upperBound) {
+    vec2 extent = upperBound - lowerBound;
+    return std::isfinite(extent.x) && std::isfinite(extent.y) && extent.x > 0.0f && extent.y > 0.0f;
+}
+
+void ParticleSystem::initialize(float D) {
+    nextId = 0;
+    diameter = D;
+    stagedSpeed = 0.0f;
+    lastStagedSpeed = 0.0f;
+    substeps = 0;
+    statSteps = 0;
+    statSubsteps = 0;
+    statsHeaderFile = NULL;
+    mortal = false;
+    
+    delete backend;
+    
+    if(backendType == backend_native)
+        backend = new NativeBackend(threads, nativeKernels);
+    else
+        backend = new CLBackend();
+    
+    backend->initialize(D, profiling);
+    
+    if(trajectory != NULL)
+        trajectory->restart();
+}
+
+void ParticleSystem::upload() {
+    int n = (int)stagedPositions.size();
     
-    int k = 0;
+    if(n == 0)
+        return;
     
-    clSetKernelArg(sorter, 0, sizeof(proxies), (void*)&proxies);
-    clSetKernelArg(sorter, 1, sizeof(tempProxies), (void*)&tempProxies);
-    clSetKernelArg(sorter, 2, sizeof(k), (void*)&k);
-    clSetKernelArg(sorter, 3, sizeof(size), (void*)&size);
+    stagedIds.resize(n);
+    for(int i = 0; i < n; ++i) {
+        stagedIds[i] = nextId++;
+        stagedSpeed = std::max(stagedSpeed, sqrtf(stagedVelocities[i].lengthSq()) * scenes[stagedSceneIds[i]].timeScale);
+    }
     
-    assert(clEnqueueTask(queue, sorter, 0, NULL, NULL) == CL_SUCCESS);
+    /// without anything that can die the backend does not need to hear about lifetimes
+    backend->add(stagedPositions.data(), stagedVelocities.data(), stagedIds.data(), stagedSceneIds.data(), mortal ? stagedLifetimes.data() : NULL, n);
     
-    k = 8;
+    stagedPositions.clear();
+    stagedVelocities.clear();
+    stagedSceneIds.clear();
+    stagedLifetimes.clear();
+}
+
+void ParticleSystem::add(int scene, const Shape& shape, const vec2& linearVelocity, float dist, float lifetime) {
+    assert(scene >= 0 && scene < (int)scenes.size());
     
-    clSetKernelArg(sorter, 0, sizeof(tempProxies), (void*)&tempProxies);
-    clSetKernelArg(sorter, 1, sizeof(proxies), (void*)&proxies);
-    clSetKernelArg(sorter, 2, sizeof(k), (void*)&k);
+    if(!(lifetime > 0.0f))
+        return;
     
-    assert(clEnqueueTask(queue, sorter, 0, NULL, NULL) == CL_SUCCESS);
+    upload();
     
-    k = 16;
+    /// the backend tests against the fields, which need the scene bounds of the next step
+    layoutScenes();
+    layoutFields();
     
-    clSetKernelArg(sorter, 0, sizeof(proxies), (void*)&proxies);
-    clSetKernelArg(sorter, 1, sizeof(tempProxies), (void*)&tempProxies);
-    clSetKernelArg(sorter, 2, sizeof(k), (void*)&k);
+    AABB aabb = shape.aabb();
     
-    assert(clEnqueueTask(queue, sorter, 0, NULL, NULL) == CL_SUCCESS);
+    EmitDesc e;
+    e.vertices = shape.vertices;
+    e.normals = shape.normals;
+    e.vertexCount = shape.count;
+    e.lower = aabb.lowerBound;
+    e.stride = diameter * dist;
     
-    k = 24;
+    /// as many points as stepping stride from the lower corner used to visit, so a shape fills with the same particles
+    e.columns = 0;
+    e.rows = 0;
     
-    clSetKernelArg(sorter, 0, sizeof(tempProxies), (void*)&tempProxies);
-    clSetKernelArg(sorter, 1, sizeof(proxies), (void*)&proxies);
-    clSetKernelArg(sorter, 2, sizeof(k), (void*)&k);
+    for(float x = aabb.lowerBound.x; x < aabb.upperBound.x; x += e.stride)
+        ++e.columns;
     
-    assert(clEnqueueTask(queue, sorter, 0, NULL, NULL) == CL_SUCCESS);
+    for(float y = aabb.lowerBound.y; y < aabb.upperBound.y; y += e.stride)
+        ++e.rows;
     
-    clFlush(queue);
-    clFinish(queue);
-}
-
-void ParticleSystem::createProxies() {
-    size_t size = count;
+    e.velocity = linearVelocity;
+    e.lifetime = lifetime;
+    e.scene = scene;
+    e.firstId = nextId;
+    e.limit = MAX_PARTICLE_COUNT - getCount();
+    e.scenes = scenes.data();
+    e.sceneCount = (int)scenes.size();
+    e.field = field.data();
+    e.fieldLength = (int)field.size();
+    e.fieldVersion = fieldVersion;
     
-    clSetKernelArg(hasher, 0, sizeof(positions_cl), (void*)&positions_cl);
-    clSetKernelArg(hasher, 1, sizeof(proxies), (void*)&proxies);
-    clSetKernelArg(hasher, 2, sizeof(diameter), (void*)&diameter);
-    clSetKernelArg(hasher, 3, sizeof(count), (void*)&count);
+    int n = backend->emit(e);
     
-    clEnqueueNDRangeKernel(queue, hasher, 1, NULL, &size, NULL, 0, NULL, NULL);
+    nextId += n;
+    mortal = mortal || (n > 0 && lifetime < INFINITY);
     
-    clFlush(queue);
-    clFinish(queue);
+    if(n > 0)
+        stagedSpeed = std::max(stagedSpeed, sqrtf(linearVelocity.lengthSq()) * scenes[scene].timeScale);
 }
 
-void ParticleSystem::toOffsetList() {
-    size_t size = count;
+int ParticleSystem::addNozzle(const vec2& position, const vec2& velocity, float width, float rate, int scene, float dist, float lifetime) {
+    assert(scene >= 0 && scene < (int)scenes.size() && velocity.lengthSq() > 0.0f);
     
-    clSetKernelArg(toList, 0, sizeof(proxies), (void*)&proxies);
-    clSetKernelArg(toList, 1, sizeof(offsetList), (void*)&offsetList);
+    float stride = diameter * dist;
     
-    clEnqueueNDRangeKernel(queue, toList, 1, NULL, &size, NULL, 0, NULL, NULL);
+    Nozzle n;
+    n.position = position;
+    n.velocity = velocity;
+    n.spacing = stride * velocity.norm().I();
+    n.count = (int)floorf(std::max(width, 0.0f) / stride) + 1;
+    n.scene = scene;
+    nozzles.push_back(n);
     
-    clFlush(queue);
-    clFinish(queue);
+    NozzleFlow f;
+    f.rate = std::max(rate, 0.0f);
+    f.due = 0.0f;
+    f.lifetime = lifetime;
+    flows.push_back(f);
+    
+    mortal = mortal || lifetime < INFINITY;
+    
+    return (int)nozzles.size() - 1;
+}
+
+int ParticleSystem::scheduleRows(float dt, int its) {
+    rows.clear();
+    
+    int room = MAX_PARTICLE_COUNT - getCount();
+    int total = 0;
+    
+    for(int k = 0; k < its; ++k) {
+        int offset = 0;
+        
+        for(size_t i = 0; i < nozzles.size(); ++i) {
+            const Nozzle& n = nozzles[i];
+            NozzleFlow& f = flows[i];
+            
+            if(f.rate <= 0.0f)
+                continue;
+            
+            float rowRate = f.rate / n.count;
+            f.due += rowRate * dt * scenes[n.scene].timeScale;
+            
+            while(f.due >= 1.0f) {
+                f.due -= 1.0f;
+                
+                /// what the nozzle cannot fit is dropped, not held back
+                if(total + n.count > room)
+                    continue;
+                
+                float age = f.due / rowRate;
+                
+                /// its particles would come out dead, which the backends never count
+                if(!(f.lifetime - age > 0.0f))
+                    continue;
+                
+                EmitRow r;
+                r.nozzle = (int)i;
+                r.substep = k;
+                r.offset = offset;
+                r.firstId = nextId;
+                r.age = age;
+                
+                /// it has been out for age already
+                r.life = f.lifetime - age;
+                rows.push_back(r);
+                
+                offset += n.count;
+                total += n.count;
+                nextId += n.count;
+            }
+        }
+    }
+    
+    return total;
+}
+
+int ParticleSystem::layoutScenes() {
+    int n = 0;
+    
+    scenes[0].gravity = gravity;
+    scenes[0].lowerBound = domain.lowerBound;
+    scenes[0].upperBound = domain.upperBound;
+    
+    if(bounded || scenes.size() > 1) {
+        for(Scene& s : scenes) {
+            vec2 extent = s.upperBound - s.lowerBound;
+            s.size.s[0] = std::max(1, (int)ceilf(extent.x / diameter));
+            s.size.s[1] = std::max(1, (int)ceilf(extent.y / diameter));
+            s.offset = n;
+            n += s.size.s[0] * s.size.s[1];
+        }
+    }else{
+        scenes[0].size.s[0] = 0;
+        scenes[0].size.s[1] = 0;
+        scenes[0].offset = 0;
+        n = MIN_CELL_COUNT;
+        while(n < 2 * getCount() && n < MAX_PARTICLE_COUNT)
+            n <<= 1;
+    }
+    
+    return n;
 }
 
-void ParticleSystem::solve(float dt) {
-    size_t size = count;
+float ParticleSystem::obstacleDistance(int scene, const vec2& p) const {
+    float d = INFINITY;
     
-    clSetKernelArg(solver, 0, sizeof(velocities_cl), (void*)&velocities_cl);
-    clSetKernelArg(solver, 1, sizeof(dt), (void*)&dt);
-    clSetKernelArg(solver, 2, sizeof(gravity), (void*)&gravity);
-    clSetKernelArg(solver, 3, sizeof(positions_cl), (void*)&positions_cl);
-    clSetKernelArg(solver, 4, sizeof(proxies), (void*)&proxies);
-    clSetKernelArg(solver, 5, sizeof(offsetList), (void*)&offsetList);
-    clSetKernelArg(solver, 6, sizeof(count), (void*)&count);
-    clSetKernelArg(solver, 7, sizeof(diameter), (void*)&diameter);
-    clSetKernelArg(solver, 8, sizeof(accelerations), (void*)&accelerations);
-    clSetKernelArg(solver, 9, sizeof(weights), (void*)&weights);
+    for(const Obstacle& o : obstacles) {
+        if(o.scene == scene && !o.sink) {
+            float e = o.shape->distance(p);
+            d = std::min(d, o.container ? -e : e);
+        }
+    }
     
-    assert(clEnqueueNDRangeKernel(queue, solver, 1, NULL, &size, NULL, 0, NULL, NULL) == CL_SUCCESS);
+    return d;
+}
+
+float ParticleSystem::sinkDistance(int scene, const vec2& p) const {
+    float d = INFINITY;
+    
+    for(const Obstacle& o : obstacles)
+        if(o.scene == scene && o.sink)
+            d = std::min(d, o.shape->distance(p));
     
-    clFlush(queue);
-    clFinish(queue);
+    return d;
 }
 
-void ParticleSystem::initialize_cl() {
-    context = create_cl_context(CL_DEVICE_TYPE_CPU, &device);
+void ParticleSystem::layoutFields() {
+    bool changed = obstaclesChanged || fieldBounds.size() != scenes.size();
+    
+    for(size_t k = 0; !changed && k < scenes.size(); ++k) {
+        const Scene& s = scenes[k];
+        const AABB& b = fieldBounds[k];
+        changed = s.lowerBound.x != b.lowerBound.x || s.lowerBound.y != b.lowerBound.y || s.upperBound.x != b.upperBound.x || s.upperBound.y != b.upperBound.y;
+    }
+    
+    if(!changed)
+        return;
+    
+    field.clear();
+    fieldBounds.resize(scenes.size());
+    
+    float spacing = 0.5f * diameter;
+    
+    for(size_t k = 0; k < scenes.size(); ++k) {
+        Scene& s = scenes[k];
+        
+        fieldBounds[k] = AABB(s.lowerBound, s.upperBound);
+        
+        bool any = false;
+        bool sinks = false;
+        for(const Obstacle& o : obstacles) {
+            any = any || (o.scene == (int)k && !o.sink);
+            sinks = sinks || (o.scene == (int)k && o.sink);
+        }
+        
+        s.field = -1;
+        s.sink = -1;
+        
+        if(!any && !sinks) {
+            s.fieldSize.s[0] = 0;
+            s.fieldSize.s[1] = 0;
+            s.fieldSpacing = 0.0f;
+            continue;
+        }
+        
+        vec2 extent = s.upperBound - s.lowerBound;
+        int nx = std::max(2, (int)ceilf(extent.x / spacing) + 1);
+        int ny = std::max(2, (int)ceilf(extent.y / spacing) + 1);
+        
+        s.fieldSize.s[0] = nx;
+        s.fieldSize.s[1] = ny;
+        s.fieldSpacing = spacing;
+        
+        if(any) {
+            s.field = (int)field.size();
+            
+            for(int y = 0; y < ny; ++y)
+                for(int x = 0; x < nx; ++x)
+                    field.push_back(obstacleDistance((int)k, s.lowerBound + vec2(x * spacing, y * spacing)));
+        }
+        
+        if(sinks) {
+            s.sink = (int)field.size();
+            
+            for(int y = 0; y < ny; ++y)
+                for(int x = 0; x < nx; ++x)
+                    field.push_back(sinkDistance((int)k, s.lowerBound + vec2(x * spacing, y * spacing)));
+        }
+    }
+    
+    obstaclesChanged = false;
+    ++fieldVersion;
+}
+
+int ParticleSystem::adaptSubsteps(float dt, int its) {
+    const Readback& r = backend->latest();
+    
+    float speed = std::max(r.maxSpeed, std::max(stagedSpeed, lastStagedSpeed));
+    float reach = courant * diameter;
+    
+    lastStagedSpeed = stagedSpeed;
+    stagedSpeed = 0.0f;
     
-    createMemObjs();
+    /// speed * dt / n <= reach, and acceleration * (dt / n)^2 <= reach
+    float n = std::max(speed * dt / reach, dt * sqrtf(r.maxAcceleration / reach));
     
-    queue = clCreateCommandQueue(context, device, 0, NULL);
+    if(!(n < (float)maxSubsteps))
+        return std::max(its, maxSubsteps);
     
-    hasher = create_cl_kernel(context, device, "hasher.cl", "hasher");
-    toList = create_cl_kernel(context, device, "toList.cl", "toList");
-    sorter = create_cl_kernel(context, device, "sort.cl", "sort");
-    solver = create_cl_kernel(context, device, "solver.cl", "solver");
-    adder = create_cl_kernel(context, device, "solver.cl", "adder");
+    return std::max(its, (int)ceilf(n));
 }
 
-void ParticleSystem::destory_cl() {
-    clReleaseContext(context);
+void ParticleSystem::step(float dt, int its) {
+    upload();
+    
+    if(getCount() == 0 && nozzles.empty()) return;
+    
+    /// the rows a nozzle emits in this step are as fast as it
+    for(size_t i = 0; i < nozzles.size(); ++i)
+        if(flows[i].rate > 0.0f)
+            stagedSpeed = std::max(stagedSpeed, sqrtf(nozzles[i].velocity.lengthSq()) * scenes[nozzles[i].scene].timeScale);
+    
+    if(courant > 0.0f)
+        its = adaptSubsteps(dt, its);
+    
+    substeps = its;
+    
+    StepDesc desc;
+    desc.dt = dt / (float) its;
+    desc.its = its;
+    desc.cells = layoutScenes();
+    desc.specialise = specialise;
+    
+    layoutFields();
+    
+    desc.field = field.data();
+    desc.fieldLength = (int)field.size();
+    desc.fieldVersion = fieldVersion;
+    desc.sleepSteps = sleepSteps;
+    desc.sleepSpeed = sleepSpeed;
+    desc.sleepAcceleration = sleepAcceleration;
+    desc.scenes = scenes.data();
+    desc.sceneCount = (int)scenes.size();
+    desc.reorderInterval = reorderInterval;
+    desc.resortLimit = resortLimit;
+    desc.skin = std::min(std::max(skin, 0.0f), diameter);
+    desc.symmetric = symmetric;
+    desc.mortal = mortal;
+    desc.emitted = scheduleRows(desc.dt, its);
+    desc.nozzles = nozzles.data();
+    desc.nozzleCount = (int)nozzles.size();
+    desc.rows = rows.data();
+    desc.rowCount = (int)rows.size();
+    
+    if(getCount() + desc.emitted == 0) return;
+    
+    ++statSteps;
+    statSubsteps += its;
+    
+    backend->step(desc);
+    
+    if(trajectory != NULL)
+        trajectory->push(backend->latest());
+    
+    if(statsInterval > 0 && statSteps >= statsInterval)
+        dumpStats();
+}
+
+void ParticleSystem::takeStats(Stats* stats) {
+    backend->takeStageTimes(stats->stageTimes);
+    
+    stats->steps = statSteps;
+    stats->substeps = statSubsteps;
+    stats->count = getCount();
+    stats->waitTime = backend->takeWaitTime();
+    stats->rebuilds = backend->takeRebuilds();
+    stats->sortPasses = backend->takeSortPasses();
+    stats->neighbours = backend->takeNeighbours();
+    
+    statSteps = 0;
+    statSubsteps = 0;
+}
+
+void ParticleSystem::dumpStats() {
+    FILE* out = statsFile != NULL ? statsFile : stdout;
+    
+    Stats stats;
+    takeStats(&stats);
     
-    releaseMemObjs();
+    if(out != statsHeaderFile) {
+        fprintf(out, "steps,substeps,particles");
+        
+        for(int s = 0; s < stage_count; ++s)
+            fprintf(out, ",%s_ms", stage_name(s));
+        
+        fprintf(out, ",wait_ms,rebuilds,sort_passes,neighbours\n");
+        statsHeaderFile = out;
+    }
     
-    clReleaseCommandQueue(queue);
+    fprintf(out, "%d,%d,%d", stats.steps, stats.substeps, stats.count);
     
-    clReleaseKernel(hasher);
-    clReleaseKernel(toList);
-    clReleaseKernel(sorter);
-    clReleaseKernel(solver);
-    clReleaseKernel(adder);
+    for(int s = 0; s < stage_count; ++s)
+        fprintf(out, ",%f", stats.stageTimes[s]);
+    
+    fprintf(out, ",%f,%d,%d,%f\n", stats.waitTime, stats.rebuilds, stats.sortPasses, stats.neighbours);
+    fflush(out);
 }
 
-void ParticleSystem::step(float dt) {
-    if(count == 0) return;
+bool ParticleSystem::save(const char* file_name) {
+    upload();
+    
+    const Readback& r = backend->current();
+    
+    std::vector<SnapshotObstacle> records(obstacles.size());
+    std::vector<vec2> vertices;
+    
+    for(size_t i = 0; i < obstacles.size(); ++i) {
+        const Shape& shape = *obstacles[i].shape;
+        records[i].scene = obstacles[i].scene;
+        records[i].container = obstacles[i].container;
+        records[i].sink = obstacles[i].sink;
+        records[i].vertexCount = shape.count;
+        vertices.insert(vertices.end(), shape.vertices, shape.vertices + shape.count);
+    }
+    
+    /// a backend without anything that can die leaves them out
+    std::vector<float> forever;
+    
+    if(r.lifetimes == NULL)
+        forever.assign(r.count, INFINITY);
+    
+    const float* lifetimes = r.lifetimes != NULL ? r.lifetimes : forever.data();
+    
+    SnapshotHeader h;
+    memcpy(h.magic, "SPHS", sizeof(h.magic));
+    h.version = SNAPSHOT_VERSION;
+    h.count = r.count;
+    h.nextId = nextId;
+    h.sceneCount = (int)scenes.size();
+    h.obstacleCount = (int)records.size();
+    h.vertexCount = (int)vertices.size();
+    h.nozzleCount = (int)nozzles.size();
+    h.diameter = diameter;
+    h.maxSpeed = std::max(r.maxSpeed, std::max(stagedSpeed, lastStagedSpeed));
+    h.gravity = gravity;
+    h.domain = domain;
+    h.bytes = (int)snapshot_bytes(h);
+    
+    /// the particles go out of the readback as they are, without being copied together first
+    iovec parts[] = {
+        {&h, sizeof(h)},
+        {scenes.data() + 1, (scenes.size() - 1) * sizeof(Scene)},
+        {records.data(), records.size() * sizeof(SnapshotObstacle)},
+        {vertices.data(), vertices.size() * sizeof(vec2)},
+        {nozzles.data(), nozzles.size() * sizeof(Nozzle)},
+        {flows.data(), flows.size() * sizeof(NozzleFlow)},
+        {(void*)r.positions, r.count * sizeof(vec2)},
+        {(void*)r.velocities, r.count * sizeof(vec2)},
+        {(void*)r.ids, r.count * sizeof(int)},
+        {(void*)r.sceneIds, r.count * sizeof(int)},
+        {(void*)lifetimes, r.count * sizeof(float)}
+    };
+    
+    int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    if(fd == -1) {
+        fprintf(stderr, "%s cannot be opened\n", file_name);
+        return false;
+    }
+    
+    ssize_t written = writev(fd, parts, sizeof(parts) / sizeof(iovec));
+    close(fd);
+    
+    if(written != h.bytes) {
+        fprintf(stderr, "%s cannot be written\n", file_name);
+        return false;
+    }
+    
+    return true;
+}
+
+bool ParticleSystem::load(const char* file_name) {
+    int fd = open(file_name, O_RDONLY);
+    
+    if(fd == -1) {
+        fprintf(stderr, "%s cannot be opened\n", file_name);
+        return false;
+    }
+    
+    struct stat st;
+    void* mapped = MAP_FAILED;
+    
+    if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SnapshotHeader))
+        mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    
+    close(fd);
+    
+    if(mapped == MAP_FAILED) {
+        fprintf(stderr, "%s is not a snapshot\n", file_name);
+        return false;
+    }
+    
+    const SnapshotHeader& h = *(const SnapshotHeader*)mapped;
+    
+    bool valid = memcmp(h.magic, "SPHS", sizeof(h.magic)) == 0 && h.version == SNAPSHOT_VERSION;
+    valid = valid && h.count >= 0 && h.count <= MAX_PARTICLE_COUNT && h.sceneCount >= 1 && h.obstacleCount >= 0 && h.vertexCount >= 0 && h.nozzleCount >= 0;
+    valid = valid && h.bytes == st.st_size && snapshot_bytes(h) == (size_t)st.st_size;
+    valid = valid && std::isfinite(h.diameter) && h.diameter > 0.0f && bounds_valid(h.domain.lowerBound, h.domain.upperBound);
+    
+    const Scene* savedScenes = (const Scene*)(&h + 1);
+    const SnapshotObstacle* records = (const SnapshotObstacle*)(savedScenes + h.sceneCount - 1);
+    const vec2* vertices = (const vec2*)(records + h.obstacleCount);
+    const Nozzle* savedNozzles = (const Nozzle*)(vertices + h.vertexCount);
+    const NozzleFlow* savedFlows = (const NozzleFlow*)(savedNozzles + h.nozzleCount);
+    const vec2* positions = (const vec2*)(savedFlows + h.nozzleCount);
+    const vec2* velocities = positions + h.count;
+    const int* ids = (const int*)(velocities + h.count);
+    const int* sceneIds = ids + h.count;
+    const float* lifetimes = (const float*)(sceneIds + h.count);
+    
+    /// the scenes have to have room and run forward, the obstacles have to share out the vertices exactly, and everything has to be in a saved scene, before anything is replaced
+    for(int k = 1; valid && k < h.sceneCount; ++k) {
+        const Scene& s = savedScenes[k - 1];
+        valid = std::isfinite(s.timeScale) && s.timeScale > 0.0f && bounds_valid(s.lowerBound, s.upperBound);
+    }
+    
+    long vertexSum = 0;
+    
+    for(int i = 0; valid && i < h.obstacleCount; ++i) {
+        valid = records[i].vertexCount > 0 && records[i].scene >= 0 && records[i].scene < h.sceneCount;
+        vertexSum += records[i].vertexCount;
+    }
+    
+    valid = valid && vertexSum == h.vertexCount;
+    
+    for(int i = 0; valid && i < h.nozzleCount; ++i)
+        valid = savedNozzles[i].count > 0 && savedNozzles[i].scene >= 0 && savedNozzles[i].scene < h.sceneCount;
+    
+    for(int i = 0; valid && i < h.count; ++i)
+        valid = sceneIds[i] >= 0 && sceneIds[i] < h.sceneCount;
+    
+    if(!valid) {
+        munmap(mapped, st.st_size);
+        fprintf(stderr, "%s is not a version %d snapshot\n", file_name, SNAPSHOT_VERSION);
+        return false;
+    }
+    
+    if(backend == NULL || h.diameter != diameter)
+        initialize(h.diameter);
+    
+    /// initialize() leaves the scenes, the staged particles and the ids alone
+    clear();
+    
+    gravity = h.gravity;
+    domain = h.domain;
+    
+    for(int k = 1; k < h.sceneCount; ++k) {
+        scenes.push_back(savedScenes[k - 1]);
+        scenes.back().field = -1;
+        scenes.back().sink = -1;
+    }
+    
+    clearObstacles();
     
-    createProxies();
+    for(int i = 0; i < h.obstacleCount; ++i) {
+        Shape shape;
+        shape.initialize(vertices, vertices + records[i].vertexCount);
+        addObstacle(shape, records[i].scene, records[i].container != 0, records[i].sink != 0);
+        vertices += records[i].vertexCount;
+    }
     
-    sortProxies();
+    nozzles.assign(savedNozzles, savedNozzles + h.nozzleCount);
+    flows.assign(savedFlows, savedFlows + h.nozzleCount);
     
-    toOffsetList();
+    for(const NozzleFlow& f : flows)
+        mortal = mortal || f.lifetime < INFINITY;
     
-    solve(dt);
+    bool finite = false;
     
-    size_t size = count;
+    for(int i = 0; i < h.count && !finite; ++i)
+        finite = lifetimes[i] < INFINITY;
     
-    clSetKernelArg(adder, 0, sizeof(velocities_cl), (void*)&velocities_cl);
-    clSetKernelArg(adder, 1, sizeof(positions_cl), (void*)&positions_cl);
-    clSetKernelArg(adder, 2, sizeof(accelerations), (void*)&accelerations);
-    clSetKernelArg(adder, 3, sizeof(dt), (void*)&dt);
-    clSetKernelArg(adder, 4, sizeof(diameter), (void*)&diameter);
+    mortal = mortal || finite;
     
-    clEnqueueNDRangeKernel(queue, adder, 1, NULL, &size, NULL, 0, NULL, NULL);
+    if(h.count > 0)
+        backend->add(positions, velocities, ids, sceneIds, finite ? lifetimes : NULL, h.count);
     
-    clEnqueueReadBuffer(queue, velocities_cl, CL_TRUE, 0, size * sizeof(vec2), velocities, 0, NULL, NULL);
-    clEnqueueReadBuffer(queue, positions_cl, CL_TRUE, 0, size * sizeof(vec2), positions, 0, NULL, NULL);
+    nextId = h.nextId;
+    stagedSpeed = h.maxSpeed;
     
-    clFlush(queue);
-    clFinish(queue);
+    munmap(mapped, st.st_size);
+    return true;
 }
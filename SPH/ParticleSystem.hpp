@@ -9,149 +9,498 @@
 #ifndef ParticleSystem_hpp
 #define ParticleSystem_hpp
 
-#include "common.h"
+#include "CLBackend.hpp"
+#include "NativeBackend.hpp"
+#include "TrajectoryWriter.hpp"
 #include "Shape.h"
 
-#ifndef ParticleSystemInitialCapacity
-#define ParticleSystemInitialCapacity 1024
-#endif
-
 #ifndef DistBtwParticles
 #define DistBtwParticles 0.75f
 #endif
 
-struct Proxy
+/// a convex shape particles are kept out of, or inside of for a container, or that removes those that enter it for a sink
+struct Obstacle
 {
-    int index;
-    int hash;
+    Shape* shape;
+    int scene;
+    bool container;
+    bool sink;
 };
 
-class ParticleSystem
+/// how fast a nozzle emits, and how far it is into the next row
+struct NozzleFlow
 {
-    cl_kernel hasher;
-    cl_kernel toList;
-    cl_kernel sorter;
-    cl_kernel solver;
-    cl_kernel adder;
-    
-    cl_context context;
-    cl_device_id device;
+    /// particles per second, in the scene's time
+    float rate;
     
-    cl_mem proxies;
-    cl_mem tempProxies;
-    cl_mem offsetList;
-    cl_mem accelerations;
-    cl_mem weights;
+    /// rows due, a row is emitted every time it passes 1
+    float due;
     
-    cl_mem positions_cl;
-    cl_mem velocities_cl;
+    /// how long its particles live, in the scene's time
+    float lifetime;
+};
+
+/// bumped whenever the snapshot layout changes, older snapshots are refused
+#define SNAPSHOT_VERSION 4
+
+/**
+ * the start of a snapshot file, followed by sceneCount - 1 Scenes, obstacleCount SnapshotObstacles, vertexCount vertices,
+ * nozzleCount Nozzles and as many NozzleFlows, then count positions, velocities, ids, scene ids and lifetimes, so every array can be used straight from the mapped file
+ */
+struct SnapshotHeader
+{
+    char magic[4];
+    int version;
     
-    cl_command_queue queue;
+    /// of the whole file, a shorter file was cut off
+    int bytes;
     
-    vec2 positions[MAX_PARTICLE_COUNT];
-    vec2 velocities[MAX_PARTICLE_COUNT];
+    int count;
+    int nextId;
+    int sceneCount;
+    int obstacleCount;
+    int vertexCount;
+    int nozzleCount;
     
     float diameter;
     
+    /// the fastest particle of the step it was saved after, what the first adaptive step goes by
+    float maxSpeed;
+    
+    vec2 gravity;
+    AABB domain;
+};
+
+struct SnapshotObstacle
+{
+    int scene;
+    int container;
+    int sink;
+    int vertexCount;
+};
+
+/// what the system did since the last ParticleSystem::takeStats()
+struct Stats
+{
+    int steps;
+    int substeps;
+    
+    /// particles when it was taken
     int count;
     
-    inline void releaseMemObjs() {
-        clReleaseMemObject(proxies);
-        clReleaseMemObject(tempProxies);
-        clReleaseMemObject(offsetList);
-        clReleaseMemObject(weights);
-        
-        clReleaseMemObject(positions_cl);
-        clReleaseMemObject(velocities_cl);
-        clReleaseMemObject(accelerations);
-    }
+    /// milliseconds each stage took on the device, 0 without profiling
+    double stageTimes[stage_count];
     
-    inline void createMemObjs() {
-        proxies = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(Proxy) * MAX_PARTICLE_COUNT, NULL, NULL);
-        tempProxies = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(Proxy) * MAX_PARTICLE_COUNT, NULL, NULL);
-        offsetList = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int) * MAX_PARTICLE_COUNT, NULL, NULL);
-        weights = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * MAX_PARTICLE_COUNT, NULL, NULL);
-        
-        positions_cl = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(vec2) * MAX_PARTICLE_COUNT, NULL, NULL);
-        velocities_cl = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(vec2) * MAX_PARTICLE_COUNT, NULL, NULL);
-        accelerations = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(vec2) * MAX_PARTICLE_COUNT, NULL, NULL);
-    }
+    /// milliseconds the host spent blocked on the device
+    double waitTime;
+    
+    /// substeps that rebuilt the cells, and the passes over the particles their sorts took
+    int rebuilds;
+    int sortPasses;
+    
+    /// neighbour candidates the density pass visited per particle and substep, 0 without COUNT_NEIGHBOURS
+    double neighbours;
+};
+
+/// where the simulation runs
+enum BackendType
+{
+    backend_opencl,
+    backend_native
+};
+
+class ParticleSystem
+{
+    Backend* backend;
+    
+    /// particles added on the host, waiting to be uploaded
+    std::vector<vec2> stagedPositions;
+    std::vector<vec2> stagedVelocities;
+    std::vector<int> stagedIds;
+    std::vector<int> stagedSceneIds;
+    std::vector<float> stagedLifetimes;
+    
+    /// a particle was given a lifetime or a sink was added, so the backend runs the lifetimes down and removes the dead
+    bool mortal;
+    
+    /// scenes[0] follows gravity and domain, the rest are added with addScene()
+    std::vector<Scene> scenes;
+    
+    float diameter;
+    
+    /// next stable id, ids follow each particle through reordering
+    int nextId;
+    
+    /// the fastest particle uploaded since the last step, and in the step before, which a readback may not have seen yet
+    float stagedSpeed;
+    float lastStagedSpeed;
+    
+    /// what the last step() took
+    int substeps;
+    
+    /// steps and substeps since the last takeStats()
+    int statSteps;
+    int statSubsteps;
+    
+    /// the file the stats header was last written to
+    FILE* statsHeaderFile;
+    
+    std::vector<Obstacle> obstacles;
+    
+    /// the signed distance fields of every scene with obstacles, and of every scene with sinks, one after another
+    std::vector<float> field;
+    
+    /// the scene bounds field was sampled over, it is sampled again when they change
+    std::vector<AABB> fieldBounds;
+    
+    /// bumped whenever field is sampled again, so backends know to read it
+    int fieldVersion;
     
-    void initialize_cl();
+    /// an obstacle was added or removed since field was sampled
+    bool obstaclesChanged;
     
-    void destory_cl();
+    /// what the backends emit from, and how often
+    std::vector<Nozzle> nozzles;
+    std::vector<NozzleFlow> flows;
     
+    /// the rows the nozzles emit over the current step
+    std::vector<EmitRow> rows;
     
+    /// plans the rows of a step of its substeps dt apart, with ids from nextId, and returns the particles they add up to
+    int scheduleRows(float dt, int its);
     
-    void createProxies();
+    /// moves the staged particles to the backend
+    void upload();
     
-    void sortProxies();
+    /**
+     * lays the scenes out in the cell table and returns its size
+     * a bounded domain gets one cell per slot and never aliases
+     * otherwise the hash table is kept at about twice the particle count so cells rarely alias
+     * with more than one scene every scene gets its own bounded grid, one after another in the table
+     */
+    int layoutScenes();
     
-    void toOffsetList();
+    /// signed distance of p to the obstacles of a scene, positive where particles are free
+    float obstacleDistance(int scene, const vec2& p) const;
     
-    void solve(float dt);
+    /// signed distance of p to the sinks of a scene, negative inside one
+    float sinkDistance(int scene, const vec2& p) const;
+    
+    /**
+     * samples every scene's obstacles into its field, D / 2 apart over its bounds, if they or the bounds changed
+     * its sinks go into a second field of the same size
+     * particles collide with the field in the adder, so what that costs does not grow with the obstacles
+     */
+    void layoutFields();
+    
+    /// at least its substeps, enough for the newest readback and the particles uploaded since to meet courant
+    int adaptSubsteps(float dt, int its);
+    
+    /// takes the stats and writes them to statsFile as a row of CSV, after a header the first time
+    void dumpStats();
     
 public:
     
     vec2 gravity;
     
-    inline ParticleSystem(const vec2& gravity) : gravity(gravity) {}
+    /// adder keeps particles inside the domain when built with BOUNDS
+    AABB domain;
     
-    inline ~ParticleSystem() {
-        destory_cl();
+    /// index cells densely inside the domain, instead of hashing them
+    bool bounded;
+    
+    /// reorder particle data into cell order every this many substeps, 0 never does
+    int reorderInterval;
+    
+    /**
+     * above 0 the cells are re-sorted from the order of the last sort while at most this share of the particles changed cell,
+     * on OpenCL going by the newest readback, latest().movedFraction tells how many did
+     */
+    float resortLimit;
+    
+    /**
+     * above 0 particles keep lists of their neighbours within D + skin,
+     * and the cells are rebuilt only once some particle moved skin / 2, clamped to D
+     */
+    float skin;
+    
+    /**
+     * the native backend solves each pair once from the forward half of the 3x3 cells
+     * and gives the other particle the opposite, without lists
+     */
+    bool symmetric;
+    
+    /**
+     * above 0 step() takes enough substeps that no particle moves more than courant * D in one,
+     * going by its speed and by how far its acceleration alone would move it, in the newest readback
+     */
+    float courant;
+    
+    /// the most substeps an adaptive step() takes
+    int maxSubsteps;
+    
+    /**
+     * above 0, cells where no particle moved faster than sleepSpeed or accelerated harder than sleepAcceleration,
+     * in them or next to them, for sleepSteps substeps stop being solved and moved, until something moving comes next to them
+     * off with lists or symmetric, latest().activeFraction tells how many particles were still moved
+     */
+    int sleepSteps;
+    float sleepSpeed;
+    float sleepAcceleration;
+    
+    /**
+     * OpenCL builds the kernels again with the diameter, and the grid when there is one scene, as constants
+     * the build runs in the background when they change, the kernels that take them as arguments run until it is done
+     */
+    bool specialise;
+    
+    /// records the time of every stage, has to be set before initialize()
+    bool profiling;
+    
+    /// the backend initialize() creates
+    BackendType backendType;
+    
+    /// threads of the native backend, 0 uses one per hardware thread
+    int threads;
+    
+    /// the neighbour kernels of the native backend, scalar, avx2 or avx512, so the vector ones can be checked against scalar, NULL runs the widest the cpu has
+    const char* nativeKernels;
+    
+    /**
+     * above 0 step() takes the stats every this many steps and writes them to statsFile, or stdout when it is NULL, as CSV
+     * with it at 0 nothing is gathered besides what profiling and COUNT_NEIGHBOURS turn on
+     */
+    int statsInterval;
+    FILE* statsFile;
+    
+    /// step() pushes it every readback it has not seen yet, which on OpenCL waits for the step before, it is not owned
+    TrajectoryWriter* trajectory;
+    
+    inline ParticleSystem(const vec2& gravity) : backend(NULL), mortal(false), fieldVersion(0), obstaclesChanged(true), gravity(gravity), domain(vec2(-5.0f, -3.0f), vec2(5.0f, 3.0f)), bounded(true), reorderInterval(1), resortLimit(0.0f), skin(0.0f), symmetric(false), courant(0.0f), maxSubsteps(32), sleepSteps(0), sleepSpeed(0.1f), sleepAcceleration(20.0f), specialise(true), profiling(false), backendType(backend_opencl), threads(0), nativeKernels(NULL), statsInterval(0), statsFile(NULL), trajectory(NULL) {
+        scenes.resize(1);
+        scenes[0].timeScale = 1.0f;
+        scenes[0].field = -1;
+        scenes[0].sink = -1;
     }
     
-    void initialize(float D) {
-        count = 0;
-        diameter = D;
-        initialize_cl();
+    inline ~ParticleSystem() {
+        clearObstacles();
+        delete backend;
     }
     
+    void initialize(float D);
+    
     inline void clear() {
-        count = 0;
-        releaseMemObjs();
-        createMemObjs();
+        stagedPositions.clear();
+        stagedVelocities.clear();
+        stagedSceneIds.clear();
+        stagedLifetimes.clear();
+        scenes.resize(1);
+        nextId = 0;
+        backend->clear();
+        
+        /// only the obstacles and nozzles of the scenes that are gone
+        for(size_t i = 0; i < obstacles.size(); ++i) {
+            if(obstacles[i].scene != 0) {
+                delete obstacles[i].shape;
+                obstacles.erase(obstacles.begin() + i--);
+                obstaclesChanged = true;
+            }
+        }
+        
+        for(size_t i = 0; i < nozzles.size(); ++i) {
+            if(nozzles[i].scene != 0) {
+                nozzles.erase(nozzles.begin() + i);
+                flows.erase(flows.begin() + i--);
+            }
+        }
     }
     
-    inline void addParticle(const vec2& p, const vec2& v) {
-        if(count < MAX_PARTICLE_COUNT) {
-            positions[count] = p;
-            velocities[count++] = v;
-        }
+    /// particles are pushed out of the shape, which has to be convex
+    inline void addObstacle(const Shape& shape, int scene = 0) {
+        addObstacle(shape, scene, false);
+    }
+    
+    /// particles are kept inside the shape, which has to be convex, as well as inside the scene's bounds
+    inline void addContainer(const Shape& shape, int scene = 0) {
+        addObstacle(shape, scene, true);
     }
     
-    void add(const Shape& shape, const vec2& linearVelocity, float dist = DistBtwParticles) {
-        int oldCount = count;
+    /// particles that enter the shape, which has to be convex, are removed at the end of the step
+    inline void addSink(const Shape& shape, int scene = 0) {
+        addObstacle(shape, scene, false, true);
+    }
+    
+    void addObstacle(const Shape& shape, int scene, bool container, bool sink = false) {
+        assert(scene >= 0 && scene < (int)scenes.size());
         
-        AABB aabb = shape.aabb();
-        float stride = diameter * dist;
-        for (float y = aabb.lowerBound.y; y < aabb.upperBound.y; y += stride) {
-            for (float x = aabb.lowerBound.x; x < aabb.upperBound.x; x += stride) {
-                vec2 p(x, y);
-                if (shape.includes(p))
-                    addParticle(p, linearVelocity);
-            }
-        }
+        Obstacle o;
+        o.shape = new Shape();
+        o.shape->initialize(shape.vertices, shape.vertices + shape.count);
+        o.scene = scene;
+        o.container = container;
+        o.sink = sink;
+        obstacles.push_back(o);
+        obstaclesChanged = true;
+        mortal = mortal || sink;
+    }
+    
+    inline void clearObstacles() {
+        for(Obstacle& o : obstacles)
+            delete o.shape;
         
-        clEnqueueWriteBuffer(queue, velocities_cl, CL_TRUE, oldCount * sizeof(vec2), (count - oldCount) * sizeof(vec2), velocities + oldCount, 0, NULL, NULL);
-        clEnqueueWriteBuffer(queue, positions_cl, CL_TRUE, oldCount * sizeof(vec2), (count - oldCount) * sizeof(vec2), positions + oldCount, 0, NULL, NULL);
+        obstacles.clear();
+        obstaclesChanged = true;
+    }
+    
+    /**
+     * adds a scene that shares the buffers and dispatches with every other scene but never interacts with them
+     * particles outside its bounds are clamped to them, returns the id to add particles with
+     */
+    inline int addScene(const vec2& gravity, const AABB& bounds, float timeScale = 1.0f) {
+        Scene s = Scene();
+        s.gravity = gravity;
+        s.lowerBound = bounds.lowerBound;
+        s.upperBound = bounds.upperBound;
+        s.timeScale = timeScale;
+        s.field = -1;
+        s.sink = -1;
+        scenes.push_back(s);
+        return (int)scenes.size() - 1;
+    }
+    
+    inline int getSceneCount() const {
+        return (int)scenes.size();
+    }
+    
+    /**
+     * the particle is kept on the host until the next add() or step(), it is removed once lifetime has gone by in its scene
+     * a lifetime that is not above 0 adds nothing, the particle would be dead before the backend could count it
+     */
+    inline void addParticle(const vec2& p, const vec2& v, int scene = 0, float lifetime = INFINITY) {
+        assert(scene >= 0 && scene < (int)scenes.size());
         
-        clFlush(queue);
-        clFinish(queue);
+        if(lifetime > 0.0f && getCount() + (int)stagedPositions.size() < MAX_PARTICLE_COUNT) {
+            stagedPositions.push_back(p);
+            stagedVelocities.push_back(v);
+            stagedSceneIds.push_back(scene);
+            stagedLifetimes.push_back(lifetime);
+            mortal = mortal || lifetime < INFINITY;
+        }
+    }
+    
+    inline void add(const Shape& shape, const vec2& linearVelocity, float dist = DistBtwParticles) {
+        add(0, shape, linearVelocity, dist);
     }
     
+    /**
+     * fills the shape, which has to be convex, with particles dist * D apart where they are outside the scene's obstacles
+     * the backend makes them, only their number comes back, a lifetime that is not above 0 makes none
+     */
+    void add(int scene, const Shape& shape, const vec2& linearVelocity, float dist = DistBtwParticles, float lifetime = INFINITY);
+    
+    /**
+     * a stream of rate particles per second, in the scene's time, leaving position with velocity in rows dist * D apart,
+     * each row width across and centred on position, returns the id setNozzleRate() takes
+     * the backend makes the particles at the start of each substep
+     * a row that would be older than lifetime when it comes out is dropped
+     */
+    int addNozzle(const vec2& position, const vec2& velocity, float width, float rate, int scene = 0, float dist = DistBtwParticles, float lifetime = INFINITY);
+    
+    /// 0 stops it
+    inline void setNozzleRate(int nozzle, float rate) {
+        flows[nozzle].rate = std::max(rate, 0.0f);
+    }
+    
+    inline int getNozzleCount() const {
+        return (int)nozzles.size();
+    }
+    
+    inline void clearNozzles() {
+        nozzles.clear();
+        flows.clear();
+    }
+    
+    /// particles dead in a step may be counted until a later step or current() removes them
     inline int getCount() const {
-        return count;
+        return backend->getCount();
     }
     
-    void step(float dt);
+    /**
+     * writes every particle, scene, obstacle and nozzle to file_name with a single write, after waiting for the steps so far
+     * returns false and says why on stderr when it cannot
+     */
+    bool save(const char* file_name);
     
-    inline void step(float dt, int its) {
-        float _dt = dt / (float) its;
-        for(int i = 0; i < its; ++i)
-            step(_dt);
+    /**
+     * replaces everything with what save() wrote, the particles go from the mapped file straight to the backend
+     * it initializes again if the snapshot's diameter is not this one, returns false and leaves everything as it was when the file cannot be used
+     */
+    bool load(const char* file_name);
+    
+    inline std::string getDeviceName() const {
+        return backend->getName();
+    }
+    
+    /**
+     * the newest readback that has completed, or if the last step is still running, the one before it
+     * particles are in storage order, ids[i] is the stable id of the particle at positions[i]
+     */
+    inline const Readback& latest() {
+        return backend->latest();
     }
     
+    /// neighbour candidates the solver visited from an aliased cell since the last call, needs COUNT_ALIASES
+    inline int getAliasedCandidates() {
+        return backend->getAliasedCandidates();
+    }
+    
+    /**
+     * hands all its substeps to the backend, the OpenCL one returns before they have run
+     * with courant above 0, its is the fewest it takes
+     */
+    void step(float dt, int its);
+    
+    inline void step(float dt) {
+        step(dt, 1);
+    }
+    
+    /// substeps the last step() took
+    inline int getSubsteps() const {
+        return substeps;
+    }
+    
+    /// blocks until everything stepped so far has run
+    inline void finish() {
+        backend->finish();
+    }
+    
+    /// blocks until the kernels being built for the last step are ready
+    inline void waitForKernels() {
+        backend->waitForKernels();
+    }
+    
+    /**
+     * waits for the backend, then fills times[stage_count] with the milliseconds
+     * each stage took since the last call, needs profiling, without it they are 0 and nothing is waited for
+     */
+    inline void takeStageTimes(double* times) {
+        backend->takeStageTimes(times);
+    }
+    
+    /// milliseconds spent waiting on the device since the last call
+    inline double takeWaitTime() {
+        return backend->takeWaitTime();
+    }
+    
+    /// substeps that rebuilt the cells since the last call, all of them unless skin is above 0
+    inline int takeRebuilds() {
+        return backend->takeRebuilds();
+    }
+    
+    /// everything Stats holds since the last call, it takes the stage and wait times and the rebuilds too, and waits for the backend when profiling
+    void takeStats(Stats* stats);
+    
     friend class PSGraphic;
 };
 
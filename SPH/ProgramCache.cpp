@@ -0,0 +1,311 @@
+//
+//  ProgramCache.cpp
+//  SPH
+//
+//  Created by Arthur Sun on 6/26/19.
+//  Copyright © 2019 Arthur Sun. All rights reserved.
+//
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ProgramCache.hpp"
+#include "kernels.h"
+
+/// FNV-1a, only used to name and check cache files
+static inline unsigned long long hash_string(const std::string& str) {
+    unsigned long long h = 14695981039346656037ull;
+    
+    for(unsigned char c : str) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    
+    return h;
+}
+
+static inline std::string device_string(cl_device_id device, cl_device_info info) {
+    char str[256] = {0};
+    clGetDeviceInfo(device, info, sizeof(str) - 1, str, NULL);
+    return str;
+}
+
+static std::string cache_directory() {
+    const char* dir = getenv("SPH_CACHE_DIR");
+    
+    if(dir != NULL)
+        return dir;
+    
+    const char* home = getenv("HOME");
+    
+#ifdef __APPLE__
+    return home != NULL ? std::string(home) + "/Library/Caches/SPH" : "";
+#else
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    
+    if(xdg != NULL && xdg[0] != '\0')
+        return std::string(xdg) + "/sph";
+    
+    return home != NULL ? std::string(home) + "/.cache/sph" : "";
+#endif
+}
+
+/// creates path and whatever is missing above it
+static bool make_directories(const std::string& path) {
+    for(size_t i = path.find('/', 1); i != std::string::npos; i = path.find('/', i + 1))
+        mkdir(path.substr(0, i).c_str(), 0755);
+    
+    mkdir(path.c_str(), 0755);
+    
+    struct stat s;
+    return stat(path.c_str(), &s) == 0 && S_ISDIR(s.st_mode);
+}
+
+static void print_build_log(cl_program program, cl_device_id device, const char* file_name) {
+    size_t size = 0;
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &size);
+    
+    std::string log(size, '\0');
+    
+    if(size > 0)
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, size, &log[0], NULL);
+    
+    fprintf(stderr, "%s does not build\n%s\n", file_name, log.c_str());
+}
+
+void ProgramCache::initialize(cl_context context, cl_device_id device) {
+    release();
+    
+    this->context = context;
+    this->device = device;
+    built = 0;
+    loaded = 0;
+    
+    deviceKey = device_string(device, CL_DEVICE_NAME) + "\n" + device_string(device, CL_DEVICE_VERSION) + "\n" + device_string(device, CL_DRIVER_VERSION);
+    directory = cache_directory();
+}
+
+bool ProgramCache::source(const char* file_name, std::string* str, std::vector<std::string>& included) {
+    if(std::find(included.begin(), included.end(), file_name) != included.end())
+        return true;
+    
+    included.push_back(file_name);
+    
+    std::string text;
+    const char* dir = getenv("SPH_KERNEL_DIR");
+    
+    if(dir != NULL) {
+        if(fstr((std::string(dir) + "/" + file_name).c_str(), &text) == -1)
+            return false;
+    }else{
+        const EmbeddedSource* e = embedded_sources;
+        
+        while(e->name != NULL && strcmp(e->name, file_name) != 0)
+            ++e;
+        
+        if(e->name == NULL) {
+            fprintf(stderr, "%s is not in kernels.h, run embed_kernels.py\n", file_name);
+            return false;
+        }
+        
+        text = e->text;
+    }
+    
+    std::istringstream lines(text);
+    std::string line;
+    
+    /// the compiler never looks for includes, so the program does not depend on the working directory
+    while(std::getline(lines, line)) {
+        size_t end = line.compare(0, 10, "#include \"") == 0 ? line.find('"', 10) : std::string::npos;
+        
+        if(end != std::string::npos) {
+            if(!source(line.substr(10, end - 10).c_str(), str, included))
+                return false;
+            
+            continue;
+        }
+        
+        str->append(line);
+        str->push_back('\n');
+    }
+    
+    return true;
+}
+
+cl_program ProgramCache::load(const std::string& path, const std::string& key, unsigned long long hash, const char* options) {
+    FILE* file = fopen(path.c_str(), "rb");
+    
+    if(file == NULL)
+        return NULL;
+    
+    ProgramCacheHeader h;
+    std::string stored;
+    std::vector<unsigned char> binary;
+    
+    bool valid = fread(&h, sizeof(h), 1, file) == 1 && memcmp(h.magic, "SPHB", sizeof(h.magic)) == 0 && h.version == PROGRAM_CACHE_VERSION && h.hash == hash && h.keySize == (int)key.size() && h.binarySize > 0;
+    
+    if(valid) {
+        stored.resize(h.keySize);
+        binary.resize(h.binarySize);
+        valid = fread(&stored[0], 1, stored.size(), file) == stored.size() && fread(binary.data(), 1, binary.size(), file) == binary.size() && stored == key;
+    }
+    
+    fclose(file);
+    
+    if(!valid)
+        return NULL;
+    
+    const unsigned char* data = binary.data();
+    size_t size = binary.size();
+    cl_int status = CL_SUCCESS;
+    cl_int error = CL_SUCCESS;
+    
+    cl_program program = clCreateProgramWithBinary(context, 1, &device, &size, &data, &status, &error);
+    
+    /// a driver that no longer takes it gets the program built from source, and the file replaced
+    if(program == NULL || error != CL_SUCCESS || status != CL_SUCCESS || clBuildProgram(program, 1, &device, options, NULL, NULL) != CL_SUCCESS) {
+        if(program != NULL)
+            clReleaseProgram(program);
+        
+        return NULL;
+    }
+    
+    return program;
+}
+
+void ProgramCache::save(cl_program program, const std::string& path, const std::string& key, unsigned long long hash) {
+    size_t size = 0;
+    
+    if(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS || size == 0)
+        return;
+    
+    std::vector<unsigned char> binary(size);
+    unsigned char* data = binary.data();
+    
+    if(clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(data), &data, NULL) != CL_SUCCESS)
+        return;
+    
+    if(!make_directories(directory)) {
+        fprintf(stderr, "%s cannot be created, programs are not cached\n", directory.c_str());
+        directory.clear();
+        return;
+    }
+    
+    ProgramCacheHeader h;
+    memcpy(h.magic, "SPHB", sizeof(h.magic));
+    h.version = PROGRAM_CACHE_VERSION;
+    h.hash = hash;
+    h.keySize = (int)key.size();
+    h.binarySize = (int)size;
+    
+    /// written next to it and renamed, so another process never loads half a binary
+    std::string temp = path + "." + std::to_string(getpid());
+    FILE* file = fopen(temp.c_str(), "wb");
+    
+    if(file == NULL) {
+        fprintf(stderr, "%s cannot be opened\n", temp.c_str());
+        return;
+    }
+    
+    bool written = fwrite(&h, sizeof(h), 1, file) == 1 && fwrite(key.data(), 1, key.size(), file) == key.size() && fwrite(data, 1, size, file) == size;
+    written = fclose(file) == 0 && written;
+    
+    if(!written || rename(temp.c_str(), path.c_str()) != 0) {
+        fprintf(stderr, "%s could not be written\n", path.c_str());
+        remove(temp.c_str());
+    }
+}
+
+cl_program ProgramCache::get(const char* file_name, const char* options) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    std::string name = std::string(file_name) + " " + options;
+    auto it = programs.find(name);
+    
+    if(it != programs.end())
+        return it->second;
+    
+    std::string str;
+    std::vector<std::string> included;
+    cl_program program = NULL;
+    
+    if(source(file_name, &str, included)) {
+        std::string key = deviceKey + "\n" + options;
+        unsigned long long hash = hash_string(key + "\n" + str);
+        std::string path;
+        
+        if(!directory.empty()) {
+            char hex[17];
+            snprintf(hex, sizeof(hex), "%016llx", hash);
+            path = directory + "/" + hex + ".bin";
+            program = load(path, key, hash, options);
+        }
+        
+        if(program != NULL) {
+            ++loaded;
+            fprintf(stderr, "loaded %s\n", file_name);
+        }else{
+            const char* text = str.c_str();
+            const size_t size = str.size();
+            
+            program = clCreateProgramWithSource(context, 1, &text, &size, NULL);
+            
+            if(program != NULL && clBuildProgram(program, 1, &device, options, NULL, NULL) != CL_SUCCESS) {
+                print_build_log(program, device, file_name);
+                clReleaseProgram(program);
+                program = NULL;
+            }
+            
+            if(program != NULL) {
+                ++built;
+                fprintf(stderr, "compiled %s\n", file_name);
+                
+                if(!path.empty())
+                    save(program, path, key, hash);
+            }
+        }
+    }
+    
+    /// a program that failed is not tried again for each of its kernels
+    programs[name] = program;
+    return program;
+}
+
+cl_kernel ProgramCache::kernel(const char* file_name, const char* kernel_name, const char* options) {
+    cl_program program = get(file_name, options);
+    
+    if(program == NULL)
+        return NULL;
+    
+    cl_kernel kernel = clCreateKernel(program, kernel_name, NULL);
+    
+    if(kernel == NULL)
+        fprintf(stderr, "%s has no kernel %s\n", file_name, kernel_name);
+    else
+        fprintf(stderr, "made %s\n", kernel_name);
+    
+    return kernel;
+}
+
+void ProgramCache::release() {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    for(auto& p : programs)
+        if(p.second != NULL)
+            clReleaseProgram(p.second);
+    
+    programs.clear();
+}
+
+void ProgramCache::release(const char* file_name, const char* options) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    auto it = programs.find(std::string(file_name) + " " + options);
+    
+    if(it == programs.end())
+        return;
+    
+    if(it->second != NULL)
+        clReleaseProgram(it->second);
+    
+    programs.erase(it);
+}
@@ -0,0 +1,93 @@
+//
+//  ProgramCache.hpp
+//  SPH
+//
+//  Created by Arthur Sun on 6/26/19.
+//  Copyright © 2019 Arthur Sun. All rights reserved.
+//
+
+#ifndef ProgramCache_hpp
+#define ProgramCache_hpp
+
+#include <map>
+#include <mutex>
+#include "common.h"
+
+#define PROGRAM_CACHE_VERSION 1
+
+/// the start of a cached binary, the key is checked again in case two keys hash the same
+struct ProgramCacheHeader
+{
+    char magic[4];
+    int version;
+    unsigned long long hash;
+    int keySize;
+    int binarySize;
+};
+
+/**
+ * builds each OpenCL program once per source and build options, every kernel of it comes from the same cl_program
+ * sources come from kernels.h, or from the files in SPH_KERNEL_DIR when it is set
+ * binaries are kept in SPH_CACHE_DIR, or the user's cache directory, keyed by the device, its driver, the source and the options
+ * an empty SPH_CACHE_DIR turns the disk cache off, get() and kernel() can be called from any thread
+ */
+class ProgramCache
+{
+    cl_context context;
+    cl_device_id device;
+    
+    /// the device name, its OpenCL version and the driver version
+    std::string deviceKey;
+    
+    /// empty when binaries are not kept
+    std::string directory;
+    
+    /// by file name and options
+    std::map<std::string, cl_program> programs;
+    
+    /// programs can be built on more than one thread
+    std::mutex mutex;
+    
+    int built;
+    int loaded;
+    
+    /// the text of file_name with its includes pasted in, each file once
+    bool source(const char* file_name, std::string* str, std::vector<std::string>& included);
+    
+    /// NULL when there is no usable binary for key
+    cl_program load(const std::string& path, const std::string& key, unsigned long long hash, const char* options);
+    
+    void save(cl_program program, const std::string& path, const std::string& key, unsigned long long hash);
+    
+public:
+    
+    inline ProgramCache() : context(NULL), device(NULL), built(0), loaded(0) {}
+    
+    inline ~ProgramCache() {
+        release();
+    }
+    
+    void initialize(cl_context context, cl_device_id device);
+    
+    /// the program of file_name built with options, NULL and the build log on stderr if it does not build
+    cl_program get(const char* file_name, const char* options = "");
+    
+    cl_kernel kernel(const char* file_name, const char* kernel_name, const char* options = "");
+    
+    /// kernels made from the programs keep them alive
+    void release();
+    
+    /// forgets the program of file_name built with options, the next get() builds or loads it again
+    void release(const char* file_name, const char* options);
+    
+    /// programs compiled from source, and loaded from the disk cache
+    inline int getBuilt() const {
+        return built;
+    }
+    
+    inline int getLoaded() const {
+        return loaded;
+    }
+};
+
+#endif /* ProgramCache_hpp */
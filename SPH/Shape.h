@@ -132,6 +132,25 @@ struct Shape
         return true;
     }
     
+    /// signed distance to the outline, negative inside, the shape is convex with its vertices counter-clockwise
+    inline float distance(const vec2& p) const {
+        float inside = -INFINITY;
+        float outside = INFINITY;
+        
+        for(int i = 0; i < count; ++i) {
+            int i2 = i != count - 1 ? i + 1 : 0;
+            vec2 e = vertices[i2] - vertices[i];
+            vec2 d = p - vertices[i];
+            
+            inside = std::max(inside, dot(normals[i], d));
+            
+            float t = std::min(std::max(dot(d, e) / e.lengthSq(), 0.0f), 1.0f);
+            outside = std::min(outside, (d - t * e).lengthSq());
+        }
+        
+        return inside > 0.0f ? sqrtf(outside) : inside;
+    }
+    
     inline AABB aabb() const {
         AABB q(vertices[0], vertices[0]);
         for(int i = 1; i < count; ++i) {
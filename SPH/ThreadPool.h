@@ -0,0 +1,163 @@
+//
+//  ThreadPool.h
+//  SPH
+//
+//  Created by Arthur Sun on 6/22/19.
+//  Copyright © 2019 Arthur Sun. All rights reserved.
+//
+
+#ifndef ThreadPool_h
+#define ThreadPool_h
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+/**
+ * a fixed set of workers that run parallel loops together with the calling thread
+ * a loop is cut into chunks, each thread starts on its own run of them and
+ * steals chunks from the others once its own run is done
+ */
+class ThreadPool
+{
+    /// the chunks a thread still has to run, others take from it too once they run out
+    struct Run
+    {
+        std::atomic<int> next;
+        int end;
+        
+        /// keeps the counters of two threads off one cache line
+        char padding[56];
+    };
+    
+    typedef std::function<void(int begin, int end, int thread)> Task;
+    
+    std::vector<std::thread> workers;
+    
+    Run* runs;
+    
+    const Task* task;
+    
+    int size;
+    int grain;
+    
+    std::mutex mutex;
+    std::condition_variable started;
+    std::condition_variable finished;
+    
+    /// bumped for every loop, workers run one loop per bump
+    unsigned generation;
+    
+    /// workers still inside the current loop
+    int busy;
+    
+    bool stopping;
+    
+    inline void run(int thread) {
+        int threads = getThreadCount();
+        
+        for(int k = 0; k < threads; ++k) {
+            Run& r = runs[(thread + k) % threads];
+            
+            for(int c = r.next.fetch_add(1, std::memory_order_relaxed); c < r.end; c = r.next.fetch_add(1, std::memory_order_relaxed)) {
+                int begin = c * grain;
+                (*task)(begin, std::min(begin + grain, size), thread);
+            }
+        }
+    }
+    
+    inline void work(int thread) {
+        unsigned seen = 0;
+        
+        for(;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                started.wait(lock, [&] { return stopping || generation != seen; });
+                
+                if(stopping)
+                    return;
+                
+                seen = generation;
+            }
+            
+            run(thread);
+            
+            std::lock_guard<std::mutex> lock(mutex);
+            if(--busy == 0)
+                finished.notify_one();
+        }
+    }
+    
+public:
+    
+    /// 0 threads uses one per hardware thread, the calling thread counts as one of them
+    inline ThreadPool(int threads) : generation(0), busy(0), stopping(false) {
+        if(threads <= 0)
+            threads = std::max(1, (int)std::thread::hardware_concurrency());
+        
+        runs = new Run[threads];
+        
+        for(int i = 1; i < threads; ++i)
+            workers.emplace_back(&ThreadPool::work, this, i);
+    }
+    
+    inline ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        
+        started.notify_all();
+        
+        for(std::thread& t : workers)
+            t.join();
+        
+        delete [] runs;
+    }
+    
+    inline int getThreadCount() const {
+        return (int)workers.size() + 1;
+    }
+    
+    /// calls fn(begin, end, thread) over [0, n) in chunks of grain, returns once all of them are done
+    inline void parallel_for(int n, int grain, const Task& fn) {
+        if(n <= 0)
+            return;
+        
+        int threads = getThreadCount();
+        int chunks = (n + grain - 1) / grain;
+        
+        if(threads == 1 || chunks == 1) {
+            for(int begin = 0; begin < n; begin += grain)
+                fn(begin, std::min(begin + grain, n), 0);
+            return;
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            
+            for(int i = 0; i < threads; ++i) {
+                runs[i].next.store((int)((long)chunks * i / threads), std::memory_order_relaxed);
+                runs[i].end = (int)((long)chunks * (i + 1) / threads);
+            }
+            
+            task = &fn;
+            size = n;
+            this->grain = grain;
+            busy = threads - 1;
+            ++generation;
+        }
+        
+        started.notify_all();
+        
+        run(0);
+        
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return busy == 0; });
+    }
+};
+
+#endif /* ThreadPool_h */
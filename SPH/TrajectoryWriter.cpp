@@ -0,0 +1,235 @@
+//
+//  TrajectoryWriter.cpp
+//  SPH
+//
+//  Created by Arthur Sun on 6/26/19.
+//  Copyright © 2019 Arthur Sun. All rights reserved.
+//
+
+#include "TrajectoryWriter.hpp"
+
+/// rounds to the nearest half float, ties to even, what is too large becomes infinity
+static inline unsigned short float_to_half(float f) {
+    unsigned int x;
+    memcpy(&x, &f, sizeof(x));
+    
+    unsigned int sign = (x >> 16) & 0x8000;
+    unsigned int m = x & 0x7fffff;
+    int e = (int)((x >> 23) & 0xff) - 127 + 15;
+    
+    if(((x >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (m != 0 ? 0x200 : 0);
+    
+    if(e >= 31)
+        return sign | 0x7c00;
+    
+    /// too small for a normal half, it keeps what fits of its implicit bit and mantissa
+    if(e <= 0) {
+        if(e < -10)
+            return sign;
+        
+        m |= 0x800000;
+        int shift = 14 - e;
+        unsigned int h = m >> shift;
+        unsigned int rest = m & ((1u << shift) - 1);
+        unsigned int half = 1u << (shift - 1);
+        
+        if(rest > half || (rest == half && (h & 1)))
+            ++h;
+        
+        return sign | h;
+    }
+    
+    unsigned int h = ((unsigned int)e << 10) | (m >> 13);
+    unsigned int rest = m & 0x1fff;
+    
+    /// a carry out of the mantissa rounds up into the exponent, which is still correct
+    if(rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+        ++h;
+    
+    return sign | h;
+}
+
+/// x spread over [lower, upper] in 16 bits
+static inline unsigned short quantise(float x, float lower, float upper) {
+    float t = (x - lower) / (upper - lower);
+    return (unsigned short)(std::max(0.0f, std::min(t, 1.0f)) * 65535.0f + 0.5f);
+}
+
+TrajectoryWriter::TrajectoryWriter(const char* file_name, TrajectoryEncoding encoding, const AABB& bounds, int frames, bool dropWhenFull) : ring(std::max(frames, 1)), first(0), queued(0), dropWhenFull(dropWhenFull), lastStep(0), written(0), dropped(0), encoding(encoding), bounds(bounds), stopping(false) {
+    file = fopen(file_name, "wb");
+    
+    if(file == NULL) {
+        fprintf(stderr, "%s cannot be opened\n", file_name);
+        return;
+    }
+    
+    TrajectoryHeader h;
+    memcpy(h.magic, "SPHT", sizeof(h.magic));
+    h.version = TRAJECTORY_VERSION;
+    h.encoding = encoding;
+    h.bounds = bounds;
+    fwrite(&h, sizeof(h), 1, file);
+    
+    worker = std::thread(&TrajectoryWriter::work, this);
+}
+
+TrajectoryWriter::~TrajectoryWriter() {
+    if(file == NULL)
+        return;
+    
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    
+    ready.notify_one();
+    worker.join();
+    
+    if(ferror(file))
+        fprintf(stderr, "the trajectory could not be written completely\n");
+    
+    fclose(file);
+}
+
+bool TrajectoryWriter::push(const Readback& r) {
+    /// a step number that went back is a backend that was started over, not a frame seen before
+    if(r.step < lastStep)
+        restart();
+    
+    if(file == NULL || r.step <= lastStep)
+        return false;
+    
+    lastStep = r.step;
+    
+    std::unique_lock<std::mutex> lock(mutex);
+    
+    if(queued == (int)ring.size()) {
+        if(dropWhenFull) {
+            ++dropped;
+            return false;
+        }
+        
+        drained.wait(lock, [&] { return queued < (int)ring.size(); });
+    }
+    
+    /// the thread only touches queued frames, so this one is filled without the lock
+    Frame& f = ring[(first + queued) % ring.size()];
+    lock.unlock();
+    
+    f.step = r.step;
+    
+    if(r.lifetimes == NULL) {
+        f.count = r.count;
+        f.positions.assign(r.positions, r.positions + r.count);
+        f.velocities.assign(r.velocities, r.velocities + r.count);
+        f.ids.assign(r.ids, r.ids + r.count);
+        f.sceneIds.assign(r.sceneIds, r.sceneIds + r.count);
+    }else{
+        /// the dead the backend has not removed yet are left out
+        f.positions.clear();
+        f.velocities.clear();
+        f.ids.clear();
+        f.sceneIds.clear();
+        
+        for(int i = 0; i < r.count; ++i) {
+            if(r.lifetimes[i] > 0.0f) {
+                f.positions.push_back(r.positions[i]);
+                f.velocities.push_back(r.velocities[i]);
+                f.ids.push_back(r.ids[i]);
+                f.sceneIds.push_back(r.sceneIds[i]);
+            }
+        }
+        
+        f.count = (int)f.ids.size();
+    }
+    
+    lock.lock();
+    ++queued;
+    lock.unlock();
+    
+    ready.notify_one();
+    return true;
+}
+
+void TrajectoryWriter::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    
+    for(;;) {
+        ready.wait(lock, [&] { return stopping || queued > 0; });
+        
+        if(queued == 0)
+            break;
+        
+        const Frame& f = ring[first];
+        
+        lock.unlock();
+        write(f);
+        lock.lock();
+        
+        first = (first + 1) % ring.size();
+        --queued;
+        ++written;
+        
+        drained.notify_one();
+    }
+}
+
+void TrajectoryWriter::write(const Frame& f) {
+    size_t vector = encoding == trajectory_float32 ? sizeof(vec2) : 2 * sizeof(unsigned short);
+    size_t bytes = f.count * (2 * sizeof(int) + 2 * vector);
+    
+    chunk.resize(sizeof(TrajectoryChunk) + bytes);
+    
+    TrajectoryChunk* c = (TrajectoryChunk*)chunk.data();
+    memcpy(c->tag, "FRAM", sizeof(c->tag));
+    c->bytes = (int)bytes;
+    c->step = f.step;
+    c->count = f.count;
+    
+    char* data = chunk.data() + sizeof(TrajectoryChunk);
+    
+    memcpy(data, f.ids.data(), f.count * sizeof(int));
+    data += f.count * sizeof(int);
+    
+    memcpy(data, f.sceneIds.data(), f.count * sizeof(int));
+    data += f.count * sizeof(int);
+    
+    if(encoding == trajectory_float32) {
+        memcpy(data, f.positions.data(), f.count * sizeof(vec2));
+        memcpy(data + f.count * sizeof(vec2), f.velocities.data(), f.count * sizeof(vec2));
+    }else{
+        unsigned short* p = (unsigned short*)data;
+        unsigned short* v = p + 2 * f.count;
+        
+        for(int i = 0; i < f.count; ++i) {
+            if(encoding == trajectory_quantised) {
+                p[2 * i] = quantise(f.positions[i].x, bounds.lowerBound.x, bounds.upperBound.x);
+                p[2 * i + 1] = quantise(f.positions[i].y, bounds.lowerBound.y, bounds.upperBound.y);
+            }else{
+                p[2 * i] = float_to_half(f.positions[i].x);
+                p[2 * i + 1] = float_to_half(f.positions[i].y);
+            }
+            
+            v[2 * i] = float_to_half(f.velocities[i].x);
+            v[2 * i + 1] = float_to_half(f.velocities[i].y);
+        }
+    }
+    
+    fwrite(chunk.data(), chunk.size(), 1, file);
+}
+
+int TrajectoryWriter::getQueued() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queued;
+}
+
+long TrajectoryWriter::getWritten() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return written;
+}
+
+long TrajectoryWriter::getDropped() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return dropped;
+}
@@ -0,0 +1,140 @@
+//
+//  TrajectoryWriter.hpp
+//  SPH
+//
+//  Created by Arthur Sun on 6/26/19.
+//  Copyright © 2019 Arthur Sun. All rights reserved.
+//
+
+#ifndef TrajectoryWriter_hpp
+#define TrajectoryWriter_hpp
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "Backend.h"
+#include "Shape.h"
+
+#define TRAJECTORY_VERSION 1
+
+/// how a trajectory stores positions, velocities are 32 bit floats in the first and 16 bit floats in the others
+enum TrajectoryEncoding
+{
+    trajectory_float32,
+    trajectory_float16,
+    
+    /// 16 bits per axis spread over the bounds the writer was given, particles outside them are clamped
+    trajectory_quantised
+};
+
+/// the start of a trajectory file, followed by one chunk per frame
+struct TrajectoryHeader
+{
+    char magic[4];
+    int version;
+    int encoding;
+    AABB bounds;
+};
+
+/**
+ * one frame, followed by bytes of count ids, count scene ids, then the positions and velocities as encoding says
+ * a reader that does not want a frame skips bytes ahead
+ */
+struct TrajectoryChunk
+{
+    char tag[4];
+    int bytes;
+    
+    /// Readback::step of the frame
+    int step;
+    
+    int count;
+};
+
+/**
+ * streams frames to a file from a thread of its own
+ * push() copies a frame into a ring of buffers that keep their memory between frames,
+ * it only waits when every buffer is still queued, or drops the frame instead when asked to
+ */
+class TrajectoryWriter
+{
+    struct Frame
+    {
+        int step;
+        int count;
+        std::vector<vec2> positions;
+        std::vector<vec2> velocities;
+        std::vector<int> ids;
+        std::vector<int> sceneIds;
+    };
+    
+    std::vector<Frame> ring;
+    
+    /// the oldest queued frame, and how many follow it
+    int first;
+    int queued;
+    
+    bool dropWhenFull;
+    
+    /// the newest step pushed, so a readback seen twice is written once
+    int lastStep;
+    
+    long written;
+    long dropped;
+    
+    FILE* file;
+    TrajectoryEncoding encoding;
+    AABB bounds;
+    
+    /// a chunk is put together here before it is written
+    std::vector<char> chunk;
+    
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable drained;
+    
+    bool stopping;
+    
+    /// encodes and writes the queued frames until stopping, then whatever is left
+    void work();
+    
+    void write(const Frame& f);
+    
+public:
+    
+    /**
+     * writes to file_name with frames buffers in the ring
+     * positions are quantised over bounds, with dropWhenFull push() drops a frame rather than wait for a buffer
+     */
+    TrajectoryWriter(const char* file_name, TrajectoryEncoding encoding, const AABB& bounds, int frames, bool dropWhenFull);
+    
+    /// writes every frame still queued, then closes the file
+    ~TrajectoryWriter();
+    
+    inline bool isOpen() const {
+        return file != NULL;
+    }
+    
+    /**
+     * queues a copy of the frame, returns false if it was dropped, or skipped because it was pushed before
+     * r can be reused as soon as it returns
+     */
+    bool push(const Readback& r);
+    
+    /// the backend starts counting steps again, its next frames are new whatever their step
+    inline void restart() {
+        lastStep = 0;
+    }
+    
+    /// frames waiting for the thread
+    int getQueued();
+    
+    /// frames written so far
+    long getWritten();
+    
+    /// frames push() dropped because the ring was full
+    long getDropped();
+};
+
+#endif /* TrajectoryWriter_hpp */
@@ -0,0 +1,341 @@
+//
+//  bench.cpp
+//  SPH
+//
+//  Created by Arthur Sun on 6/20/19.
+//  Copyright © 2019 Arthur Sun. All rights reserved.
+//
+
+/**
+ * headless benchmark, runs fixed scenes without a window and
+ * prints per-stage device times as JSON so runs can be compared across commits
+ *
+ * usage: sph_bench [scenario ...] [-frames n] [-backend opencl|native ...] [-threads n] [-kernels scalar|avx2|avx512] [-skin f] [-symmetric] [-courant c] [-sleep k] [-resort f] [-generic] [-trajectory file]
+ * every scenario runs once on each backend given, so they can be compared on the same scene
+ * -kernels runs the native backend on those neighbour kernels instead of the widest the cpu has, so their results can be compared
+ * -skin turns on the neighbour lists, with a skin of f particle diameters
+ * -symmetric solves each pair once on the native backend
+ * -sleep lets cells that have been still for k substeps sleep, the rate counts sleeping particles too
+ * -courant picks at least 6 substeps a frame from the CFL condition, the rate counts the substeps actually taken
+ * -resort merges the particles that changed cell back into the last sort while at most a share f of them did
+ * -generic keeps the OpenCL kernels that take the diameter and the scenes as arguments, instead of building them in as constants
+ * -trajectory streams every frame to file, quantised over the domain, and reports the frames it had to drop
+ * neighbours is 0 unless built with COUNT_NEIGHBOURS
+ */
+ 
+#include <cstring>
+#include "ParticleSystem.hpp"
+
+#define substeps 6
+
+float dt = 0.016f;
+float D = 0.05f;
+
+vec2 gravity(0.0f, -9.8f);
+
+struct Scenario
+{
+    const char* name;
+    int frames;
+    void (*setup)(ParticleSystem& ps);
+};
+
+/// a column of water released against the left wall
+void damBreak(ParticleSystem& ps) {
+    Shape shape;
+    shape.initializeAsBox(vec2(-3.5f, -1.0f), 1.5f, 2.0f);
+    ps.add(shape, vec2(0.0f, 0.0f));
+}
+
+/// what the A, B, Q and S keys of the viewer drop in
+void drops(ParticleSystem& ps) {
+    Shape shape;
+    
+    shape.initializeAsCircle(vec2(-2.0f, 0.5f), 1.0f, 60);
+    ps.add(shape, vec2(0.0f, 0.0f));
+    
+    shape.initializeAsBox(vec2(2.5f, 0.0f), 1.0f, 10.0f);
+    ps.add(shape, vec2(0.0f, 0.0f));
+    
+    shape.initializeAsBox(vec2(0.0f, 1.5f), 1.0f, 1.0f);
+    ps.add(shape, vec2(0.0f, 0.0f));
+    
+    shape.initializeAsCircle(vec2(-4.0f, 2.0f), 0.2f, 60);
+    ps.add(shape, vec2(100.0f, 0.0f));
+}
+
+/// about a million particles settling in a wide tank
+void block(ParticleSystem& ps) {
+    ps.domain = AABB(vec2(-20.0f, -20.0f), vec2(20.0f, 20.0f));
+    
+    Shape shape;
+    shape.initializeAsBox(vec2(0.0f, -1.25f), 18.75f, 18.75f);
+    ps.add(shape, vec2(0.0f, 0.0f));
+}
+
+/// 64 small dam breaks under different gravity, all advanced by the same dispatches
+void sweep(ParticleSystem& ps) {
+    Shape shape;
+    shape.initializeAsBox(vec2(-0.6f, -0.2f), 0.35f, 0.75f);
+    
+    for(int i = 0; i < 64; ++i) {
+        int scene = ps.addScene(vec2(0.0f, -4.9f - 0.15f * i), AABB(vec2(-1.0f, -1.0f), vec2(1.0f, 1.0f)));
+        ps.add(scene, shape, vec2(0.0f, 0.0f));
+    }
+}
+
+/// a block of water falling through rows of pegs into an octagonal bowl, all of them in the signed distance field
+void pegs(ParticleSystem& ps) {
+    Shape shape;
+    
+    shape.initializeAsCircle(vec2(0.0f, 0.5f), 5.5f, 8);
+    ps.addContainer(shape);
+    
+    for(int row = 0; row < 2; ++row) {
+        for(int i = 0; i < 7 - row; ++i) {
+            shape.initializeAsCircle(vec2(-3.0f + row * 0.5f + i, 0.6f - row * 0.8f), 0.15f, 24);
+            ps.addObstacle(shape);
+        }
+    }
+    
+    shape.initializeAsBox(vec2(0.0f, 2.2f), 2.5f, 0.6f);
+    ps.add(shape, vec2(0.0f, 0.0f));
+}
+
+/// a jet filling the tank from the upper left, its particles made on the device every substep
+void stream(ParticleSystem& ps) {
+    ps.addNozzle(vec2(-4.5f, 2.0f), vec2(4.0f, 0.0f), 0.5f, 1500.0f);
+}
+
+/// the jet of stream drained by a sink in the lower right corner, and a spray that lasts a second, particles are removed every step
+void drain(ParticleSystem& ps) {
+    stream(ps);
+    ps.addNozzle(vec2(4.5f, 2.0f), vec2(-3.0f, 1.0f), 0.2f, 300.0f, 0, DistBtwParticles, 1.0f);
+    
+    Shape shape;
+    shape.initializeAsBox(vec2(4.5f, -3.0f), 1.5f, 0.75f);
+    ps.addSink(shape);
+}
+
+Scenario scenarios[] = {
+    {"dam_break", 300, damBreak},
+    {"drops", 300, drops},
+    {"block_1m", 20, block},
+    {"sweep_64", 300, sweep},
+    {"pegs", 300, pegs},
+    {"stream", 300, stream},
+    {"drain", 600, drain}
+};
+
+const char* backendNames[] = {"opencl", "native"};
+
+void run(const Scenario& scenario, BackendType backend, int threads, const char* kernels, float skin, bool symmetric, float courant, int sleep, float resort, bool generic, const char* trajectory, int frames, bool first) {
+    ParticleSystem* ps = new ParticleSystem(gravity);
+    ps->profiling = true;
+    ps->backendType = backend;
+    ps->threads = threads;
+    ps->nativeKernels = kernels;
+    ps->skin = skin * D;
+    ps->symmetric = symmetric;
+    ps->courant = courant;
+    ps->sleepSteps = sleep;
+    ps->resortLimit = resort;
+    ps->specialise = !generic;
+    ps->initialize(D);
+    
+    scenario.setup(*ps);
+    
+    TrajectoryWriter* writer = NULL;
+    
+    if(trajectory != NULL) {
+        writer = new TrajectoryWriter(trajectory, trajectory_quantised, ps->domain, 8, true);
+        ps->trajectory = writer;
+    }
+    
+    Stats stats;
+    
+    /// the first frames include kernel warm-up and are left out, the kernels built for the scene run from the second
+    for(int i = 0; i < 2; ++i) {
+        ps->step(dt, substeps);
+        ps->waitForKernels();
+    }
+    
+    ps->takeStats(&stats);
+    
+    nanosecond_type start = current_nanosecond;
+    
+    int taken = 0;
+    double active = 0.0;
+    double changed = 0.0;
+    
+    for(int i = 0; i < frames; ++i) {
+        ps->step(dt, substeps);
+        active += ps->latest().activeFraction;
+        changed += ps->latest().movedFraction;
+        taken += ps->getSubsteps();
+    }
+    
+    ps->finish();
+    
+    double seconds = std::chrono::duration<double>(current_nanosecond - start).count();
+    
+    ps->takeStats(&stats);
+    
+    int count = stats.count;
+    double rate = (double)count * taken / seconds;
+    
+    if(!first)
+        printf(",\n");
+    
+    printf("    {\n");
+    printf("      \"name\": \"%s\",\n", scenario.name);
+    printf("      \"backend\": \"%s\",\n", backendNames[backend]);
+    printf("      \"device\": \"%s\",\n", ps->getDeviceName().c_str());
+    printf("      \"particles\": %d,\n", count);
+    printf("      \"frames\": %d,\n", frames);
+    printf("      \"substeps\": %f,\n", taken / (double)frames);
+    printf("      \"courant\": %f,\n", courant);
+    printf("      \"sleep_steps\": %d,\n", sleep);
+    printf("      \"active_fraction\": %f,\n", active / frames);
+    printf("      \"resort_limit\": %f,\n", resort);
+    printf("      \"moved_fraction\": %f,\n", changed / frames);
+    printf("      \"skin\": %f,\n", skin);
+    printf("      \"symmetric\": %s,\n", symmetric ? "true" : "false");
+    printf("      \"specialised\": %s,\n", generic ? "false" : "true");
+    
+    if(writer != NULL) {
+        printf("      \"trajectory_written\": %ld,\n", writer->getWritten());
+        printf("      \"trajectory_queued\": %d,\n", writer->getQueued());
+        printf("      \"trajectory_dropped\": %ld,\n", writer->getDropped());
+    }
+    
+    printf("      \"rebuilds\": %d,\n", stats.rebuilds);
+    printf("      \"sort_passes\": %d,\n", stats.sortPasses);
+    printf("      \"neighbours\": %f,\n", stats.neighbours);
+    printf("      \"seconds\": %f,\n", seconds);
+    printf("      \"particle_steps_per_second\": %f,\n", rate);
+    printf("      \"wait_ms\": %f,\n", stats.waitTime);
+    printf("      \"stage_ms\": {");
+    
+    for(int s = 0; s < stage_count; ++s)
+        printf("%s\"%s\": %f", s == 0 ? "" : ", ", stage_name(s), stats.stageTimes[s]);
+    
+    printf("}\n    }");
+    
+    delete ps;
+    delete writer;
+}
+
+int main(int argc, const char * argv[]) {
+    int frames = 0;
+    int threads = 0;
+    const char* kernels = NULL;
+    float skin = 0.0f;
+    bool symmetric = false;
+    float courant = 0.0f;
+    int sleep = 0;
+    float resort = 0.0f;
+    bool generic = false;
+    const char* trajectory = NULL;
+    std::vector<const Scenario*> selected;
+    std::vector<BackendType> backends;
+    
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "-frames") == 0 && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+            continue;
+        }
+        
+        if(strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            continue;
+        }
+        
+        if(strcmp(argv[i], "-kernels") == 0 && i + 1 < argc) {
+            kernels = argv[++i];
+            if(strcmp(kernels, "scalar") != 0 && strcmp(kernels, "avx2") != 0 && strcmp(kernels, "avx512") != 0) {
+                fprintf(stderr, "unknown kernels %s\n", kernels);
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+        
+        if(strcmp(argv[i], "-skin") == 0 && i + 1 < argc) {
+            skin = atof(argv[++i]);
+            continue;
+        }
+        
+        if(strcmp(argv[i], "-symmetric") == 0) {
+            symmetric = true;
+            continue;
+        }
+        
+        if(strcmp(argv[i], "-courant") == 0 && i + 1 < argc) {
+            courant = atof(argv[++i]);
+            continue;
+        }
+        
+        if(strcmp(argv[i], "-sleep") == 0 && i + 1 < argc) {
+            sleep = atoi(argv[++i]);
+            continue;
+        }
+        
+        if(strcmp(argv[i], "-resort") == 0 && i + 1 < argc) {
+            resort = atof(argv[++i]);
+            continue;
+        }
+        
+        if(strcmp(argv[i], "-generic") == 0) {
+            generic = true;
+            continue;
+        }
+        
+        if(strcmp(argv[i], "-trajectory") == 0 && i + 1 < argc) {
+            trajectory = argv[++i];
+            continue;
+        }
+        
+        if(strcmp(argv[i], "-backend") == 0 && i + 1 < argc) {
+            ++i;
+            if(strcmp(argv[i], "native") == 0) {
+                backends.push_back(backend_native);
+            }else if(strcmp(argv[i], "opencl") == 0) {
+                backends.push_back(backend_opencl);
+            }else{
+                fprintf(stderr, "unknown backend %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+        
+        bool found = false;
+        for(const Scenario& s : scenarios) {
+            if(strcmp(argv[i], s.name) == 0) {
+                selected.push_back(&s);
+                found = true;
+            }
+        }
+        
+        if(!found) {
+            fprintf(stderr, "unknown scenario %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    if(selected.empty())
+        for(const Scenario& s : scenarios)
+            selected.push_back(&s);
+    
+    if(backends.empty())
+        backends.push_back(backend_opencl);
+    
+    printf("{\n  \"scenarios\": [\n");
+    
+    for(size_t i = 0; i < selected.size(); ++i)
+        for(size_t b = 0; b < backends.size(); ++b)
+            run(*selected[i], backends[b], threads, kernels, skin, symmetric, courant, sleep, resort, generic, trajectory, frames > 0 ? frames : selected[i]->frames, i == 0 && b == 0);
+    
+    printf("\n  ]\n}\n");
+    
+    return EXIT_SUCCESS;
+}
@@ -3,19 +3,154 @@
 #ifndef common_cl
 #define common_cl
 
-#define BOUNDS 1
-
 typedef struct Proxy {
     int index;
     int hash;
 } Proxy;
 
+/**
+ * parameters of one scene, scenes share the buffers but never interact
+ * a particle's scene is found through its entry in the scene id buffer
+ */
+typedef struct Scene {
+    float2 gravity;
+    float2 lower;
+    float2 upper;
+    
+    /// cells of the scene's bounded grid, (0, 0) when hashing modulo the cell count
+    int2 size;
+    
+    /// first cell of the scene's grid in the shared cell table
+    int offset;
+    
+    /// the scene steps dt * timeScale per substep
+    float timeScale;
+    
+    /// samples of the scene's signed distance field, fieldSpacing apart from lower, positive where particles are free
+    int2 fieldSize;
+    
+    /// first sample of the scene's field in the shared field buffer, -1 without obstacles
+    int field;
+    
+    /// first sample of the field of its sinks, -1 without sinks
+    int sink;
+    
+    float fieldSpacing;
+} Scene;
+
+/// the particle diameter, a constant the compiler folds when the program was built with PARTICLE_DIAMETER
+#ifdef PARTICLE_DIAMETER
+#define DIAMETER(d) (PARTICLE_DIAMETER)
+#else
+#define DIAMETER(d) (d)
+#endif
+
+/**
+ * the scene of particle i, built with SINGLE_SCENE every particle is in scene 0 and S is never read
+ * SCENE_SIZE_X and SCENE_SIZE_Y then fix the size of its grid, so the strides between cells are constants
+ */
+inline Scene scene_of(global const Scene* scenes, global const int* S, int i) {
+#if SINGLE_SCENE
+    Scene s = scenes[0];
+#ifdef SCENE_SIZE_X
+    s.size = (int2)(SCENE_SIZE_X, SCENE_SIZE_Y);
+#endif
+    return s;
+#else
+    return scenes[S[i]];
+#endif
+}
+
 inline int imod(int x, int m) {
     return ((x % m) + m) % m;
 }
 
-inline int map(int x, int y) {
-    return imod(x + (y << 10), MAX_PARTICLE_COUNT);
+/// cell coordinates of p, relative to the lower corner of the grid
+inline int2 cell_of(float2 p, float2 lower, float D) {
+    return convert_int2(floor((p - lower) / D));
+}
+
+/**
+ * size.x > 0 selects the bounded grid, where every cell has its own row-major slot
+ * and cells outside the grid map to -1
+ * otherwise cells are hashed modulo n, and distant cells can alias
+ */
+inline int map(int2 c, int2 size, int n) {
+    if(size.x > 0) {
+        if(c.x < 0 || c.y < 0 || c.x >= size.x || c.y >= size.y)
+            return -1;
+        return c.x + c.y * size.x;
+    }
+    
+    return imod(c.x + (c.y << 10), n);
+}
+
+/// the cell a particle is filed under, particles outside a bounded grid go to its border cells
+inline int2 home_cell(float2 p, float2 lower, int2 size, float D) {
+    int2 c = cell_of(p, lower, D);
+    
+    if(size.x > 0)
+        c = clamp(c, (int2)(0, 0), size - (int2)(1, 1));
+    
+    return c;
+}
+
+/// the cell table slot of c in scene s, or -1 outside its grid
+inline int scene_map(int2 c, Scene s, int n) {
+    int h = map(c, s.size, n);
+    return h < 0 ? h : h + s.offset;
+}
+
+/**
+ * activity holds the last substep something moved in or next to each slot
+ * a slot sleeps once steps substeps went by without, slots outside the grid always do and steps 0 never sleeps
+ */
+inline bool asleep(global const int* activity, int slot, int stamp, int steps) {
+    return steps > 0 && (slot < 0 || stamp - activity[slot] > steps);
+}
+
+/// c and every cell next to it sleep, so no particle that is awake needs the density of one in c
+inline bool deeply_asleep(global const int* activity, int2 c, Scene s, int n, int stamp, int steps) {
+    for(int x = -1; x <= 1; ++x)
+        for(int y = -1; y <= 1; ++y)
+            if(!asleep(activity, scene_map(c + (int2)(x, y), s, n), stamp, steps))
+                return false;
+    
+    return true;
+}
+
+/// keeps c and the cells next to it awake, marks is folded into activity once the substep is done
+inline void wake(global int* marks, int2 c, Scene s, int n, int stamp) {
+    for(int x = -1; x <= 1; ++x) {
+        for(int y = -1; y <= 1; ++y) {
+            int h = scene_map(c + (int2)(x, y), s, n);
+            if(h >= 0)
+                marks[h] = stamp;
+        }
+    }
+}
+
+/// the particle died and waits to be removed, with L NULL none has
+inline bool dead(global const float* L, int i) {
+    return L != 0 && L[i] <= 0.0f;
+}
+
+/// bilinear sample of a scene's signed distance field at p, relative to its lower corner, and the direction it grows in
+inline float field_distance(global const float* F, int2 size, float spacing, float2 p, float2* gradient) {
+    float2 g = clamp(p / spacing, (float2)(0.0f, 0.0f), convert_float2(size - (int2)(1, 1)));
+    int2 c = min(convert_int2(g), size - (int2)(2, 2));
+    float2 t = g - convert_float2(c);
+    
+    global const float* f = F + c.x + c.y * size.x;
+    
+    float d00 = f[0];
+    float d10 = f[1];
+    float d01 = f[size.x];
+    float d11 = f[size.x + 1];
+    
+    *gradient = (float2)(mix(d10 - d00, d11 - d01, t.y), mix(d01 - d00, d11 - d10, t.x));
+    
+    return mix(mix(d00, d10, t.x), mix(d01, d11, t.x), t.y);
 }
 
 #endif // common_cl
@@ -14,6 +14,9 @@
 #include <sstream>
 #include <cmath>
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 
 #ifdef __APPLE__
 #include <OpenCL/opencl.h>
@@ -40,6 +43,26 @@ typedef std::chrono::high_resolution_clock::time_point nanosecond_type;
 #define randf \
 (rand() / (float) RAND_MAX)
 
+/// runs call in every build, unlike assert, and stops with where it failed and the error it gave
+#define cl_check(call) \
+do { \
+    cl_int cl_status = (call); \
+    if(cl_status != CL_SUCCESS) { \
+        fprintf(stderr, "OpenCL error %d at %s:%d\n", cl_status, __FILE__, __LINE__); \
+        abort(); \
+    } \
+} while(0)
+
+/// number of bits needed to represent x
+inline int bit_width(unsigned int x) {
+    int n = 0;
+    while(x != 0) {
+        x >>= 1;
+        ++n;
+    }
+    return n;
+}
+
 template <class T>
 inline void Realloc(T** ptr, int oldSize, int size) {
     void* oldPtr = *ptr;
@@ -136,7 +159,7 @@ inline int fstr(const char* file_name, std::string* str) {
     file.open(file_name);
     
     if(!file.is_open()) {
-        printf("%s cannot be opened\n", file_name);
+        fprintf(stderr, "%s cannot be opened\n", file_name);
         return -1;
     }
     
@@ -154,28 +177,34 @@ inline cl_context create_cl_context(cl_int type, cl_device_id* device_id) {
     return clCreateContext(NULL, 1, device_id, NULL, NULL, NULL);
 }
 
-inline cl_program create_cl_program(cl_context context, const char* file_name) {
-    std::string str;
-    int success = fstr(file_name, &str);
-    
-    if(success == -1)
-        return NULL;
+inline std::string cl_device_name(cl_device_id device_id) {
+    char name[256] = {0};
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+    return name;
+}
+
+inline size_t max_work_group_size(cl_kernel kernel, cl_device_id device_id) {
+    size_t size = 1;
+    clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size), &size, NULL);
+    return size;
+}
+
+/// a multiple of the device's preferred size close to target, that the kernel can run with
+inline size_t pick_local_size(cl_kernel kernel, cl_device_id device_id, size_t target) {
+    size_t multiple = 1;
+    clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple), &multiple, NULL);
     
-    const char* source = str.c_str();
-    const size_t size = str.size();
+    size_t size = std::max(multiple, target / multiple * multiple);
+    size_t max = max_work_group_size(kernel, device_id);
     
-    printf("compiled %s\n", file_name);
+    if(size > max)
+        size = max >= multiple ? max / multiple * multiple : max;
     
-    return clCreateProgramWithSource(context, 1, &source, &size, NULL);
+    return size;
 }
 
-inline cl_kernel create_cl_kernel(cl_context context, cl_device_id device_id, const char* file_name, const char* kernel_name) {
-    cl_program program = create_cl_program(context, file_name);
-    clBuildProgram(program, 1, &device_id, NULL, NULL, NULL);
-    cl_kernel kernel = clCreateKernel(program, kernel_name, NULL);
-    clReleaseProgram(program);
-    printf("made %s\n", kernel_name);
-    return kernel;
+inline size_t round_up(size_t size, size_t multiple) {
+    return (size + multiple - 1) / multiple * multiple;
 }
 
 #endif /* common_h */
@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+#
+#  embed_kernels.py
+#  SPH
+#
+#  Created by Arthur Sun on 6/26/19.
+#  Copyright © 2019 Arthur Sun. All rights reserved.
+#
+
+"""
+writes kernels.h, the OpenCL sources and settings.h they include as string literals,
+so the programs build without the .cl files in the working directory
+
+usage: embed_kernels.py [directory]
+run it again after changing a .cl file or settings.h, the Xcode targets do it before compiling
+"""
+
+import os
+import sys
+
+directory = sys.argv[1] if len(sys.argv) > 1 else os.path.dirname(os.path.abspath(__file__))
+names = sorted(n for n in os.listdir(directory) if n.endswith('.cl')) + ['settings.h']
+
+out = []
+out.append('//\n//  kernels.h\n//  SPH\n//\n//  generated by embed_kernels.py from %s, do not edit\n//\n' % ', '.join(names))
+out.append('#ifndef kernels_h\n#define kernels_h\n')
+out.append('struct EmbeddedSource\n{\n    const char* name;\n    const char* text;\n};\n')
+out.append('static const EmbeddedSource embedded_sources[] = {')
+
+for name in names:
+    with open(os.path.join(directory, name)) as f:
+        text = f.read()
+
+    if ')sph"' in text:
+        sys.exit('%s cannot be embedded, it contains the raw string delimiter' % name)
+
+    out.append('    {"%s", R"sph(%s)sph"},' % (name, text))
+
+out.append('    {NULL, NULL}\n};\n')
+out.append('#endif /* kernels_h */\n')
+
+path = os.path.join(directory, 'kernels.h')
+text = '\n'.join(out)
+
+# left alone when nothing changed, so the build does not recompile what includes it
+if not os.path.exists(path) or open(path).read() != text:
+    with open(path, 'w') as f:
+        f.write(text)
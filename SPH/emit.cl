@@ -0,0 +1,84 @@
+#include "common.cl"
+
+typedef struct Nozzle {
+    float2 position;
+    float2 velocity;
+    
+    /// from one particle of a row to the next, across the stream
+    float2 spacing;
+    
+    int count;
+    int scene;
+} Nozzle;
+
+typedef struct EmitRow {
+    int nozzle;
+    int substep;
+    
+    /// where its first particle goes, counted from count
+    int offset;
+    
+    int firstId;
+    
+    /// time since it was due, it starts that far downstream
+    float age;
+    
+    float life;
+} EmitRow;
+
+/**
+ * one work-item per point of the lattice lower + (x, y) * stride, points inside the convex shape and outside the scene's obstacles
+ * are appended after count in the order they get a slot from appended[0], at most limit of them
+ * shape holds the vertices and then their outward normals
+ */
+kernel void emit(global float2* P, global float2* V, global int* I, global int* S, global float* L, global const float2* shape, const int vertices, const float2 lower, const float stride, const float2 velocity, const float lifetime, const int scene, const int count, const int firstId, const int limit, global const Scene* scenes, global const float* F, global int* appended) {
+    const float2 p = lower + (float2)(get_global_id(0), get_global_id(1)) * stride;
+    
+    for(int k = 0; k < vertices; ++k)
+        if(dot(shape[vertices + k], p - shape[k]) > 0.0f)
+            return;
+    
+    const Scene s = scenes[scene];
+    
+    if(s.field >= 0) {
+        float2 g;
+        if(field_distance(F + s.field, s.fieldSize, s.fieldSpacing, p - s.lower, &g) <= 0.0f)
+            return;
+    }
+    
+    int k = atomic_inc(appended);
+    
+    if(k >= limit) return;
+    
+    P[count + k] = p;
+    V[count + k] = velocity;
+    I[count + k] = firstId + k;
+    S[count + k] = scene;
+    L[count + k] = lifetime;
+}
+
+/**
+ * a work-item per particle of rows [first, first + get_global_size(1)), which are appended after count
+ * with sleepSteps above 0 the cells around them are woken in activity, the particles would never be moved in a sleeping one
+ */
+kernel void nozzle(global float2* P, global float2* V, global int* I, global int* S, global float* L, global const Nozzle* nozzles, global const EmitRow* rows, const int first, const int count, const float D, const int cells, global const Scene* scenes, global int* activity, const int stamp, const int sleepSteps) {
+    const int j = get_global_id(0);
+    const EmitRow r = rows[first + get_global_id(1)];
+    const Nozzle n = nozzles[r.nozzle];
+    
+    if(j >= n.count) return;
+    
+    const float2 p = n.position + (j - 0.5f * (n.count - 1)) * n.spacing + r.age * n.velocity;
+    const int i = count + r.offset + j;
+    
+    P[i] = p;
+    V[i] = n.velocity;
+    I[i] = r.firstId + j;
+    S[i] = n.scene;
+    L[i] = r.life;
+    
+    if(sleepSteps > 0) {
+        const Scene s = scenes[n.scene];
+        wake(activity, home_cell(p, s.lower, s.size, D), s, cells, stamp);
+    }
+}
@@ -1,11 +1,38 @@
 #include "common.cl"
 
-kernel void hasher(global const float2 *A, global Proxy *B, const float D, const int count) {
+kernel void hasher(global const float2 *A, global Proxy *B, const float diameter, const int count, const int cells, global const Scene *scenes, global const int *S) {
     int i = get_global_id(0);
+    const float D = DIAMETER(diameter);
     B[i].index = i;
     if(i >= count) {
         B[i].hash = MAX_PARTICLE_COUNT;
     }else{
-        B[i].hash = map((int)(A[i].x / D), (int)(A[i].y / D));
+        const Scene s = scene_of(scenes, S, i);
+        B[i].hash = scene_map(home_cell(A[i], s.lower, s.size, D), s, cells);
     }
 }
+
+/**
+ * hashes the particles again in the order A was last sorted into, A still holds the hashes of that sort
+ * particles that changed cell are counted in moved[0] and motion[4], and with mark their hash carries RESORT_FLAG
+ */
+kernel void rehash(global Proxy *A, global const float2 *P, const float diameter, const int count, const int cells, global const Scene *scenes, global const int *S, global int *moved, global int *motion, const int mark) {
+    int i = get_global_id(0);
+    const float D = DIAMETER(diameter);
+    
+    if(i >= count) return;
+    
+    Proxy q = A[i];
+    const Scene s = scene_of(scenes, S, q.index);
+    int h = scene_map(home_cell(P[q.index], s.lower, s.size, D), s, cells);
+    
+    if(h != q.hash) {
+        atomic_inc(moved);
+        atomic_inc(&motion[4]);
+        
+        if(mark)
+            h |= RESORT_FLAG;
+    }
+    
+    A[i].hash = h;
+}
@@ -0,0 +1,1142 @@
+//
+//  kernels.h
+//  SPH
+//
+//  generated by embed_kernels.py from common.cl, emit.cl, hasher.cl, reorder.cl, solver.cl, sort.cl, toList.cl, settings.h, do not edit
+//
+
+#ifndef kernels_h
+#define kernels_h
+
+struct EmbeddedSource
+{
+    const char* name;
+    const char* text;
+};
+
+static const EmbeddedSource embedded_sources[] = {
+    {"common.cl", R"sph(#include "settings.h"
+
+#ifndef common_cl
+#define common_cl
+
+typedef struct Proxy {
+    int index;
+    int hash;
+} Proxy;
+
+/**
+ * parameters of one scene, scenes share the buffers but never interact
+ * a particle's scene is found through its entry in the scene id buffer
+ */
+typedef struct Scene {
+    float2 gravity;
+    float2 lower;
+    float2 upper;
+    
+    /// cells of the scene's bounded grid, (0, 0) when hashing modulo the cell count
+    int2 size;
+    
+    /// first cell of the scene's grid in the shared cell table
+    int offset;
+    
+    /// the scene steps dt * timeScale per substep
+    float timeScale;
+    
+    /// samples of the scene's signed distance field, fieldSpacing apart from lower, positive where particles are free
+    int2 fieldSize;
+    
+    /// first sample of the scene's field in the shared field buffer, -1 without obstacles
+    int field;
+    
+    /// first sample of the field of its sinks, -1 without sinks
+    int sink;
+    
+    float fieldSpacing;
+} Scene;
+
+/// the particle diameter, a constant the compiler folds when the program was built with PARTICLE_DIAMETER
+#ifdef PARTICLE_DIAMETER
+#define DIAMETER(d) (PARTICLE_DIAMETER)
+#else
+#define DIAMETER(d) (d)
+#endif
+
+/**
+ * the scene of particle i, built with SINGLE_SCENE every particle is in scene 0 and S is never read
+ * SCENE_SIZE_X and SCENE_SIZE_Y then fix the size of its grid, so the strides between cells are constants
+ */
+inline Scene scene_of(global const Scene* scenes, global const int* S, int i) {
+#if SINGLE_SCENE
+    Scene s = scenes[0];
+#ifdef SCENE_SIZE_X
+    s.size = (int2)(SCENE_SIZE_X, SCENE_SIZE_Y);
+#endif
+    return s;
+#else
+    return scenes[S[i]];
+#endif
+}
+
+inline int imod(int x, int m) {
+    return ((x % m) + m) % m;
+}
+
+/// cell coordinates of p, relative to the lower corner of the grid
+inline int2 cell_of(float2 p, float2 lower, float D) {
+    return convert_int2(floor((p - lower) / D));
+}
+
+/**
+ * size.x > 0 selects the bounded grid, where every cell has its own row-major slot
+ * and cells outside the grid map to -1
+ * otherwise cells are hashed modulo n, and distant cells can alias
+ */
+inline int map(int2 c, int2 size, int n) {
+    if(size.x > 0) {
+        if(c.x < 0 || c.y < 0 || c.x >= size.x || c.y >= size.y)
+            return -1;
+        return c.x + c.y * size.x;
+    }
+    
+    return imod(c.x + (c.y << 10), n);
+}
+
+/// the cell a particle is filed under, particles outside a bounded grid go to its border cells
+inline int2 home_cell(float2 p, float2 lower, int2 size, float D) {
+    int2 c = cell_of(p, lower, D);
+    
+    if(size.x > 0)
+        c = clamp(c, (int2)(0, 0), size - (int2)(1, 1));
+    
+    return c;
+}
+
+/// the cell table slot of c in scene s, or -1 outside its grid
+inline int scene_map(int2 c, Scene s, int n) {
+    int h = map(c, s.size, n);
+    return h < 0 ? h : h + s.offset;
+}
+
+/**
+ * activity holds the last substep something moved in or next to each slot
+ * a slot sleeps once steps substeps went by without, slots outside the grid always do and steps 0 never sleeps
+ */
+inline bool asleep(global const int* activity, int slot, int stamp, int steps) {
+    return steps > 0 && (slot < 0 || stamp - activity[slot] > steps);
+}
+
+/// c and every cell next to it sleep, so no particle that is awake needs the density of one in c
+inline bool deeply_asleep(global const int* activity, int2 c, Scene s, int n, int stamp, int steps) {
+    for(int x = -1; x <= 1; ++x)
+        for(int y = -1; y <= 1; ++y)
+            if(!asleep(activity, scene_map(c + (int2)(x, y), s, n), stamp, steps))
+                return false;
+    
+    return true;
+}
+
+/// keeps c and the cells next to it awake, marks is folded into activity once the substep is done
+inline void wake(global int* marks, int2 c, Scene s, int n, int stamp) {
+    for(int x = -1; x <= 1; ++x) {
+        for(int y = -1; y <= 1; ++y) {
+            int h = scene_map(c + (int2)(x, y), s, n);
+            if(h >= 0)
+                marks[h] = stamp;
+        }
+    }
+}
+
+/// the particle died and waits to be removed, with L NULL none has
+inline bool dead(global const float* L, int i) {
+    return L != 0 && L[i] <= 0.0f;
+}
+
+/// bilinear sample of a scene's signed distance field at p, relative to its lower corner, and the direction it grows in
+inline float field_distance(global const float* F, int2 size, float spacing, float2 p, float2* gradient) {
+    float2 g = clamp(p / spacing, (float2)(0.0f, 0.0f), convert_float2(size - (int2)(1, 1)));
+    int2 c = min(convert_int2(g), size - (int2)(2, 2));
+    float2 t = g - convert_float2(c);
+    
+    global const float* f = F + c.x + c.y * size.x;
+    
+    float d00 = f[0];
+    float d10 = f[1];
+    float d01 = f[size.x];
+    float d11 = f[size.x + 1];
+    
+    *gradient = (float2)(mix(d10 - d00, d11 - d01, t.y), mix(d01 - d00, d11 - d10, t.x));
+    
+    return mix(mix(d00, d10, t.x), mix(d01, d11, t.x), t.y);
+}
+
+#endif // common_cl
+)sph"},
+    {"emit.cl", R"sph(#include "common.cl"
+
+typedef struct Nozzle {
+    float2 position;
+    float2 velocity;
+    
+    /// from one particle of a row to the next, across the stream
+    float2 spacing;
+    
+    int count;
+    int scene;
+} Nozzle;
+
+typedef struct EmitRow {
+    int nozzle;
+    int substep;
+    
+    /// where its first particle goes, counted from count
+    int offset;
+    
+    int firstId;
+    
+    /// time since it was due, it starts that far downstream
+    float age;
+    
+    float life;
+} EmitRow;
+
+/**
+ * one work-item per point of the lattice lower + (x, y) * stride, points inside the convex shape and outside the scene's obstacles
+ * are appended after count in the order they get a slot from appended[0], at most limit of them
+ * shape holds the vertices and then their outward normals
+ */
+kernel void emit(global float2* P, global float2* V, global int* I, global int* S, global float* L, global const float2* shape, const int vertices, const float2 lower, const float stride, const float2 velocity, const float lifetime, const int scene, const int count, const int firstId, const int limit, global const Scene* scenes, global const float* F, global int* appended) {
+    const float2 p = lower + (float2)(get_global_id(0), get_global_id(1)) * stride;
+    
+    for(int k = 0; k < vertices; ++k)
+        if(dot(shape[vertices + k], p - shape[k]) > 0.0f)
+            return;
+    
+    const Scene s = scenes[scene];
+    
+    if(s.field >= 0) {
+        float2 g;
+        if(field_distance(F + s.field, s.fieldSize, s.fieldSpacing, p - s.lower, &g) <= 0.0f)
+            return;
+    }
+    
+    int k = atomic_inc(appended);
+    
+    if(k >= limit) return;
+    
+    P[count + k] = p;
+    V[count + k] = velocity;
+    I[count + k] = firstId + k;
+    S[count + k] = scene;
+    L[count + k] = lifetime;
+}
+
+/**
+ * a work-item per particle of rows [first, first + get_global_size(1)), which are appended after count
+ * with sleepSteps above 0 the cells around them are woken in activity, the particles would never be moved in a sleeping one
+ */
+kernel void nozzle(global float2* P, global float2* V, global int* I, global int* S, global float* L, global const Nozzle* nozzles, global const EmitRow* rows, const int first, const int count, const float D, const int cells, global const Scene* scenes, global int* activity, const int stamp, const int sleepSteps) {
+    const int j = get_global_id(0);
+    const EmitRow r = rows[first + get_global_id(1)];
+    const Nozzle n = nozzles[r.nozzle];
+    
+    if(j >= n.count) return;
+    
+    const float2 p = n.position + (j - 0.5f * (n.count - 1)) * n.spacing + r.age * n.velocity;
+    const int i = count + r.offset + j;
+    
+    P[i] = p;
+    V[i] = n.velocity;
+    I[i] = r.firstId + j;
+    S[i] = n.scene;
+    L[i] = r.life;
+    
+    if(sleepSteps > 0) {
+        const Scene s = scenes[n.scene];
+        wake(activity, home_cell(p, s.lower, s.size, D), s, cells, stamp);
+    }
+}
+)sph"},
+    {"hasher.cl", R"sph(#include "common.cl"
+
+kernel void hasher(global const float2 *A, global Proxy *B, const float diameter, const int count, const int cells, global const Scene *scenes, global const int *S) {
+    int i = get_global_id(0);
+    const float D = DIAMETER(diameter);
+    B[i].index = i;
+    if(i >= count) {
+        B[i].hash = MAX_PARTICLE_COUNT;
+    }else{
+        const Scene s = scene_of(scenes, S, i);
+        B[i].hash = scene_map(home_cell(A[i], s.lower, s.size, D), s, cells);
+    }
+}
+
+/**
+ * hashes the particles again in the order A was last sorted into, A still holds the hashes of that sort
+ * particles that changed cell are counted in moved[0] and motion[4], and with mark their hash carries RESORT_FLAG
+ */
+kernel void rehash(global Proxy *A, global const float2 *P, const float diameter, const int count, const int cells, global const Scene *scenes, global const int *S, global int *moved, global int *motion, const int mark) {
+    int i = get_global_id(0);
+    const float D = DIAMETER(diameter);
+    
+    if(i >= count) return;
+    
+    Proxy q = A[i];
+    const Scene s = scene_of(scenes, S, q.index);
+    int h = scene_map(home_cell(P[q.index], s.lower, s.size, D), s, cells);
+    
+    if(h != q.hash) {
+        atomic_inc(moved);
+        atomic_inc(&motion[4]);
+        
+        if(mark)
+            h |= RESORT_FLAG;
+    }
+    
+    A[i].hash = h;
+}
+)sph"},
+    {"reorder.cl", R"sph(#include "common.cl"
+
+/**
+ * gathers particle data into the sorted order of the proxies,
+ * so particles of one cell sit next to each other in memory
+ * the proxies then index the new order directly
+ */
+kernel void reorder(global Proxy *proxies, global const float2 *P, global const float2 *V, global const int *I, global const int *S, global const float *L, global float2 *P2, global float2 *V2, global int *I2, global int *S2, global float *L2) {
+    int i = get_global_id(0);
+    int j = proxies[i].index;
+    
+    P2[i] = P[j];
+    V2[i] = V[j];
+    I2[i] = I[j];
+    S2[i] = S[j];
+    L2[i] = L[j];
+    
+    proxies[i].index = i;
+}
+)sph"},
+    {"solver.cl", R"sph(#include "common.cl"
+
+/// what a weight sum turns into, capped so the pressure cannot push a particle further than D in one substep
+inline float pressure_weight(float weight, float D, float sdt) {
+    const float mp = 0.25f * D * D / (sdt * sdt);
+    return min(mp, 0.05f * max(weight - 1.0f, 0.0f));
+}
+
+/// pressure and viscosity from a neighbour at diff, closer than D, vd is its velocity relative to the particle
+inline float2 pair_force(float2 diff, float ds, float2 vd, float h, float D, float sdt) {
+    float dr = sqrt(ds);
+    float w = 1.0f - dr/D;
+    float2 n = diff / dr;
+    float2 accel = -(64.0f * w * h / D) * n;
+    
+    float vn = dot(vd, n);
+    
+    if(vn < 0.0f)
+        accel += (0.25f * max(w, min(-(sdt / D) * vn, 0.5f)) * vn / sdt) * n;
+    
+    return accel;
+}
+
+/**
+ * the density pass has to finish for every particle before any force is computed,
+ * so the two passes are separate kernels enqueued back to back
+ * with L a dead particle waiting to be removed is no one's neighbour, in these and the list kernels
+ */
+
+kernel void density(global const float2 *P, global const Proxy* proxies, global const int2* list, const int count, const float diameter, const float dt, global float* weights, const int cells, global const Scene* scenes, global const int* S, global int* aliases, global const int* activity, const int stamp, const int sleepSteps, global int* motion, global const float* L) {
+    int i = get_global_id(0);
+    
+    const float D = DIAMETER(diameter);
+    
+    if(i >= count) return;
+    
+    const Scene s = scene_of(scenes, S, i);
+    
+    const float sdt = dt * s.timeScale;
+    
+    const float2 p = P[i];
+    
+    const int2 c = home_cell(p, s.lower, s.size, D);
+    
+    if(deeply_asleep(activity, c, s, cells, stamp, sleepSteps)) return;
+    
+    const float D2 = D * D;
+    
+    int j, hh;
+    int2 range, nc;
+    float2 jp, diff;
+    float ds;
+    
+    float weight = 0.0f;
+    
+#if COUNT_ALIASES
+    int aliased = 0;
+#endif
+
+#if COUNT_NEIGHBOURS
+    /// the particle itself is among them
+    int visited = -1;
+#endif
+    
+    for(int x = -1; x <= 1; ++x) {
+        for(int y = -1; y <= 1; ++y) {
+            nc = c + (int2)(x, y);
+            hh = scene_map(nc, s, cells);
+            
+            if(hh < 0) continue;
+            
+            range = list[hh];
+            
+#if COUNT_NEIGHBOURS
+            visited += range.y - range.x;
+#endif
+            
+            for(j = range.x; j < range.y; ++j) {
+                Proxy cell = proxies[j];
+                
+                if(cell.index == i || dead(L, cell.index)) {
+                    continue;
+                }
+                
+                jp = P[cell.index];
+                
+#if COUNT_ALIASES
+                int2 jc = home_cell(jp, s.lower, s.size, D);
+                if(jc.x != nc.x || jc.y != nc.y) ++aliased;
+#endif
+                
+                diff = jp - p;
+                ds = diff.x * diff.x + diff.y * diff.y;
+                if(ds < D2)
+                    weight += 1.0f - sqrt(ds)/D;
+            }
+        }
+    }
+    
+    weights[i] = pressure_weight(weight, D, sdt);
+    
+#if COUNT_ALIASES
+    if(aliased != 0)
+        atomic_add(aliases, aliased);
+#endif
+
+#if COUNT_NEIGHBOURS
+    atomic_add(&motion[3], visited);
+#endif
+}
+
+kernel void force(global const float2 *A, const float dt, global const float2 *P, global const Proxy* proxies, global const int2* list, const int count, const float diameter, global float2* R, global const float* weights, const int cells, global const Scene* scenes, global const int* S, global int* aliases, global const int* activity, const int stamp, const int sleepSteps, global const float* L) {
+    int i = get_global_id(0);
+    
+    const float D = DIAMETER(diameter);
+    
+    if(i >= count) return;
+    
+    const float2 p = P[i];
+    const float2 v = A[i];
+    
+    const Scene s = scene_of(scenes, S, i);
+    
+    const float sdt = dt * s.timeScale;
+    
+    const int2 c = home_cell(p, s.lower, s.size, D);
+    
+    if(asleep(activity, scene_map(c, s, cells), stamp, sleepSteps)) return;
+    
+    const float D2 = D * D;
+    
+    const float weight = weights[i];
+    
+    int j, hh;
+    int2 range, nc;
+    float2 jp, diff;
+    float ds;
+    
+#if COUNT_ALIASES
+    int aliased = 0;
+#endif
+    
+    float2 accel = (float2)(0.0f, 0.0f);
+    
+    for(int x = -1; x <= 1; ++x) {
+        for(int y = -1; y <= 1; ++y) {
+            nc = c + (int2)(x, y);
+            hh = scene_map(nc, s, cells);
+            
+            if(hh < 0) continue;
+            
+            range = list[hh];
+            
+            for(j = range.x; j < range.y; ++j) {
+                Proxy cell = proxies[j];
+                
+                if(cell.index == i || dead(L, cell.index)) {
+                    continue;
+                }
+                
+                jp = P[cell.index];
+                
+#if COUNT_ALIASES
+                int2 jc = home_cell(jp, s.lower, s.size, D);
+                if(jc.x != nc.x || jc.y != nc.y) ++aliased;
+#endif
+                
+                diff = jp - p;
+                ds = diff.x * diff.x + diff.y * diff.y;
+                if(ds < D2)
+                    accel += pair_force(diff, ds, A[cell.index] - v, weights[cell.index] + weight, D, sdt);
+            }
+        }
+    }
+    
+    R[i] = sdt * (accel + s.gravity);
+    
+#if COUNT_ALIASES
+    if(aliased != 0)
+        atomic_add(aliases, aliased);
+#endif
+}
+
+/**
+ * lists every particle closer than R to particle i, R is at most 2D so the 5x5 cells around it hold them all
+ * a list holds at most capacity of them, the longest list is recorded in state[1] when one does not fit
+ */
+kernel void neighbours(global const float2 *P, global const Proxy* proxies, global const int2* list, const int count, const float diameter, const float R, const int cells, global const Scene* scenes, global const int* S, global int* N, global int* counts, const int capacity, global int* state, global const float* L) {
+    int i = get_global_id(0);
+    
+    const float D = DIAMETER(diameter);
+    
+    if(i >= count) return;
+    
+    const Scene s = scene_of(scenes, S, i);
+    
+    const float2 p = P[i];
+    
+    const int2 c = home_cell(p, s.lower, s.size, D);
+    
+    const float R2 = R * R;
+    
+    global int* out = N + i * capacity;
+    
+    int n = 0;
+    
+    for(int x = -2; x <= 2; ++x) {
+        for(int y = -2; y <= 2; ++y) {
+            int hh = scene_map(c + (int2)(x, y), s, cells);
+            
+            if(hh < 0) continue;
+            
+            int2 range = list[hh];
+            
+            for(int j = range.x; j < range.y; ++j) {
+                int index = proxies[j].index;
+                
+                if(index == i || dead(L, index)) continue;
+                
+                float2 diff = P[index] - p;
+                
+                if(dot(diff, diff) < R2) {
+                    if(n < capacity)
+                        out[n] = index;
+                    ++n;
+                }
+            }
+        }
+    }
+    
+    counts[i] = min(n, capacity);
+    
+    if(n > capacity)
+        atomic_max(state + 1, n);
+}
+
+/// density over the neighbour lists instead of the cells
+kernel void listDensity(global const float2 *P, global const int* N, global const int* counts, const int capacity, const int count, const float diameter, const float dt, global float* weights, global const Scene* scenes, global const int* S, global int* motion, global const float* L) {
+    int i = get_global_id(0);
+    
+    const float D = DIAMETER(diameter);
+    
+    if(i >= count) return;
+    
+    const float sdt = dt * scene_of(scenes, S, i).timeScale;
+    
+    const float2 p = P[i];
+    
+    const float D2 = D * D;
+    
+    global const int* list = N + i * capacity;
+    const int n = counts[i];
+    
+    float weight = 0.0f;
+    
+    for(int k = 0; k < n; ++k) {
+        if(dead(L, list[k])) continue;
+        
+        float2 diff = P[list[k]] - p;
+        float ds = dot(diff, diff);
+        if(ds < D2)
+            weight += 1.0f - sqrt(ds)/D;
+    }
+    
+    weights[i] = pressure_weight(weight, D, sdt);
+    
+#if COUNT_NEIGHBOURS
+    atomic_add(&motion[3], n);
+#endif
+}
+
+/// force over the neighbour lists instead of the cells
+kernel void listForce(global const float2 *A, const float dt, global const float2 *P, global const int* N, global const int* counts, const int capacity, const int count, const float diameter, global float2* R, global const float* weights, global const Scene* scenes, global const int* S, global const float* L) {
+    int i = get_global_id(0);
+    
+    const float D = DIAMETER(diameter);
+    
+    if(i >= count) return;
+    
+    const Scene s = scene_of(scenes, S, i);
+    
+    const float sdt = dt * s.timeScale;
+    
+    const float2 p = P[i];
+    const float2 v = A[i];
+    
+    const float D2 = D * D;
+    
+    const float weight = weights[i];
+    
+    global const int* list = N + i * capacity;
+    const int n = counts[i];
+    
+    float2 accel = (float2)(0.0f, 0.0f);
+    
+    for(int k = 0; k < n; ++k) {
+        int j = list[k];
+        
+        if(dead(L, j)) continue;
+        
+        float2 diff = P[j] - p;
+        float ds = dot(diff, diff);
+        if(ds < D2)
+            accel += pair_force(diff, ds, A[j] - v, weights[j] + weight, D, sdt);
+    }
+    
+    R[i] = sdt * (accel + s.gravity);
+}
+
+/// a particle that died in the given step stops, with -step as its life, until the host has counted it in motion[5] and a step removes it
+inline void die(global float* L, int i, int step, global int* motion) {
+    L[i] = -(float)step;
+    atomic_inc(motion + 5);
+}
+
+/**
+ * when the neighbour lists are in use, N holds where each particle was when they were built,
+ * and state[0] the largest squared distance any particle has moved from there, as the bits of a float
+ * non-negative floats order like their bits, so atomic_max on them works
+ * with L the lifetimes left run down, sleeping or not, and particles in a sink die
+ */
+kernel void adder(global float2 *A, global float2 *B, global const float2* C, const float dt, const float diameter, const int count, global const Scene* scenes, global const int* S, global const float2* N, global int* state, global int* motion, global const float* F, const int cells, global const int* activity, global int* marks, const int stamp, const int sleepSteps, const float sleepSpeed, const float sleepAcceleration, global float* L, const int step) {
+    int i = get_global_id(0);
+    
+    const float D = DIAMETER(diameter);
+    
+    if(i >= count) return;
+    
+    const Scene s = scene_of(scenes, S, i);
+    
+    const float sdt = dt * s.timeScale;
+    const float2 lowerBound = s.lower;
+    const float2 upperBound = s.upper;
+    
+    /// the cell the particle was filed under this substep
+    const int2 c = home_cell(B[i], lowerBound, s.size, D);
+    
+    if(L != 0) {
+        if(L[i] <= 0.0f) return;
+        
+        L[i] -= sdt;
+        
+        if(L[i] <= 0.0f) {
+            die(L, i, step, motion);
+            return;
+        }
+    }
+    
+    if(asleep(activity, scene_map(c, s, cells), stamp, sleepSteps)) return;
+    
+    const float2 dv = C[i];
+    
+    A[i] += dv;
+    
+    const float D2 = D * D;
+    
+    const float cv2 = D2 / (sdt * sdt);
+    
+    float v2 = dot(A[i], A[i]);
+    
+    /// before the clamp, so the next step can take enough substeps that it does not have to
+    const float ts2 = s.timeScale * s.timeScale;
+    const float speed2 = v2 * ts2;
+    const float accel2 = dot(dv, dv) * ts2 / (dt * dt);
+    
+    if(speed2 > as_float(motion[0]))
+        atomic_max(motion, as_int(speed2));
+    
+    if(accel2 > as_float(motion[1]))
+        atomic_max(motion + 1, as_int(accel2));
+    
+    if(sleepSteps > 0 && (speed2 > sleepSpeed * sleepSpeed || accel2 > sleepAcceleration * sleepAcceleration))
+        wake(marks, c, s, cells, stamp);
+    
+    if(v2 > cv2) {
+        A[i] *= sqrt(cv2 / v2);
+    }
+    
+    B[i] += A[i] * sdt;
+    
+    /// out of the obstacles, and the velocity into them removed
+    if(s.field >= 0) {
+        float2 n;
+        float d = field_distance(F + s.field, s.fieldSize, s.fieldSpacing, B[i] - lowerBound, &n);
+        float n2 = dot(n, n);
+        
+        if(d < 0.0f && n2 > 0.0f) {
+            n *= rsqrt(n2);
+            B[i] -= d * n;
+            
+            float vn = dot(A[i], n);
+            if(vn < 0.0f)
+                A[i] -= vn * n;
+        }
+    }
+    
+#if BOUNDS
+    if(B[i].x < lowerBound.x) {
+        A[i].x = 0.0f;
+        B[i].x = lowerBound.x;
+    }
+    
+    if(B[i].y < lowerBound.y) {
+        A[i].y = 0.0f;
+        B[i].y = lowerBound.y;
+    }
+    
+    if(B[i].x > upperBound.x) {
+        A[i].x = 0.0f;
+        B[i].x = upperBound.x;
+    }
+    
+    if(B[i].y > upperBound.y) {
+        A[i].y = 0.0f;
+        B[i].y = upperBound.y;
+    }
+#endif
+    
+    if(N != 0) {
+        float2 d = B[i] - N[i];
+        float d2 = dot(d, d);
+        
+        if(d2 > as_float(state[0]))
+            atomic_max(state, as_int(d2));
+    }
+    
+    if(L != 0 && s.sink >= 0) {
+        float2 n;
+        if(field_distance(F + s.sink, s.fieldSize, s.fieldSpacing, B[i] - lowerBound, &n) < 0.0f)
+            die(L, i, step, motion);
+    }
+}
+
+/**
+ * runs over the cell table after the adder, adds the particles of the slots that slept through the substep to motion[2]
+ * and folds the marks the adder left into activity, which the next substep reads
+ */
+kernel void settle(global int* activity, global const int* marks, global const int2* list, const int cells, const int stamp, const int sleepSteps, global int* motion) {
+    int c = get_global_id(0);
+    
+    local int sleeping;
+    
+    if(get_local_id(0) == 0)
+        sleeping = 0;
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    if(c < cells) {
+        if(asleep(activity, c, stamp, sleepSteps)) {
+            int2 range = list[c];
+            if(range.y > range.x)
+                atomic_add(&sleeping, range.y - range.x);
+        }
+        
+        activity[c] = max(activity[c], marks[c]);
+    }
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    if(get_local_id(0) == 0 && sleeping != 0)
+        atomic_add(motion + 2, sleeping);
+}
+)sph"},
+    {"sort.cl", R"sph(#include "common.cl"
+
+/**
+ * each work-group owns a contiguous chunk of the proxies
+ * histograms are stored digit-major, so one exclusive scan over them
+ * gives every group its stable starting offset for every digit
+ * with tail only the last tail[0] of the N proxies are sorted, a count the host never reads
+ */
+
+inline int chunk_size(int N, int groups) {
+    return (N + groups - 1) / groups;
+}
+
+inline int tail_start(global const int *tail, int N) {
+    return tail != 0 ? N - tail[0] : 0;
+}
+
+kernel void histogram(global const Proxy *A, global uint *H, const int p, const int N, global const int *tail) {
+    local uint count[RADIX_SIZE];
+    
+    int lid = get_local_id(0);
+    int ls = get_local_size(0);
+    int g = get_group_id(0);
+    int groups = get_num_groups(0);
+    
+    for(int i = lid; i < RADIX_SIZE; i += ls) {
+        count[i] = 0;
+    }
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    int first = tail_start(tail, N);
+    int chunk = chunk_size(N - first, groups);
+    int begin = first + g * chunk;
+    int end = min(begin + chunk, N);
+    
+    for(int i = begin + lid; i < end; i += ls) {
+        atomic_inc(&count[(A[i].hash >> p) & RADIX_MASK]);
+    }
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    for(int i = lid; i < RADIX_SIZE; i += ls) {
+        H[i * groups + g] = count[i];
+    }
+}
+
+/// exclusive scan of H, run as a single work-group
+kernel void scan(global uint *H, const int n) {
+    local uint sums[RADIX_GROUP_SIZE];
+    
+    int lid = get_local_id(0);
+    int ls = get_local_size(0);
+    
+    int segment = (n + ls - 1) / ls;
+    int begin = min(lid * segment, n);
+    int end = min(begin + segment, n);
+    
+    uint sum = 0;
+    for(int i = begin; i < end; ++i) {
+        uint c = H[i];
+        H[i] = sum;
+        sum += c;
+    }
+    
+    sums[lid] = sum;
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    if(lid == 0) {
+        sum = 0;
+        for(int i = 0; i < ls; ++i) {
+            uint c = sums[i];
+            sums[i] = sum;
+            sum += c;
+        }
+    }
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    sum = sums[lid];
+    for(int i = begin; i < end; ++i) {
+        H[i] += sum;
+    }
+}
+
+/**
+ * the chunk is walked in tiles of one proxy per work-item
+ * a proxy's rank inside the tile is the number of earlier work-items with the same digit,
+ * which keeps the scatter stable
+ */
+kernel void scatter(global const Proxy *A, global Proxy *B, global const uint *H, const int p, const int N, global const int *tail) {
+    local uint offsets[RADIX_SIZE];
+    local int digits[RADIX_GROUP_SIZE];
+    
+    int lid = get_local_id(0);
+    int ls = get_local_size(0);
+    int g = get_group_id(0);
+    int groups = get_num_groups(0);
+    
+    int first = tail_start(tail, N);
+    
+    for(int i = lid; i < RADIX_SIZE; i += ls) {
+        offsets[i] = first + H[i * groups + g];
+    }
+    
+    int chunk = chunk_size(N - first, groups);
+    int begin = first + g * chunk;
+    int end = min(begin + chunk, N);
+    
+    for(int k = begin; k < end; k += ls) {
+        int i = k + lid;
+        
+        Proxy q;
+        int d = RADIX_SIZE;
+        
+        if(i < end) {
+            q = A[i];
+            d = (q.hash >> p) & RADIX_MASK;
+        }
+        
+        digits[lid] = d;
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        int before = 0;
+        int after = 0;
+        
+        for(int j = 0; j < ls; ++j) {
+            if(digits[j] == d) {
+                if(j < lid) ++before;
+                if(j > lid) ++after;
+            }
+        }
+        
+        if(d != RADIX_SIZE) {
+            B[offsets[d] + before] = q;
+        }
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        /// the last work-item of each digit advances it for the next tile
+        if(d != RADIX_SIZE && after == 0) {
+            offsets[d] += before + 1;
+        }
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+/**
+ * merges the proxies that did not change cell, A[0, N - moved[0]), with the sorted ones that did after them, into B
+ * every work-item finds how many of the first run come before its slot along the merge path,
+ * ties go to the first run, so a cell keeps the particles it had ahead of those that came in
+ */
+kernel void merge(global const Proxy *A, global Proxy *B, const int N, global const int *moved) {
+    int k = get_global_id(0);
+    
+    if(k >= N) return;
+    
+    int m = moved[0];
+    int s = N - m;
+    
+    int lo = max(0, k - m);
+    int hi = min(k, s);
+    
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        
+        if(A[mid].hash <= (A[s + k - 1 - mid].hash & ~RESORT_FLAG))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    int i = lo;
+    int j = s + k - lo;
+    
+    Proxy q = j >= N || (i < s && A[i].hash <= (A[j].hash & ~RESORT_FLAG)) ? A[i] : A[j];
+    q.hash &= ~RESORT_FLAG;
+    
+    B[k] = q;
+}
+
+/// a particle stays unless it died in a step up to last, one that died since has not been counted by the host yet
+inline bool survives(float life, int last) {
+    return life > 0.0f || life < -(float)last;
+}
+
+/// the particles of each group's chunk that survive into H[g], scan turns them into where the group writes
+kernel void tally(global const float *L, global uint *H, const int N, const int last) {
+    local uint count;
+    
+    int lid = get_local_id(0);
+    int ls = get_local_size(0);
+    int g = get_group_id(0);
+    
+    if(lid == 0)
+        count = 0;
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    int chunk = chunk_size(N, get_num_groups(0));
+    int begin = g * chunk;
+    int end = min(begin + chunk, N);
+    
+    uint n = 0;
+    for(int i = begin + lid; i < end; i += ls) {
+        if(survives(L[i], last))
+            ++n;
+    }
+    
+    if(n != 0)
+        atomic_add(&count, n);
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    if(lid == 0)
+        H[g] = count;
+}
+
+/**
+ * moves the survivors to the front of the second set of buffers, in the order they were in, and their number into motion[6]
+ * walked in tiles like scatter, a particle's place in the tile is the survivors of the work-items before it
+ */
+kernel void compact(global const float2 *P, global const float2 *V, global const int *I, global const int *S, global const float *L, global float2 *P2, global float2 *V2, global int *I2, global int *S2, global float *L2, global const uint *H, const int N, const int last, global int *motion) {
+    local int keeps[RADIX_GROUP_SIZE];
+    local uint offset;
+    
+    int lid = get_local_id(0);
+    int ls = get_local_size(0);
+    int g = get_group_id(0);
+    
+    if(lid == 0)
+        offset = H[g];
+    
+    int chunk = chunk_size(N, get_num_groups(0));
+    int begin = g * chunk;
+    int end = min(begin + chunk, N);
+    
+    for(int k = begin; k < end; k += ls) {
+        int i = k + lid;
+        int keep = i < end && survives(L[i], last);
+        
+        keeps[lid] = keep;
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        uint o = offset;
+        int before = 0;
+        int all = 0;
+        
+        for(int j = 0; j < ls; ++j) {
+            before += j < lid ? keeps[j] : 0;
+            all += keeps[j];
+        }
+        
+        if(keep) {
+            P2[o + before] = P[i];
+            V2[o + before] = V[i];
+            I2[o + before] = I[i];
+            S2[o + before] = S[i];
+            L2[o + before] = L[i];
+        }
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        if(lid == 0)
+            offset += all;
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    
+    /// the last group ends where every survivor has been written, what the host checks its count against
+    if(lid == 0 && g == get_num_groups(0) - 1)
+        motion[6] = offset;
+}
+)sph"},
+    {"toList.cl", R"sph(#include "common.cl"
+
+/**
+ * B holds a [start, end) pair per cell, read as int2 by the solver
+ * start and end of one cell may be written by different work-items,
+ * so they are stored as separate ints
+ */
+kernel void toList(global const Proxy *A, global int *B, const int N) {
+    int i = get_global_id(0);
+    Proxy p = A[i];
+    
+    if(i == 0 || A[i - 1].hash != p.hash)
+        B[2 * p.hash] = i;
+    
+    if(i == N - 1 || A[i + 1].hash != p.hash)
+        B[2 * p.hash + 1] = i + 1;
+}
+)sph"},
+    {"settings.h", R"sph(//
+//  settings.h
+//  SPH
+//
+//  Created by Arthur Sun on 6/8/19.
+//  Copyright © 2019 Arthur Sun. All rights reserved.
+//
+
+#ifndef settings_h
+#define settings_h
+
+/// 2 ^ 24
+#define MAX_PARTICLE_COUNT 16777216
+
+/// smallest hash table, large enough that the 5x5 cells around a particle never share a hash
+#define MIN_CELL_COUNT 65536
+
+/// when 1 the solver counts neighbour candidates that came from a different cell with the same hash
+#define COUNT_ALIASES 0
+
+/// when 1 the density pass counts the neighbour candidates it visits, what Stats::neighbours averages
+#define COUNT_NEIGHBOURS 0
+
+/// when 1 adder clamps particles to the bounds of their scene
+#define BOUNDS 1
+
+/// neighbours each particle's list has room for at first, grows once a particle has more
+#define NEIGHBOUR_CAPACITY 32
+
+/// bits of the hash sorted per radix pass
+#define RADIX_BITS 8
+
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+#define RADIX_MASK (RADIX_SIZE - 1)
+
+/// marks a particle that changed cell since the last sort, above any hash the cell table can hold
+#define RESORT_SHIFT 30
+
+#define RESORT_FLAG (1 << RESORT_SHIFT)
+
+/// work-items per group in the sort kernels, also the size of their local tiles
+#define RADIX_GROUP_SIZE 128
+
+/// upper bound on work-groups per pass, sizes the histogram buffer
+#define RADIX_MAX_GROUPS 256
+
+/// local sizes the particle kernels aim for, rounded to what the device prefers
+#define DENSITY_GROUP_SIZE 64
+
+#define FORCE_GROUP_SIZE 64
+
+#define ADDER_GROUP_SIZE 64
+
+#define SETTLE_GROUP_SIZE 64
+
+/// kernel variants built with constants an OpenCL backend keeps, besides the one that takes everything as arguments
+#define KERNEL_VARIANTS 4
+
+#endif /* settings_h */
+)sph"},
+    {NULL, NULL}
+};
+
+#endif /* kernels_h */
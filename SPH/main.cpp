@@ -28,6 +28,8 @@ vec2 gravity(0.0f, -9.8f);
 
 float timeBtwFrames = 0.016f;
 
+const char* snapshotFile = "sph.snapshot";
+
 #ifdef DEBUG
 
 int framesPerSecond = 0;
@@ -42,6 +44,8 @@ float lastSecondTime = glfwGetTime();
 ParticleSystem ps(gravity);
 PSGraphic renderer(&ps);
 
+TrajectoryWriter* trajectory = NULL;
+
 void mouseCallback(GLFWwindow* window, int button, int action, int mods) {
 }
 
@@ -88,8 +92,20 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
             ps.clear();
         }
         
+        /// a settled scene can be written once and loaded again instead of being simulated to rest
+        if(key == GLFW_KEY_W) {
+            ps.save(snapshotFile);
+        }
+        
+        if(key == GLFW_KEY_L) {
+            ps.load(snapshotFile);
+        }
+        
         if(key == GLFW_KEY_N) {
             printf("%d\n", ps.getCount());
+#if COUNT_ALIASES
+            printf("%d aliased candidates\n", ps.getAliasedCandidates());
+#endif
         }
     }
 }
@@ -149,8 +165,33 @@ int main(int argc, const char * argv[]) {
     mouseY = height * 0.5f;
     
     renderer.initialize();
+    
+    for(int i = 1; i < argc; ++i)
+        if(strcmp(argv[i], "-native") == 0)
+            ps.backendType = backend_native;
+    
+    /// -trajectory file streams every frame to file, dropping frames rather than holding the simulation up
+    /// -stats n writes the stats every n frames as CSV, to stdout or to the file after -stats-csv
+    for(int i = 1; i + 1 < argc; ++i) {
+        if(strcmp(argv[i], "-trajectory") == 0)
+            trajectory = new TrajectoryWriter(argv[i + 1], trajectory_quantised, ps.domain, 16, true);
+        
+        if(strcmp(argv[i], "-stats") == 0)
+            ps.statsInterval = atoi(argv[i + 1]);
+        
+        if(strcmp(argv[i], "-stats-csv") == 0)
+            ps.statsFile = fopen(argv[i + 1], "w");
+    }
+    
+    ps.trajectory = trajectory;
+    
+    /// fast jets get the substeps they need instead of being slowed down to D per substep
+    ps.courant = 0.5f;
+    
     ps.initialize(D);
     
+    printf("simulating on %s\n", ps.getDeviceName().c_str());
+    
     frame.x = 0;
     frame.y = 0;
     frame.w = width * 2;
@@ -171,6 +212,11 @@ int main(int argc, const char * argv[]) {
         ++framesPerSecond;
         if(currentTime - lastSecondTime >= 1.0f) {
             printf("%f ms/frame \n", 1000.0f * (currentTime - lastSecondTime)/(float)framesPerSecond);
+            printf("%f ms/frame waiting on the device \n", ps.takeWaitTime()/(double)framesPerSecond);
+            printf("%d substeps in the last frame \n", ps.getSubsteps());
+            printf("%f of the particles awake \n", ps.latest().activeFraction);
+            if(trajectory != NULL)
+                printf("%d frames queued, %ld dropped \n", trajectory->getQueued(), trajectory->getDropped());
             framesPerSecond = 0;
             lastSecondTime = currentTime;
         }
@@ -187,7 +233,7 @@ int main(int argc, const char * argv[]) {
         frame.offset.x += dMouseX * 4.0f / frame.scl;
         frame.offset.y += dMouseY * 4.0f / frame.scl;
         
-        ps.step(dt, 6);
+        ps.step(dt, 2);
         
         renderer.draw(0, frame);
         
@@ -204,6 +250,10 @@ int main(int argc, const char * argv[]) {
         usleep(useconds_t(ssecs * 1000000.0f));
     } while (glfwWindowShouldClose(window) == GL_FALSE && glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_PRESS);
     renderer.destory();
+    delete trajectory;
+    
+    if(ps.statsFile != NULL)
+        fclose(ps.statsFile);
     glfwDestroyCursor(cursor);
     glfwTerminate();
     return EXIT_SUCCESS;
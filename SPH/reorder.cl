@@ -0,0 +1,19 @@
+#include "common.cl"
+
+/**
+ * gathers particle data into the sorted order of the proxies,
+ * so particles of one cell sit next to each other in memory
+ * the proxies then index the new order directly
+ */
+kernel void reorder(global Proxy *proxies, global const float2 *P, global const float2 *V, global const int *I, global const int *S, global const float *L, global float2 *P2, global float2 *V2, global int *I2, global int *S2, global float *L2) {
+    int i = get_global_id(0);
+    int j = proxies[i].index;
+    
+    P2[i] = P[j];
+    V2[i] = V[j];
+    I2[i] = I[j];
+    S2[i] = S[j];
+    L2[i] = L[j];
+    
+    proxies[i].index = i;
+}
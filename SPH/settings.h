@@ -12,4 +12,49 @@
 /// 2 ^ 24
 #define MAX_PARTICLE_COUNT 16777216
 
+/// smallest hash table, large enough that the 5x5 cells around a particle never share a hash
+#define MIN_CELL_COUNT 65536
+
+/// when 1 the solver counts neighbour candidates that came from a different cell with the same hash
+#define COUNT_ALIASES 0
+
+/// when 1 the density pass counts the neighbour candidates it visits, what Stats::neighbours averages
+#define COUNT_NEIGHBOURS 0
+
+/// when 1 adder clamps particles to the bounds of their scene
+#define BOUNDS 1
+
+/// neighbours each particle's list has room for at first, grows once a particle has more
+#define NEIGHBOUR_CAPACITY 32
+
+/// bits of the hash sorted per radix pass
+#define RADIX_BITS 8
+
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+#define RADIX_MASK (RADIX_SIZE - 1)
+
+/// marks a particle that changed cell since the last sort, above any hash the cell table can hold
+#define RESORT_SHIFT 30
+
+#define RESORT_FLAG (1 << RESORT_SHIFT)
+
+/// work-items per group in the sort kernels, also the size of their local tiles
+#define RADIX_GROUP_SIZE 128
+
+/// upper bound on work-groups per pass, sizes the histogram buffer
+#define RADIX_MAX_GROUPS 256
+
+/// local sizes the particle kernels aim for, rounded to what the device prefers
+#define DENSITY_GROUP_SIZE 64
+
+#define FORCE_GROUP_SIZE 64
+
+#define ADDER_GROUP_SIZE 64
+
+#define SETTLE_GROUP_SIZE 64
+
+/// kernel variants built with constants an OpenCL backend keeps, besides the one that takes everything as arguments
+#define KERNEL_VARIANTS 4
+
 #endif /* settings_h */
@@ -1,132 +1,398 @@
 #include "common.cl"
 
-kernel void solver(global const float2 *A, const float dt, const float2 g, global const float2 *P, global const Proxy* proxies, global const int* list, const int count, const float D, global float2* R, global float* weights) {
+/// what a weight sum turns into, capped so the pressure cannot push a particle further than D in one substep
+inline float pressure_weight(float weight, float D, float sdt) {
+    const float mp = 0.25f * D * D / (sdt * sdt);
+    return min(mp, 0.05f * max(weight - 1.0f, 0.0f));
+}
+
+/// pressure and viscosity from a neighbour at diff, closer than D, vd is its velocity relative to the particle
+inline float2 pair_force(float2 diff, float ds, float2 vd, float h, float D, float sdt) {
+    float dr = sqrt(ds);
+    float w = 1.0f - dr/D;
+    float2 n = diff / dr;
+    float2 accel = -(64.0f * w * h / D) * n;
+    
+    float vn = dot(vd, n);
+    
+    if(vn < 0.0f)
+        accel += (0.25f * max(w, min(-(sdt / D) * vn, 0.5f)) * vn / sdt) * n;
+    
+    return accel;
+}
+
+/**
+ * the density pass has to finish for every particle before any force is computed,
+ * so the two passes are separate kernels enqueued back to back
+ * with L a dead particle waiting to be removed is no one's neighbour, in these and the list kernels
+ */
+
+kernel void density(global const float2 *P, global const Proxy* proxies, global const int2* list, const int count, const float diameter, const float dt, global float* weights, const int cells, global const Scene* scenes, global const int* S, global int* aliases, global const int* activity, const int stamp, const int sleepSteps, global int* motion, global const float* L) {
     int i = get_global_id(0);
     
+    const float D = DIAMETER(diameter);
+    
+    if(i >= count) return;
+    
+    const Scene s = scene_of(scenes, S, i);
+    
+    const float sdt = dt * s.timeScale;
+    
     const float2 p = P[i];
-    const float2 v = A[i];
     
-    int px = (int)(p.x / D);
-    int py = (int)(p.y / D);
+    const int2 c = home_cell(p, s.lower, s.size, D);
     
-    const float D2 = D * D;
+    if(deeply_asleep(activity, c, s, cells, stamp, sleepSteps)) return;
     
-    const float cv2 = D2 / (dt * dt);
-    const float mp = cv2 * 0.25f;
+    const float D2 = D * D;
     
     int j, hh;
-    float2 jp, diff, jv, vd, n;
-    float ds, dr, w, h;
+    int2 range, nc;
+    float2 jp, diff;
+    float ds;
     
     float weight = 0.0f;
     
+#if COUNT_ALIASES
+    int aliased = 0;
+#endif
+
+#if COUNT_NEIGHBOURS
+    /// the particle itself is among them
+    int visited = -1;
+#endif
+    
     for(int x = -1; x <= 1; ++x) {
         for(int y = -1; y <= 1; ++y) {
-            hh = map(px + x, py + y);
+            nc = c + (int2)(x, y);
+            hh = scene_map(nc, s, cells);
             
-            j = list[hh];
+            if(hh < 0) continue;
             
-            if(j < 0) continue;
+            range = list[hh];
             
-            while(j < count) {
+#if COUNT_NEIGHBOURS
+            visited += range.y - range.x;
+#endif
+            
+            for(j = range.x; j < range.y; ++j) {
                 Proxy cell = proxies[j];
                 
-                if(cell.hash != hh) {
-                    break;
-                }
-                
-                if(cell.index == i) {
-                    ++j;
+                if(cell.index == i || dead(L, cell.index)) {
                     continue;
                 }
                 
                 jp = P[cell.index];
                 
+#if COUNT_ALIASES
+                int2 jc = home_cell(jp, s.lower, s.size, D);
+                if(jc.x != nc.x || jc.y != nc.y) ++aliased;
+#endif
+                
                 diff = jp - p;
                 ds = diff.x * diff.x + diff.y * diff.y;
-                if(ds < D2) {
-                    dr = sqrt(ds);
-                    weight += 1.0f - dr/D;
-                }
-                ++j;
+                if(ds < D2)
+                    weight += 1.0f - sqrt(ds)/D;
             }
         }
     }
     
-    weight = min(mp, 0.05f * max(weight - 1.0f, 0.0f));
+    weights[i] = pressure_weight(weight, D, sdt);
     
-    weights[i] = weight;
+#if COUNT_ALIASES
+    if(aliased != 0)
+        atomic_add(aliases, aliased);
+#endif
+
+#if COUNT_NEIGHBOURS
+    atomic_add(&motion[3], visited);
+#endif
+}
+
+kernel void force(global const float2 *A, const float dt, global const float2 *P, global const Proxy* proxies, global const int2* list, const int count, const float diameter, global float2* R, global const float* weights, const int cells, global const Scene* scenes, global const int* S, global int* aliases, global const int* activity, const int stamp, const int sleepSteps, global const float* L) {
+    int i = get_global_id(0);
     
-    barrier(CLK_GLOBAL_MEM_FENCE);
+    const float D = DIAMETER(diameter);
     
-    float2 accel = (float2)(0.0f, 0.0f);
+    if(i >= count) return;
+    
+    const float2 p = P[i];
+    const float2 v = A[i];
+    
+    const Scene s = scene_of(scenes, S, i);
+    
+    const float sdt = dt * s.timeScale;
     
-    float qd = dt / D;
+    const int2 c = home_cell(p, s.lower, s.size, D);
+    
+    if(asleep(activity, scene_map(c, s, cells), stamp, sleepSteps)) return;
+    
+    const float D2 = D * D;
+    
+    const float weight = weights[i];
+    
+    int j, hh;
+    int2 range, nc;
+    float2 jp, diff;
+    float ds;
+    
+#if COUNT_ALIASES
+    int aliased = 0;
+#endif
+    
+    float2 accel = (float2)(0.0f, 0.0f);
     
     for(int x = -1; x <= 1; ++x) {
         for(int y = -1; y <= 1; ++y) {
-            hh = map(px + x, py + y);
+            nc = c + (int2)(x, y);
+            hh = scene_map(nc, s, cells);
             
-            j = list[hh];
+            if(hh < 0) continue;
             
-            if(j < 0) continue;
+            range = list[hh];
             
-            while(j < count) {
+            for(j = range.x; j < range.y; ++j) {
                 Proxy cell = proxies[j];
                 
-                if(cell.hash != hh) {
-                    break;
-                }
-                
-                if(cell.index == i) {
-                    ++j;
+                if(cell.index == i || dead(L, cell.index)) {
                     continue;
                 }
                 
                 jp = P[cell.index];
                 
+#if COUNT_ALIASES
+                int2 jc = home_cell(jp, s.lower, s.size, D);
+                if(jc.x != nc.x || jc.y != nc.y) ++aliased;
+#endif
+                
                 diff = jp - p;
                 ds = diff.x * diff.x + diff.y * diff.y;
-                if(ds < D2) {
-                    dr = sqrt(ds);
-                    w = 1.0f - dr/D;
-                    h = weights[cell.index] + weight;
-                    jv = A[cell.index];
-                    vd = jv - v;
-                    n = diff / dr;
-                    accel -= (64.0f * w * h / D) * n;
-                    
-                    float vn = dot(vd, n);
-                    
-                    if(vn < 0.0f)
-                        accel += (0.25f * max(w, min(-qd * vn, 0.5f)) * vn / dt) * n;
-                }
+                if(ds < D2)
+                    accel += pair_force(diff, ds, A[cell.index] - v, weights[cell.index] + weight, D, sdt);
+            }
+        }
+    }
+    
+    R[i] = sdt * (accel + s.gravity);
+    
+#if COUNT_ALIASES
+    if(aliased != 0)
+        atomic_add(aliases, aliased);
+#endif
+}
+
+/**
+ * lists every particle closer than R to particle i, R is at most 2D so the 5x5 cells around it hold them all
+ * a list holds at most capacity of them, the longest list is recorded in state[1] when one does not fit
+ */
+kernel void neighbours(global const float2 *P, global const Proxy* proxies, global const int2* list, const int count, const float diameter, const float R, const int cells, global const Scene* scenes, global const int* S, global int* N, global int* counts, const int capacity, global int* state, global const float* L) {
+    int i = get_global_id(0);
+    
+    const float D = DIAMETER(diameter);
+    
+    if(i >= count) return;
+    
+    const Scene s = scene_of(scenes, S, i);
+    
+    const float2 p = P[i];
+    
+    const int2 c = home_cell(p, s.lower, s.size, D);
+    
+    const float R2 = R * R;
+    
+    global int* out = N + i * capacity;
+    
+    int n = 0;
+    
+    for(int x = -2; x <= 2; ++x) {
+        for(int y = -2; y <= 2; ++y) {
+            int hh = scene_map(c + (int2)(x, y), s, cells);
+            
+            if(hh < 0) continue;
+            
+            int2 range = list[hh];
+            
+            for(int j = range.x; j < range.y; ++j) {
+                int index = proxies[j].index;
+                
+                if(index == i || dead(L, index)) continue;
                 
-                ++j;
+                float2 diff = P[index] - p;
+                
+                if(dot(diff, diff) < R2) {
+                    if(n < capacity)
+                        out[n] = index;
+                    ++n;
+                }
             }
         }
     }
     
-    R[i] = dt * (accel + g);
+    counts[i] = min(n, capacity);
+    
+    if(n > capacity)
+        atomic_max(state + 1, n);
+}
+
+/// density over the neighbour lists instead of the cells
+kernel void listDensity(global const float2 *P, global const int* N, global const int* counts, const int capacity, const int count, const float diameter, const float dt, global float* weights, global const Scene* scenes, global const int* S, global int* motion, global const float* L) {
+    int i = get_global_id(0);
+    
+    const float D = DIAMETER(diameter);
+    
+    if(i >= count) return;
+    
+    const float sdt = dt * scene_of(scenes, S, i).timeScale;
+    
+    const float2 p = P[i];
+    
+    const float D2 = D * D;
+    
+    global const int* list = N + i * capacity;
+    const int n = counts[i];
+    
+    float weight = 0.0f;
+    
+    for(int k = 0; k < n; ++k) {
+        if(dead(L, list[k])) continue;
+        
+        float2 diff = P[list[k]] - p;
+        float ds = dot(diff, diff);
+        if(ds < D2)
+            weight += 1.0f - sqrt(ds)/D;
+    }
+    
+    weights[i] = pressure_weight(weight, D, sdt);
+    
+#if COUNT_NEIGHBOURS
+    atomic_add(&motion[3], n);
+#endif
 }
 
-kernel void adder(global float2 *A, global float2 *B, global const float2* C, const float dt, const float D) {
+/// force over the neighbour lists instead of the cells
+kernel void listForce(global const float2 *A, const float dt, global const float2 *P, global const int* N, global const int* counts, const int capacity, const int count, const float diameter, global float2* R, global const float* weights, global const Scene* scenes, global const int* S, global const float* L) {
     int i = get_global_id(0);
-    A[i] += C[i];
+    
+    const float D = DIAMETER(diameter);
+    
+    if(i >= count) return;
+    
+    const Scene s = scene_of(scenes, S, i);
+    
+    const float sdt = dt * s.timeScale;
+    
+    const float2 p = P[i];
+    const float2 v = A[i];
     
     const float D2 = D * D;
     
-    const float cv2 = D2 / (dt * dt);
+    const float weight = weights[i];
+    
+    global const int* list = N + i * capacity;
+    const int n = counts[i];
+    
+    float2 accel = (float2)(0.0f, 0.0f);
+    
+    for(int k = 0; k < n; ++k) {
+        int j = list[k];
+        
+        if(dead(L, j)) continue;
+        
+        float2 diff = P[j] - p;
+        float ds = dot(diff, diff);
+        if(ds < D2)
+            accel += pair_force(diff, ds, A[j] - v, weights[j] + weight, D, sdt);
+    }
+    
+    R[i] = sdt * (accel + s.gravity);
+}
+
+/// a particle that died in the given step stops, with -step as its life, until the host has counted it in motion[5] and a step removes it
+inline void die(global float* L, int i, int step, global int* motion) {
+    L[i] = -(float)step;
+    atomic_inc(motion + 5);
+}
+
+/**
+ * when the neighbour lists are in use, N holds where each particle was when they were built,
+ * and state[0] the largest squared distance any particle has moved from there, as the bits of a float
+ * non-negative floats order like their bits, so atomic_max on them works
+ * with L the lifetimes left run down, sleeping or not, and particles in a sink die
+ */
+kernel void adder(global float2 *A, global float2 *B, global const float2* C, const float dt, const float diameter, const int count, global const Scene* scenes, global const int* S, global const float2* N, global int* state, global int* motion, global const float* F, const int cells, global const int* activity, global int* marks, const int stamp, const int sleepSteps, const float sleepSpeed, const float sleepAcceleration, global float* L, const int step) {
+    int i = get_global_id(0);
+    
+    const float D = DIAMETER(diameter);
+    
+    if(i >= count) return;
+    
+    const Scene s = scene_of(scenes, S, i);
+    
+    const float sdt = dt * s.timeScale;
+    const float2 lowerBound = s.lower;
+    const float2 upperBound = s.upper;
+    
+    /// the cell the particle was filed under this substep
+    const int2 c = home_cell(B[i], lowerBound, s.size, D);
+    
+    if(L != 0) {
+        if(L[i] <= 0.0f) return;
+        
+        L[i] -= sdt;
+        
+        if(L[i] <= 0.0f) {
+            die(L, i, step, motion);
+            return;
+        }
+    }
+    
+    if(asleep(activity, scene_map(c, s, cells), stamp, sleepSteps)) return;
+    
+    const float2 dv = C[i];
+    
+    A[i] += dv;
+    
+    const float D2 = D * D;
+    
+    const float cv2 = D2 / (sdt * sdt);
     
     float v2 = dot(A[i], A[i]);
+    
+    /// before the clamp, so the next step can take enough substeps that it does not have to
+    const float ts2 = s.timeScale * s.timeScale;
+    const float speed2 = v2 * ts2;
+    const float accel2 = dot(dv, dv) * ts2 / (dt * dt);
+    
+    if(speed2 > as_float(motion[0]))
+        atomic_max(motion, as_int(speed2));
+    
+    if(accel2 > as_float(motion[1]))
+        atomic_max(motion + 1, as_int(accel2));
+    
+    if(sleepSteps > 0 && (speed2 > sleepSpeed * sleepSpeed || accel2 > sleepAcceleration * sleepAcceleration))
+        wake(marks, c, s, cells, stamp);
+    
     if(v2 > cv2) {
         A[i] *= sqrt(cv2 / v2);
     }
     
-    B[i] += A[i] * dt;
+    B[i] += A[i] * sdt;
     
-    float2 lowerBound = (float2)(-5.0f, -3.0f);
-    float2 upperBound = (float2)(5.0f, 3.0f);
+    /// out of the obstacles, and the velocity into them removed
+    if(s.field >= 0) {
+        float2 n;
+        float d = field_distance(F + s.field, s.fieldSize, s.fieldSpacing, B[i] - lowerBound, &n);
+        float n2 = dot(n, n);
+        
+        if(d < 0.0f && n2 > 0.0f) {
+            n *= rsqrt(n2);
+            B[i] -= d * n;
+            
+            float vn = dot(A[i], n);
+            if(vn < 0.0f)
+                A[i] -= vn * n;
+        }
+    }
     
 #if BOUNDS
     if(B[i].x < lowerBound.x) {
@@ -149,4 +415,48 @@ kernel void adder(global float2 *A, global float2 *B, global const float2* C, co
         B[i].y = upperBound.y;
     }
 #endif
+    
+    if(N != 0) {
+        float2 d = B[i] - N[i];
+        float d2 = dot(d, d);
+        
+        if(d2 > as_float(state[0]))
+            atomic_max(state, as_int(d2));
+    }
+    
+    if(L != 0 && s.sink >= 0) {
+        float2 n;
+        if(field_distance(F + s.sink, s.fieldSize, s.fieldSpacing, B[i] - lowerBound, &n) < 0.0f)
+            die(L, i, step, motion);
+    }
+}
+
+/**
+ * runs over the cell table after the adder, adds the particles of the slots that slept through the substep to motion[2]
+ * and folds the marks the adder left into activity, which the next substep reads
+ */
+kernel void settle(global int* activity, global const int* marks, global const int2* list, const int cells, const int stamp, const int sleepSteps, global int* motion) {
+    int c = get_global_id(0);
+    
+    local int sleeping;
+    
+    if(get_local_id(0) == 0)
+        sleeping = 0;
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    if(c < cells) {
+        if(asleep(activity, c, stamp, sleepSteps)) {
+            int2 range = list[c];
+            if(range.y > range.x)
+                atomic_add(&sleeping, range.y - range.x);
+        }
+        
+        activity[c] = max(activity[c], marks[c]);
+    }
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    if(get_local_id(0) == 0 && sleeping != 0)
+        atomic_add(motion + 2, sleeping);
 }
@@ -1,21 +1,277 @@
 #include "common.cl"
 
-kernel void sort(global const Proxy *A, global Proxy *B, const int p, const int N) {
-    local uint count[0x100];
+/**
+ * each work-group owns a contiguous chunk of the proxies
+ * histograms are stored digit-major, so one exclusive scan over them
+ * gives every group its stable starting offset for every digit
+ * with tail only the last tail[0] of the N proxies are sorted, a count the host never reads
+ */
+
+inline int chunk_size(int N, int groups) {
+    return (N + groups - 1) / groups;
+}
+
+inline int tail_start(global const int *tail, int N) {
+    return tail != 0 ? N - tail[0] : 0;
+}
+
+kernel void histogram(global const Proxy *A, global uint *H, const int p, const int N, global const int *tail) {
+    local uint count[RADIX_SIZE];
+    
+    int lid = get_local_id(0);
+    int ls = get_local_size(0);
+    int g = get_group_id(0);
+    int groups = get_num_groups(0);
     
-    for(int i = 0; i < 0x100; ++i) {
+    for(int i = lid; i < RADIX_SIZE; i += ls) {
         count[i] = 0;
     }
     
-    for(int i = 0; i < N; ++i) {
-        ++count[(A[i].hash >> p) & 0xff];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    int first = tail_start(tail, N);
+    int chunk = chunk_size(N - first, groups);
+    int begin = first + g * chunk;
+    int end = min(begin + chunk, N);
+    
+    for(int i = begin + lid; i < end; i += ls) {
+        atomic_inc(&count[(A[i].hash >> p) & RADIX_MASK]);
+    }
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    for(int i = lid; i < RADIX_SIZE; i += ls) {
+        H[i * groups + g] = count[i];
+    }
+}
+
+/// exclusive scan of H, run as a single work-group
+kernel void scan(global uint *H, const int n) {
+    local uint sums[RADIX_GROUP_SIZE];
+    
+    int lid = get_local_id(0);
+    int ls = get_local_size(0);
+    
+    int segment = (n + ls - 1) / ls;
+    int begin = min(lid * segment, n);
+    int end = min(begin + segment, n);
+    
+    uint sum = 0;
+    for(int i = begin; i < end; ++i) {
+        uint c = H[i];
+        H[i] = sum;
+        sum += c;
+    }
+    
+    sums[lid] = sum;
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    if(lid == 0) {
+        sum = 0;
+        for(int i = 0; i < ls; ++i) {
+            uint c = sums[i];
+            sums[i] = sum;
+            sum += c;
+        }
+    }
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    sum = sums[lid];
+    for(int i = begin; i < end; ++i) {
+        H[i] += sum;
+    }
+}
+
+/**
+ * the chunk is walked in tiles of one proxy per work-item
+ * a proxy's rank inside the tile is the number of earlier work-items with the same digit,
+ * which keeps the scatter stable
+ */
+kernel void scatter(global const Proxy *A, global Proxy *B, global const uint *H, const int p, const int N, global const int *tail) {
+    local uint offsets[RADIX_SIZE];
+    local int digits[RADIX_GROUP_SIZE];
+    
+    int lid = get_local_id(0);
+    int ls = get_local_size(0);
+    int g = get_group_id(0);
+    int groups = get_num_groups(0);
+    
+    int first = tail_start(tail, N);
+    
+    for(int i = lid; i < RADIX_SIZE; i += ls) {
+        offsets[i] = first + H[i * groups + g];
+    }
+    
+    int chunk = chunk_size(N - first, groups);
+    int begin = first + g * chunk;
+    int end = min(begin + chunk, N);
+    
+    for(int k = begin; k < end; k += ls) {
+        int i = k + lid;
+        
+        Proxy q;
+        int d = RADIX_SIZE;
+        
+        if(i < end) {
+            q = A[i];
+            d = (q.hash >> p) & RADIX_MASK;
+        }
+        
+        digits[lid] = d;
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        int before = 0;
+        int after = 0;
+        
+        for(int j = 0; j < ls; ++j) {
+            if(digits[j] == d) {
+                if(j < lid) ++before;
+                if(j > lid) ++after;
+            }
+        }
+        
+        if(d != RADIX_SIZE) {
+            B[offsets[d] + before] = q;
+        }
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        /// the last work-item of each digit advances it for the next tile
+        if(d != RADIX_SIZE && after == 0) {
+            offsets[d] += before + 1;
+        }
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
+}
+
+/**
+ * merges the proxies that did not change cell, A[0, N - moved[0]), with the sorted ones that did after them, into B
+ * every work-item finds how many of the first run come before its slot along the merge path,
+ * ties go to the first run, so a cell keeps the particles it had ahead of those that came in
+ */
+kernel void merge(global const Proxy *A, global Proxy *B, const int N, global const int *moved) {
+    int k = get_global_id(0);
+    
+    if(k >= N) return;
+    
+    int m = moved[0];
+    int s = N - m;
+    
+    int lo = max(0, k - m);
+    int hi = min(k, s);
+    
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        
+        if(A[mid].hash <= (A[s + k - 1 - mid].hash & ~RESORT_FLAG))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    int i = lo;
+    int j = s + k - lo;
+    
+    Proxy q = j >= N || (i < s && A[i].hash <= (A[j].hash & ~RESORT_FLAG)) ? A[i] : A[j];
+    q.hash &= ~RESORT_FLAG;
+    
+    B[k] = q;
+}
+
+/// a particle stays unless it died in a step up to last, one that died since has not been counted by the host yet
+inline bool survives(float life, int last) {
+    return life > 0.0f || life < -(float)last;
+}
+
+/// the particles of each group's chunk that survive into H[g], scan turns them into where the group writes
+kernel void tally(global const float *L, global uint *H, const int N, const int last) {
+    local uint count;
+    
+    int lid = get_local_id(0);
+    int ls = get_local_size(0);
+    int g = get_group_id(0);
+    
+    if(lid == 0)
+        count = 0;
     
-    for(int i = 1; i < 0x100; ++i) {
-        count[i] += count[i - 1];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    int chunk = chunk_size(N, get_num_groups(0));
+    int begin = g * chunk;
+    int end = min(begin + chunk, N);
+    
+    uint n = 0;
+    for(int i = begin + lid; i < end; i += ls) {
+        if(survives(L[i], last))
+            ++n;
     }
     
-    for(int i = N - 1; i != -1; --i) {
-        B[--count[(A[i].hash >> p) & 0xff]] = A[i];
+    if(n != 0)
+        atomic_add(&count, n);
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    if(lid == 0)
+        H[g] = count;
+}
+
+/**
+ * moves the survivors to the front of the second set of buffers, in the order they were in, and their number into motion[6]
+ * walked in tiles like scatter, a particle's place in the tile is the survivors of the work-items before it
+ */
+kernel void compact(global const float2 *P, global const float2 *V, global const int *I, global const int *S, global const float *L, global float2 *P2, global float2 *V2, global int *I2, global int *S2, global float *L2, global const uint *H, const int N, const int last, global int *motion) {
+    local int keeps[RADIX_GROUP_SIZE];
+    local uint offset;
+    
+    int lid = get_local_id(0);
+    int ls = get_local_size(0);
+    int g = get_group_id(0);
+    
+    if(lid == 0)
+        offset = H[g];
+    
+    int chunk = chunk_size(N, get_num_groups(0));
+    int begin = g * chunk;
+    int end = min(begin + chunk, N);
+    
+    for(int k = begin; k < end; k += ls) {
+        int i = k + lid;
+        int keep = i < end && survives(L[i], last);
+        
+        keeps[lid] = keep;
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        uint o = offset;
+        int before = 0;
+        int all = 0;
+        
+        for(int j = 0; j < ls; ++j) {
+            before += j < lid ? keeps[j] : 0;
+            all += keeps[j];
+        }
+        
+        if(keep) {
+            P2[o + before] = P[i];
+            V2[o + before] = V[i];
+            I2[o + before] = I[i];
+            S2[o + before] = S[i];
+            L2[o + before] = L[i];
+        }
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        if(lid == 0)
+            offset += all;
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
+    
+    /// the last group ends where every survivor has been written, what the host checks its count against
+    if(lid == 0 && g == get_num_groups(0) - 1)
+        motion[6] = offset;
 }
@@ -1,8 +1,17 @@
 #include "common.cl"
 
-kernel void toList(global const Proxy *A, global int *B) {
+/**
+ * B holds a [start, end) pair per cell, read as int2 by the solver
+ * start and end of one cell may be written by different work-items,
+ * so they are stored as separate ints
+ */
+kernel void toList(global const Proxy *A, global int *B, const int N) {
     int i = get_global_id(0);
     Proxy p = A[i];
+    
     if(i == 0 || A[i - 1].hash != p.hash)
-        B[p.hash] = i;
+        B[2 * p.hash] = i;
+    
+    if(i == N - 1 || A[i + 1].hash != p.hash)
+        B[2 * p.hash + 1] = i + 1;
 }